@@ -13,6 +13,44 @@
 #include <linux/atomic.h>
 #include <linux/limits.h>
 #include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/err.h>
+#include <linux/mm.h>
+#include <linux/namei.h>
+#include <linux/minmax.h>
+#include <linux/wait.h>
+#include <linux/jiffies.h>
+#include <linux/preempt.h>
+#include <linux/uio.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/shrinker.h>
+#include <linux/miscdevice.h>
+#include <linux/build_bug.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/poll.h>
+#include <linux/capability.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/shmem_fs.h>
+#include <linux/pagemap.h>
+#include <linux/fcntl.h>
+#include <linux/cred.h>
+#include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/rcupdate.h>
+#include <linux/overflow.h>
+#include <linux/fsnotify.h>
+
+#include "test_module.h"
+#include "test_module_uapi.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Golchanskiy Maxim");
@@ -21,30 +59,552 @@ MODULE_DESCRIPTION("Kernel module that writes messages to a file periodically");
 #define MAX_PATH_LEN (PATH_MAX - 1)
 #define MAX_PERIOD 3600
 #define MIN_PERIOD 1
+#define TM_MAX_PRODUCERS 32
+/* Доля времени writer'а, которую допускается тратить на I/O: 1/TM_FLUSH_DUTY */
+#define TM_FLUSH_DUTY 10
+/* Буферы потока нарезаны на слоты фиксированного размера, запись занимает несколько подряд */
+#define TM_SLOT_SIZE 64
+#define TM_MAX_RECORD_LEN 4096
+#define TM_MAX_BUFFERS 4
+#define TM_MIN_BUFFER_KB 64
+/* Резерв должен вмещать запись максимального размера */
+#define TM_MIN_RESERVE_KB 8
+#define TM_MAX_BUFFER_KB 65536
+#define TM_MAX_IOV UIO_MAXIOV
+#define TM_MAX_RECENT 4096
+#define TM_MAX_IO_DEPTH 16
+#define TM_MAX_SHM_KB 262144
+#define TM_MAX_READERS 16
+#define TM_FILTER_MAX_RULES 16
+#define TM_FILTER_PREFIX_MAX 32
+#define TM_FILTER_RULES_LEN 1024
+
+/* head потока: индекс активного буфера в старших 32 битах, занятые слоты - в младших */
+#define TM_HEAD(buf, slot) (((s64)(buf) << 32) | (slot))
+#define TM_HEAD_BUF(head) ((unsigned int)((u64)(head) >> 32))
+#define TM_HEAD_SLOT(head) ((unsigned int)(head))
+/* Слот припаркованного head: буфер выглядит заполненным, пока writer меняет память потока */
+#define TM_HEAD_PARKED 0x7fffffffU
+
+/*
+ * При nr_shards > 1 каждая запись начинается с "<seq> <realtime ns> " в
+ * hex фиксированной ширины: seq общий для всех шардов потока, по нему
+ * tm_merge восстанавливает порядок.
+ */
+#define TM_SHARD_HDR_LEN 34
 
 static char *filename = "/var/tmp/test_module/kernel_log.txt";
 module_param(filename, charp, 0644);
 MODULE_PARM_DESC(filename, "Path to the log file");
 
+/* Параметр объявлен рядом с tm_stream_rearm(): запись в него перевзводит тики */
 static unsigned int timer_period = 5;
-module_param(timer_period, uint, 0644);
-MODULE_PARM_DESC(timer_period, "Timer period in seconds (1-3600)");
 
-struct write_work {
+static unsigned int nr_streams = 1;
+module_param(nr_streams, uint, 0444);
+MODULE_PARM_DESC(nr_streams, "Number of output streams (1-8), stream N > 0 writes to <filename>.N");
+
+static bool timer_deferrable[TM_MAX_STREAMS];
+module_param_array(timer_deferrable, bool, NULL, 0644);
+MODULE_PARM_DESC(timer_deferrable, "Per-stream deferrable, second-aligned timer instead of the precise one (power saving)");
+
+static bool process_ticks;
+module_param(process_ticks, bool, 0644);
+MODULE_PARM_DESC(process_ticks, "Produce heartbeat records from a delayed work (process context) instead of a timer (softirq)");
+
+static unsigned int backpressure_ms = 100;
+module_param(backpressure_ms, uint, 0644);
+MODULE_PARM_DESC(backpressure_ms, "How long process-context producers wait for writer when buffers are full, ms");
+
+static unsigned int stream_rate[TM_MAX_STREAMS];
+module_param_array(stream_rate, uint, NULL, 0644);
+MODULE_PARM_DESC(stream_rate, "Per-stream rate limit in records per second (0 - unlimited)");
+
+static unsigned int stream_burst[TM_MAX_STREAMS] = {
+    [0 ... TM_MAX_STREAMS - 1] = 100
+};
+module_param_array(stream_burst, uint, NULL, 0644);
+MODULE_PARM_DESC(stream_burst, "Per-stream burst size in records");
+
+static unsigned int producer_rate;
+module_param(producer_rate, uint, 0644);
+MODULE_PARM_DESC(producer_rate, "Per-producer rate limit in records per second (0 - unlimited)");
+
+static unsigned int producer_burst = 10;
+module_param(producer_burst, uint, 0644);
+MODULE_PARM_DESC(producer_burst, "Per-producer burst size in records");
+
+static unsigned int ratelimit_sample;
+module_param(ratelimit_sample, uint, 0644);
+MODULE_PARM_DESC(ratelimit_sample, "Keep every Nth over-limit record instead of dropping it (0 - drop all)");
+
+static unsigned int nr_shards = 1;
+module_param(nr_shards, uint, 0444);
+MODULE_PARM_DESC(nr_shards, "Files per stream, each with its own writer (nr_streams * nr_shards <= 8); "
+                 "shard J > 0 writes to <stream file>.shardJ");
+
+static bool shard_by_cpu = true;
+module_param(shard_by_cpu, bool, 0644);
+MODULE_PARM_DESC(shard_by_cpu, "Pick the shard by CPU (Y) or by producer (N)");
+
+static unsigned int buffer_kb = 1024;
+module_param(buffer_kb, uint, 0444);
+MODULE_PARM_DESC(buffer_kb, "Size of each per-stream record buffer, KiB (64-65536)");
+
+static unsigned int nr_buffers = 2;
+module_param(nr_buffers, uint, 0444);
+MODULE_PARM_DESC(nr_buffers, "Buffers per stream: producers fill one while the others are written (2-4)");
+
+static int ring_node[TM_MAX_STREAMS] = { [0 ... TM_MAX_STREAMS - 1] = NUMA_NO_NODE };
+module_param_array(ring_node, int, NULL, 0444);
+MODULE_PARM_DESC(ring_node, "NUMA node of each stream's buffers (-1 - node of the CPU loading the module)");
+
+static bool ring_contig = true;
+module_param(ring_contig, bool, 0444);
+MODULE_PARM_DESC(ring_contig, "Try physically contiguous buffers (stats reports their allocation order as ring_order, -1 - vmalloc)");
+
+static unsigned int reserve_kb = 16;
+module_param(reserve_kb, uint, 0444);
+MODULE_PARM_DESC(reserve_kb, "Size of each buffer an idle stream keeps after its memory is reclaimed, KiB");
+
+static unsigned int shrink_idle_s = 10;
+module_param(shrink_idle_s, uint, 0644);
+MODULE_PARM_DESC(shrink_idle_s, "Stream without bulk output for this long gives its buffers back under memory pressure, s (0 - never)");
+
+static unsigned int recent_records = 64;
+module_param(recent_records, uint, 0444);
+MODULE_PARM_DESC(recent_records, "Last records kept in memory per stream for /proc/test_module/recent (0-4096)");
+
+static unsigned int reader_ring_kb;
+module_param(reader_ring_kb, uint, 0444);
+MODULE_PARM_DESC(reader_ring_kb, "Record ring shared by " TM_LOG_DEVICE_PATH " readers, KiB: a reader lagging by more is detached (0 - disabled)");
+
+static unsigned int mem_budget_kb = 0;
+module_param(mem_budget_kb, uint, 0644);
+MODULE_PARM_DESC(mem_budget_kb, "Memory budget of the module, KiB: above it records overflow (0 - unlimited)");
+
+static unsigned int flush_min_bytes = 4096;
+module_param(flush_min_bytes, uint, 0644);
+MODULE_PARM_DESC(flush_min_bytes, "Lower bound of the adaptive batch size, bytes");
+
+static unsigned int flush_max_bytes = 1024 * 1024;
+module_param(flush_max_bytes, uint, 0644);
+MODULE_PARM_DESC(flush_max_bytes, "Upper bound of the adaptive batch size, bytes");
+
+static unsigned int flush_min_ms = 10;
+module_param(flush_min_ms, uint, 0644);
+MODULE_PARM_DESC(flush_min_ms, "Lower bound of the adaptive flush deadline, ms");
+
+static unsigned int flush_max_ms = 1000;
+module_param(flush_max_ms, uint, 0644);
+MODULE_PARM_DESC(flush_max_ms, "Upper bound of the adaptive flush deadline, ms");
+
+static unsigned int flush_target_us = 5000;
+module_param(flush_target_us, uint, 0644);
+MODULE_PARM_DESC(flush_target_us, "Target write+fsync latency of one batch, us");
+
+static bool flush_fsync;
+module_param(flush_fsync, bool, 0644);
+MODULE_PARM_DESC(flush_fsync, "Call fdatasync after every batch");
+
+static bool write_vectored = true;
+module_param(write_vectored, bool, 0644);
+MODULE_PARM_DESC(write_vectored, "Write batches straight from record slots via iov_iter instead of copying into one buffer");
+
+static char *bdev_path;
+module_param(bdev_path, charp, 0444);
+MODULE_PARM_DESC(bdev_path, "Block device to use as a raw circular log instead of files (its contents are overwritten)");
+
+static unsigned int bdev_segment_kb = 1024;
+module_param(bdev_segment_kb, uint, 0444);
+MODULE_PARM_DESC(bdev_segment_kb, "Segment size of the block-device log in KiB (16-1024)");
+
+static unsigned int shm_kb;
+module_param(shm_kb, uint, 0444);
+MODULE_PARM_DESC(shm_kb, "Keep the log in a shared-memory ring of this many KiB per stream instead of files (0 - disabled)");
+
+static unsigned int io_depth;
+module_param(io_depth, uint, 0644);
+MODULE_PARM_DESC(io_depth, "Batch writes in flight per stream on the test_module_io workqueue (0 - writes from the flush worker, max 16)");
+
+/*
+ * Token bucket в форме GCRA: состояние - одно атомарное значение
+ * (теоретическое время прихода следующей записи, нс), которое обновляется
+ * через cmpxchg без блокировок. Эквивалентно ведру на burst токенов,
+ * пополняемому со скоростью rate в секунду.
+ */
+struct tm_bucket {
+    atomic64_t tat;
+};
+
+struct tm_counters {
+    atomic64_t accepted;
+    atomic64_t dropped;
+    atomic64_t sampled;
+    atomic64_t filtered;
+};
+
+/* Классы аллокаций для учета памяти */
+enum tm_mem_class {
+    TM_MEM_WORK,    /* асинхронные запросы записи */
+    TM_MEM_RECORDS, /* ring и резервные буферы записей */
+    TM_MEM_CONFIG,  /* копии путей, состояние модуля и отображаемые страницы */
+    TM_MEM_SINK,    /* буферы writer'а */
+    TM_MEM_NR,
+};
+
+static const char * const tm_mem_names[TM_MEM_NR] = {
+    [TM_MEM_WORK] = "work",
+    [TM_MEM_RECORDS] = "records",
+    [TM_MEM_CONFIG] = "config",
+    [TM_MEM_SINK] = "sink",
+};
+
+struct tm_mem {
+    atomic64_t live[TM_MEM_NR];
+    atomic64_t peak[TM_MEM_NR];
+    atomic64_t total;
+    atomic64_t total_peak;
+};
+
+enum tm_verdict {
+    TM_PASS,
+    TM_SAMPLED,
+    TM_DROP,
+};
+
+struct test_module_state;
+
+struct tm_record {
+    u32 len;
+    u32 slots;
+    char data[];
+};
+
+/*
+ * Копия записи для /proc/test_module/recent, длинные записи обрезаются.
+ * version - seqcount слота: 2 * seq + 1, пока запись seq копируется,
+ * 2 * seq + 2 - когда она готова.
+ */
+struct tm_recent {
+    atomic64_t version;
+    u64 seq;
+    unsigned int stream;
+    unsigned int len;
+    char data[232];
+};
+
+/* Позиция читателя /proc/test_module/recent между вызовами read() */
+struct tm_recent_iter {
+    /* Следующая запись: поток, ее номер в нем и позиция seq_file */
+    unsigned int stream;
+    u64 seq;
+    loff_t pos;
+    /* recent_seq потока, когда чтение до него дошло: дальше не читаем */
+    u64 end;
+    struct tm_recent entry;
+};
+
+/*
+ * Один из буферов потока. Producer'ы резервируют слоты атомарным сдвигом
+ * head и отмечают готовность в committed; writer получает буфер целиком
+ * после обмена head и не пересекается с producer'ами по памяти.
+ */
+struct tm_buf {
+    char *slots;
+    unsigned int nr_slots;
+    unsigned int used;
+    atomic_t committed;
+    /* Ссылки writer'а и асинхронных запросов, последний освобождает буфер */
+    atomic_t io_pending;
+    bool busy;
+};
+
+/* Текущий сегмент потока в логе на блочном устройстве */
+struct tm_bdev_log {
+    /* Копия сегмента: блок заголовка и данные */
+    char *segment;
+    /* Смещение области потока на устройстве, байт */
+    u64 start;
+    u64 index;
+    u64 seq;
+    /* Байт данных в сегменте и из них уже записанных на устройство */
+    u32 used;
+    u32 synced;
+};
+
+struct tm_slot_ref {
+    struct tm_stream *stream;
+    struct tm_buf *buf;
+    struct tm_record *record;
+    /* Куда producer пишет данные: после заголовка шарда, если он есть */
+    char *data;
+    unsigned int slot;
+};
+
+struct tm_stream {
+    struct test_module_state *state;
+    struct timer_list write_timer;
+    /* TIMER_DEFERRABLE: не будит простаивающий CPU, срабатывает с ближайшим прерыванием */
+    struct timer_list idle_timer;
+    /* То же самое в контексте процесса (process_ticks) */
+    struct delayed_work tick_work;
+    struct delayed_work idle_tick_work;
+    unsigned long expires;
+    /* Сериализует перевзвод тиков: из самого тика и при смене timer_period */
+    spinlock_t tick_lock;
+    unsigned int tick_late_us;
+    unsigned int tick_softirq_ns;
+    unsigned int tick_process_ns;
+    atomic_t write_counter;
+    struct tm_bucket bucket;
+    struct tm_counters counters;
+    atomic_t over_limit;
+    unsigned int id;
+    /* Поток, шардом которого является этот (сам поток для шарда 0) */
+    struct tm_stream *parent;
+    unsigned int shard;
+    /* Сквозной номер записей всех шардов, используется у parent */
+    atomic64_t shard_seq;
+
+    /* Двойная (N-кратная) буферизация записей между producer'ами и writer'ом */
+    atomic64_t head;
+    struct tm_buf bufs[TM_MAX_BUFFERS];
+    unsigned int nr_bufs;
+    char *ring;
+    size_t ring_size;
+    /* Порядок непрерывной аллокации, -1 - ring из vmalloc */
+    int ring_order;
+    int ring_nid;
+    /* Малые буферы, на которые поток переходит после отдачи ring shrinker'у */
+    char *reserve;
+    bool shrunk;
+    /* Время последнего сброса, не поместившегося бы в резерв */
+    unsigned long last_busy;
+    struct tm_mem mem;
+    /* Сериализует writer и shrinker при замене памяти потока */
+    struct mutex ring_lock;
+    struct delayed_work flush_work;
+    wait_queue_head_t space_wait;
+
+    /* Состояние writer'а, используется только из flush_work */
+    struct file *filp;
+    char *filp_path;
+    char *buf;
+    size_t buf_size;
+    struct kvec *iov;
+
+    /* Асинхронная запись: позиция следующего пакета и число запросов в полете */
+    loff_t write_pos;
+    /* Записи, отправленные после последнего tm_stream_io_settle() */
+    u64 io_records;
+    /*
+     * Под io_lock: начало первой недописанной записи (-1 - нет) и ее номер
+     * среди io_records; байты и записи неудачных и отмененных запросов,
+     * не попавшие в bytes_written и last_seq
+     */
+    loff_t io_fail_pos;
+    u64 io_fail_rec;
+    u64 io_lost_bytes;
+    u64 io_lost_records;
+    atomic_t io_inflight;
+    unsigned int io_peak;
+    unsigned int io_lat_us;
+    spinlock_t io_lock;
+    wait_queue_head_t io_wait;
+
+    /* Адаптивно выбранные параметры сброса */
+    unsigned int batch_bytes;
+    unsigned int deadline_ms;
+    unsigned int write_lat_us;
+    unsigned int fsync_lat_us;
+
+    atomic64_t overflow;
+    atomic64_t write_errors;
+    atomic64_t flushes;
+    atomic64_t bytes_written;
+    atomic64_t io_ns;
+
+    /* Записи, отданные sink'у: writer и асинхронные запросы */
+    atomic64_t last_seq;
+    /* Для страницы статистики: обновляются writer'ом под io_lock */
+    u64 last_write_ns;
+    u64 lat_sum_ns;
+    u64 lat_hist[TM_LAT_BUCKETS];
+
+    /* Последние recent_records записей, заполняется в tm_commit() без блокировок */
+    struct tm_recent *recent;
+    atomic64_t recent_seq;
+    /* Позиция потока в логе на блочном устройстве (bdev_path) */
+    struct tm_bdev_log *bdev_log;
+};
+
+struct tm_aio {
+    struct kiocb iocb;
     struct work_struct work;
-    char *message;
-    char *filepath;
+    struct tm_stream *stream;
+    struct tm_buf *buf;
+    struct kvec *iov;
+    unsigned int nr;
+    loff_t pos;
+    size_t len;
+    /* Номер первой записи запроса среди io_records потока */
+    u64 first_rec;
+    ktime_t submitted;
+};
+
+struct tm_producer {
+    struct tm_stream *stream;
+    struct tm_bucket bucket;
+    struct tm_counters counters;
+    unsigned int id;
+    bool in_use;
+    /* Слот освобожден, но tm_log() на другом CPU еще может его использовать */
+    bool retiring;
+    char name[TM_PRODUCER_NAME_LEN];
+};
+
+/* Правило фильтра: условия на поток и producer'а свернуты в маску producer'ов */
+struct tm_filter_rule {
+    u32 producers;
+    u8 sevs;
+    bool drop;
+    u8 prefix_len;
+    char prefix[TM_FILTER_PREFIX_MAX];
+};
+
+/* Скомпилированный параметр filter, заменяется целиком через RCU */
+struct tm_filter {
+    struct rcu_head rcu;
+    unsigned int nr_rules;
+    /* Первое правило, которое может сработать для producer'а и уровня; nr_rules - ни одно */
+    u8 first[TM_MAX_PRODUCERS][TM_SEV_NR];
+    struct tm_filter_rule rules[];
+};
+
+/* Читатель TM_LOG_DEVICE_PATH, поля под readers_lock модуля */
+struct tm_reader {
+    struct list_head node;
+    unsigned int id;
+    pid_t pid;
+    char comm[TASK_COMM_LEN];
+    /* Следующий байт для read() и граница, до которой кольцо можно перезаписывать */
+    u64 pos;
+    u64 acked;
+    /* Читатель подтверждает сам (TM_IOC_READER_ACK), а не при read() */
+    bool manual_ack;
+    bool detached;
+    u64 detach_lag;
 };
 
 struct test_module_state {
-    struct timer_list write_timer;
     struct workqueue_struct *wq;
-    atomic_t write_counter;
+    struct workqueue_struct *io_wq;
+    struct tm_stream streams[TM_MAX_STREAMS];
+    unsigned int nr_streams;
+    /* Все writer'ы: потоки 0..nr_streams-1, за ними шарды 1..nr_shards-1 каждого потока */
+    unsigned int nr_writers;
+    unsigned int nr_shards;
+    struct tm_producer producers[TM_MAX_PRODUCERS];
+    /* Также сериализует пересборку filter, маски которого зависят от producer'ов */
+    struct mutex producers_lock;
+    struct tm_filter __rcu *filter;
+    struct work_struct bench_work;
+    unsigned int bench_stream;
+    atomic_t bench_remaining;
+    /* Страницы статистики и heartbeat, отображаемые в пространство пользователя */
+    struct tm_stats_page *stats_page;
+    struct tm_heartbeat_page *heartbeat_page;
+    /* Поколение страницы статистики: read()/poll() на /dev/test_module ждут его смены */
+    atomic64_t stats_gen;
+    wait_queue_head_t stats_wait;
+    /*
+     * Поколение конфигурации, меняется только при TM_IOC_SET_PARAM: запись
+     * в файл sysfs идет в ops->set() параметра мимо модуля.
+     */
+    atomic64_t config_gen;
+    /* Кольцо записей для читателей TM_LOG_DEVICE_PATH, rd_head - байт записано всего */
+    char *rd_ring;
+    u64 rd_size;
+    u64 rd_head;
+    struct list_head readers;
+    unsigned int nr_readers;
+    /* Подключенные читатели; без них записи в кольцо не копируются */
+    unsigned int nr_attached;
+    unsigned int reader_ids;
+    atomic64_t readers_detached;
+    struct mutex readers_lock;
+    wait_queue_head_t readers_wait;
+    struct proc_dir_entry *proc_dir;
     bool module_active;
 };
 
 static struct test_module_state *module_state = NULL;
 
+/* Учет всей памяти модуля; module_state тоже учитывается, поэтому учет глобальный */
+static struct tm_mem tm_mem_global;
+static atomic64_t tm_mem_denied;
+
+static void tm_mem_max(atomic64_t *peak, s64 value)
+{
+    s64 old = atomic64_read(peak);
+
+    while (old < value && !atomic64_try_cmpxchg(peak, &old, value))
+        ;
+}
+
+static void tm_mem_add(struct tm_mem *mem, enum tm_mem_class cls, s64 bytes)
+{
+    s64 live = atomic64_add_return(bytes, &mem->live[cls]);
+    s64 total = atomic64_add_return(bytes, &mem->total);
+
+    if (bytes > 0) {
+        tm_mem_max(&mem->peak[cls], live);
+        tm_mem_max(&mem->total_peak, total);
+    }
+}
+
+static void tm_mem_charge(struct tm_stream *stream, enum tm_mem_class cls, size_t bytes)
+{
+    tm_mem_add(&tm_mem_global, cls, bytes);
+    if (stream)
+        tm_mem_add(&stream->mem, cls, bytes);
+}
+
+static void tm_mem_uncharge(struct tm_stream *stream, enum tm_mem_class cls, size_t bytes)
+{
+    tm_mem_add(&tm_mem_global, cls, -(s64)bytes);
+    if (stream)
+        tm_mem_add(&stream->mem, cls, -(s64)bytes);
+}
+
+static bool tm_mem_exceeds(size_t bytes)
+{
+    unsigned int budget = READ_ONCE(mem_budget_kb);
+
+    return budget && atomic64_read(&tm_mem_global.total) + (s64)bytes > (s64)budget * 1024;
+}
+
+/*
+ * Для необязательных аллокаций (запросы, буферы writer'а, возврат ring):
+ * без них модуль продолжает работать, поэтому бюджет они не превышают.
+ */
+static bool tm_mem_try_charge(struct tm_stream *stream, enum tm_mem_class cls, size_t bytes)
+{
+    if (tm_mem_exceeds(bytes)) {
+        atomic64_inc(&tm_mem_denied);
+        return false;
+    }
+
+    tm_mem_charge(stream, cls, bytes);
+    return true;
+}
+
+static bool tm_mem_over_budget(void)
+{
+    return tm_mem_exceeds(0);
+}
+
 static bool is_valid_path(const char *path)
 {
     size_t len;
@@ -61,12 +621,29 @@ static bool is_valid_path(const char *path)
     return true;
 }
 
+static struct file *open_log_file(const char *file_path)
+{
+    struct file *filp;
+    int ret;
+
+    filp = filp_open(file_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (IS_ERR(filp)) {
+        ret = PTR_ERR(filp);
+        pr_err("test_module: Failed to open file %s, error: %d (%s)\n", 
+               file_path, ret, 
+               ret == -ENOENT ? "ENOENT - check directory exists and permissions" :
+               ret == -EACCES ? "EACCES - permission denied" :
+               ret == -ENOSPC ? "ENOSPC - no space left" : "unknown error");
+    }
+
+    return filp;
+}
+
 static int write_to_file(const char *message, const char *filepath)
 {
     struct file *filp;
     loff_t pos;
     int ret = 0;
-    char *file_path = NULL;
     ssize_t written;
     size_t msg_len;
 
@@ -86,21 +663,9 @@ static int write_to_file(const char *message, const char *filepath)
         return 0;
     }
 
-    file_path = kstrdup(filepath, GFP_KERNEL);
-    if (!file_path) {
-        pr_err("test_module: Failed to allocate memory for file path\n");
-        return -ENOMEM;
-    }
-
-    filp = filp_open(file_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    filp = open_log_file(filepath);
     if (IS_ERR(filp)) {
-        ret = PTR_ERR(filp);
-        pr_err("test_module: Failed to open file %s, error: %d (%s)\n", 
-               file_path, ret, 
-               ret == -ENOENT ? "ENOENT - check directory exists and permissions" :
-               ret == -EACCES ? "EACCES - permission denied" :
-               ret == -ENOSPC ? "ENOSPC - no space left" : "unknown error");
-        goto out_free_path;
+        return PTR_ERR(filp);
     }
 
     pos = i_size_read(file_inode(filp));
@@ -116,209 +681,4011 @@ static int write_to_file(const char *message, const char *filepath)
 
     filp_close(filp, NULL);
 
-out_free_path:
-    kfree(file_path);
     return ret;
 }
 
-static void write_work_handler(struct work_struct *work)
+static bool tm_bucket_consume(struct tm_bucket *bucket, unsigned int rate,
+                              unsigned int burst, s64 now)
 {
-    struct write_work *w = container_of(work, struct write_work, work);
-    int ret;
+    s64 interval;
+    s64 tolerance;
+    s64 tat;
+    s64 new_tat;
 
-    if (!w->message || !w->filepath) {
-        pr_err("test_module: Invalid work parameters\n");
-        goto out;
+    if (rate == 0) {
+        return true;
     }
 
-    ret = write_to_file(w->message, w->filepath);
-    if (ret < 0) {
-        pr_err("test_module: Failed to write message to file (error: %d)\n", ret);
-    }
+    interval = div_u64(NSEC_PER_SEC, rate);
+    if (interval == 0)
+        interval = 1;
+    tolerance = interval * max(burst, 1U);
 
-out:
-    kfree(w->message);
-    kfree(w->filepath);
-    kfree(w);
+    tat = atomic64_read(&bucket->tat);
+    do {
+        new_tat = max(tat, now) + interval;
+        if (new_tat - now > tolerance) {
+            return false;
+        }
+    } while (!atomic64_try_cmpxchg(&bucket->tat, &tat, new_tat));
+
+    return true;
 }
 
-static void timer_callback(struct timer_list *t)
+/* Возвращает токен, взятый tm_bucket_consume() с тем же rate */
+static void tm_bucket_refund(struct tm_bucket *bucket, unsigned int rate)
 {
-    struct test_module_state *state;
-    struct write_work *w;
-    char *message = NULL;
-    char *filepath = NULL;
-    int len;
-    unsigned int counter;
-    unsigned long delay;
+    s64 interval;
 
-    state = container_of(t, struct test_module_state, write_timer);
-
-    if (!state || !module_state || state != module_state) {
-        pr_warn("test_module: Timer callback called with invalid state\n");
+    if (rate == 0) {
         return;
     }
 
-    if (!state->module_active) {
-        pr_warn("test_module: Timer callback called after module deactivation\n");
-        return;
-    }
+    interval = div_u64(NSEC_PER_SEC, rate);
+    atomic64_sub(interval ? interval : 1, &bucket->tat);
+}
 
-    counter = atomic_inc_return(&state->write_counter);
+static enum tm_verdict tm_ratelimit(struct tm_producer *producer)
+{
+    struct tm_stream *stream = producer->stream;
+    unsigned int rate = READ_ONCE(producer_rate);
+    s64 now = (s64)ktime_get_ns();
+    unsigned int sample;
 
-    if (counter == 0) {
-        atomic_set(&state->write_counter, 1);
-        counter = 1;
+    if (tm_bucket_consume(&producer->bucket, rate, READ_ONCE(producer_burst), now)) {
+        if (tm_bucket_consume(&stream->bucket, READ_ONCE(stream_rate[stream->id]),
+                              READ_ONCE(stream_burst[stream->id]), now)) {
+            atomic64_inc(&producer->counters.accepted);
+            atomic64_inc(&stream->counters.accepted);
+            return TM_PASS;
+        }
+        /* Запись не прошла лимит потока - не списываем ее с лимита producer'а */
+        tm_bucket_refund(&producer->bucket, rate);
     }
 
-    len = snprintf(NULL, 0, "Hello from kernel module (%u)\n", counter);
-    if (len < 0) {
-        pr_err("test_module: snprintf failed\n");
-        goto reschedule;
+    sample = READ_ONCE(ratelimit_sample);
+    if (sample && (unsigned int)atomic_inc_return(&stream->over_limit) % sample == 0) {
+        atomic64_inc(&producer->counters.sampled);
+        atomic64_inc(&stream->counters.sampled);
+        return TM_SAMPLED;
     }
 
-    w = kmalloc(sizeof(*w), GFP_ATOMIC);
-    if (!w) {
-        pr_err("test_module: Failed to allocate memory for work\n");
-        goto reschedule;
-    }
+    atomic64_inc(&producer->counters.dropped);
+    atomic64_inc(&stream->counters.dropped);
+    return TM_DROP;
+}
 
-    message = kmalloc(len + 1, GFP_ATOMIC);
-    if (!message) {
-        pr_err("test_module: Failed to allocate memory for message\n");
-        kfree(w);
-        goto reschedule;
-    }
+/*
+ * Фильтр записей (параметр filter): правила через ';', первое сработавшее
+ * решает судьбу записи, без совпадений запись пишется. Правило -
+ * "keep" или "drop" и условия через пробел, все должны выполняться:
+ *   stream=N[,N...]       поток producer'а
+ *   producer=NAME[,NAME]  имя producer'а
+ *   sev=L, sev>=L, sev<=L уровень: debug, info, warn, err
+ *   prefix=TEXT           начало записи (до 32 байт, без пробелов и ';')
+ * Например: "drop producer=bench; keep sev>=warn; drop stream=1".
+ * Условия на поток и producer'а при компиляции сворачиваются в маску
+ * зарегистрированных producer'ов, поэтому фильтр пересобирается при
+ * регистрации. Проверка записи - поиск по таблице first и сравнение
+ * масок; текст записи форматируется заранее, только если до решения
+ * дошло правило с prefix=.
+ */
+static char filter_rules[TM_FILTER_RULES_LEN];
 
-    if (!filename) {
-        pr_err("test_module: Filename parameter is NULL\n");
-        kfree(message);
-        kfree(w);
-        goto reschedule;
-    }
+enum tm_filter_verdict {
+    TM_FILTER_KEEP,
+    TM_FILTER_DROP,
+    /* Решение зависит от префикса записи */
+    TM_FILTER_TEXT,
+};
 
-    filepath = kstrdup(filename, GFP_ATOMIC);
-    if (!filepath) {
-        pr_err("test_module: Failed to allocate memory for filepath\n");
-        kfree(message);
-        kfree(w);
-        goto reschedule;
+static const char * const tm_sev_names[TM_SEV_NR] = {
+    [TM_SEV_DEBUG] = "debug",
+    [TM_SEV_INFO] = "info",
+    [TM_SEV_WARN] = "warn",
+    [TM_SEV_ERR] = "err",
+};
+
+static enum tm_filter_verdict tm_filter_match(const struct tm_filter *filter, unsigned int producer,
+                                              unsigned int sev, const char *text, unsigned int len)
+{
+    unsigned int i;
+
+    for (i = filter->first[producer][sev]; i < filter->nr_rules; i++) {
+        const struct tm_filter_rule *rule = &filter->rules[i];
+
+        if (!(rule->producers & BIT(producer)) || !(rule->sevs & BIT(sev)))
+            continue;
+
+        if (rule->prefix_len) {
+            if (!text)
+                return TM_FILTER_TEXT;
+            if (len < rule->prefix_len || memcmp(text, rule->prefix, rule->prefix_len) != 0)
+                continue;
+        }
+
+        return rule->drop ? TM_FILTER_DROP : TM_FILTER_KEEP;
     }
 
-    len = snprintf(message, len + 1, "Hello from kernel module (%u)\n", counter);
-    if (len < 0) {
-        pr_err("test_module: snprintf failed when formatting message\n");
-        kfree(message);
-        kfree(filepath);
-        kfree(w);
-        goto reschedule;
+    return TM_FILTER_KEEP;
+}
+
+static void tm_filter_count(struct tm_producer *producer)
+{
+    atomic64_inc(&producer->counters.filtered);
+    atomic64_inc(&producer->stream->counters.filtered);
+}
+
+/* Для записей, текст которых известен до резервирования места */
+static bool tm_filter_drops(struct tm_producer *producer, unsigned int sev, const char *text, unsigned int len)
+{
+    struct tm_filter *filter;
+    bool drop;
+
+    rcu_read_lock();
+    filter = rcu_dereference(producer->stream->state->filter);
+    drop = filter && tm_filter_match(filter, producer->id, sev, text, len) == TM_FILTER_DROP;
+    rcu_read_unlock();
+
+    if (drop) {
+        tm_filter_count(producer);
     }
+    return drop;
+}
 
-    INIT_WORK(&w->work, write_work_handler);
-    w->message = message;
-    w->filepath = filepath;
+static int tm_filter_parse_sev(const char *name)
+{
+    int sev;
 
-    if (state->wq && state->module_active) {
-        queue_work(state->wq, &w->work);
-    } else {
-        pr_err("test_module: Workqueue not initialized or module inactive\n");
-        kfree(message);
-        kfree(filepath);
-        kfree(w);
-        goto reschedule;
+    for (sev = 0; sev < TM_SEV_NR; sev++) {
+        if (strcmp(name, tm_sev_names[sev]) == 0)
+            return sev;
     }
+    return -EINVAL;
+}
 
-reschedule:
-    /* Проверяем module_active еще раз перед перепланированием таймера */
-    if (state && state->module_active && timer_period > 0) {
-        delay = msecs_to_jiffies(timer_period * 1000);
-        if (delay == 0)
-            delay = 1;
-        mod_timer(&state->write_timer, jiffies + delay);
+static bool tm_filter_name_listed(const char *names, const char *name)
+{
+    size_t len = strlen(name);
+
+    while (names) {
+        if (strncmp(names, name, len) == 0 && (names[len] == ',' || names[len] == '\0'))
+            return true;
+        names = strchr(names, ',');
+        if (names)
+            names++;
     }
+    return false;
 }
 
-static int __init test_module_init(void)
+static int tm_filter_parse_cond(char *cond, struct tm_filter_rule *rule, u32 *streams, char **names)
 {
-    unsigned long delay;
+    char *value;
+    size_t n;
+    int sev;
 
-    pr_info("test_module: Initializing module\n");
-    pr_info("test_module: Filename: %s\n", filename ? filename : "(NULL)");
-    pr_info("test_module: Timer period: %u seconds\n", timer_period);
+    if ((n = str_has_prefix(cond, "sev>=")) || (n = str_has_prefix(cond, "sev<="))) {
+        sev = tm_filter_parse_sev(cond + n);
+        if (sev < 0)
+            return sev;
+        rule->sevs &= cond[3] == '>' ? GENMASK(TM_SEV_NR - 1, sev) : GENMASK(sev, 0);
+    } else if ((n = str_has_prefix(cond, "sev="))) {
+        sev = tm_filter_parse_sev(cond + n);
+        if (sev < 0)
+            return sev;
+        rule->sevs &= BIT(sev);
+    } else if ((n = str_has_prefix(cond, "stream="))) {
+        /* Разбираем копию: исходный текст нужен для сообщения об ошибке */
+        char buf[32];
+        char *id;
+        unsigned int stream;
 
-    if (!filename || !is_valid_path(filename)) {
-        pr_err("test_module: Invalid filename parameter\n");
-        return -EINVAL;
-    }
+        if (strscpy(buf, cond + n, sizeof(buf)) <= 0)
+            return -EINVAL;
+        value = buf;
+        while ((id = strsep(&value, ",")) != NULL) {
+            if (kstrtouint(id, 10, &stream) || stream >= TM_MAX_STREAMS)
+                return -EINVAL;
+            *streams |= BIT(stream);
+        }
+    } else if ((n = str_has_prefix(cond, "producer="))) {
+        if (!cond[n])
+            return -EINVAL;
+        *names = cond + n;
+    } else if ((n = str_has_prefix(cond, "prefix="))) {
+        size_t len = strlen(cond + n);
 
-    if (timer_period < MIN_PERIOD || timer_period > MAX_PERIOD) {
-        pr_err("test_module: Timer period must be between %u and %u seconds\n",
-               MIN_PERIOD, MAX_PERIOD);
+        if (len == 0 || len > TM_FILTER_PREFIX_MAX)
+            return -EINVAL;
+        rule->prefix_len = len;
+        memcpy(rule->prefix, cond + n, len);
+    } else {
         return -EINVAL;
     }
 
-    module_state = kmalloc(sizeof(*module_state), GFP_KERNEL);
-    if (!module_state) {
-        pr_err("test_module: Failed to allocate memory for module state\n");
-        return -ENOMEM;
-    }
+    return 0;
+}
 
-    atomic_set(&module_state->write_counter, 0);
-    module_state->module_active = false;
+/* Маска producer'ов, к которым относится правило; без условий - все, включая будущих */
+static u32 tm_filter_producers(struct test_module_state *state, u32 streams, const char *names)
+{
+    u32 mask = 0;
+    unsigned int i;
 
-    module_state->wq = alloc_workqueue("test_module_wq", WQ_MEM_RECLAIM, 1);
-    if (!module_state->wq) {
-        pr_err("test_module: Failed to create workqueue\n");
-        kfree(module_state);
-        return -ENOMEM;
+    if (!streams && !names) {
+        return U32_MAX;
     }
 
-    timer_setup(&module_state->write_timer, timer_callback, 0);
-    
-    delay = msecs_to_jiffies(timer_period * 1000);
-    if (delay == 0)
-        delay = 1;
+    if (!state) {
+        return 0;
+    }
 
-    module_state->module_active = true;
-    
-    mod_timer(&module_state->write_timer, jiffies + delay);
+    for (i = 0; i < TM_MAX_PRODUCERS; i++) {
+        struct tm_producer *p = &state->producers[i];
 
-    pr_info("test_module: Module initialized successfully\n");
-    return 0;
+        if (!p->in_use)
+            continue;
+        if (streams && !(streams & BIT(p->stream->id)))
+            continue;
+        if (names && !tm_filter_name_listed(names, p->name))
+            continue;
+        mask |= BIT(i);
+    }
+
+    return mask;
 }
 
-static void __exit test_module_exit(void)
+/*
+ * Компилирует rules; state может быть NULL (проверка синтаксиса до
+ * инициализации модуля). Пустая строка - фильтр выключен (NULL).
+ */
+static struct tm_filter *tm_filter_compile(struct test_module_state *state, const char *rules)
 {
-    unsigned int total_writes = 0;
+    struct tm_filter *filter;
+    char *copy;
+    char *cur;
+    char *part;
+    unsigned int producer;
+    unsigned int sev;
+    unsigned int i;
+    int ret = -EINVAL;
 
-    pr_info("test_module: Removing module\n");
-
-    if (!module_state) {
-        pr_warn("test_module: Module state is NULL during exit\n");
-        return;
+    copy = kstrdup(rules, GFP_KERNEL);
+    filter = kzalloc(struct_size(filter, rules, TM_FILTER_MAX_RULES), GFP_KERNEL);
+    if (!copy || !filter) {
+        ret = -ENOMEM;
+        goto err;
     }
 
-    total_writes = atomic_read(&module_state->write_counter);
+    cur = copy;
+    while ((part = strsep(&cur, ";")) != NULL) {
+        struct tm_filter_rule *rule;
+        char *names = NULL;
+        u32 streams = 0;
+        char *tok;
 
-    module_state->module_active = false;
+        part = strim(part);
+        if (!*part)
+            continue;
+
+        if (filter->nr_rules == TM_FILTER_MAX_RULES) {
+            pr_err("test_module: filter has more than %u rules\n", TM_FILTER_MAX_RULES);
+            goto err;
+        }
+        rule = &filter->rules[filter->nr_rules];
+        rule->sevs = GENMASK(TM_SEV_NR - 1, 0);
+
+        tok = strsep(&part, " \t");
+        if (strcmp(tok, "keep") != 0 && strcmp(tok, "drop") != 0) {
+            pr_err("test_module: filter rule must start with keep or drop: %s\n", tok);
+            goto err;
+        }
+        rule->drop = tok[0] == 'd';
 
-    if (timer_pending(&module_state->write_timer)) {
-        timer_delete_sync(&module_state->write_timer);
+        while ((tok = strsep(&part, " \t")) != NULL) {
+            if (!*tok)
+                continue;
+            if (tm_filter_parse_cond(tok, rule, &streams, &names) < 0) {
+                pr_err("test_module: Invalid filter condition: %s\n", tok);
+                goto err;
+            }
+        }
+
+        if (state && (streams >> state->nr_streams)) {
+            pr_err("test_module: filter refers to a stream beyond nr_streams\n");
+            goto err;
+        }
+
+        rule->producers = tm_filter_producers(state, streams, names);
+        filter->nr_rules++;
     }
 
-    if (module_state->wq) {
-        flush_workqueue(module_state->wq);
-        destroy_workqueue(module_state->wq);
-        module_state->wq = NULL;
+    kfree(copy);
+
+    if (!filter->nr_rules) {
+        kfree(filter);
+        return NULL;
+    }
+
+    for (producer = 0; producer < TM_MAX_PRODUCERS; producer++) {
+        for (sev = 0; sev < TM_SEV_NR; sev++) {
+            for (i = 0; i < filter->nr_rules; i++) {
+                if ((filter->rules[i].producers & BIT(producer)) && (filter->rules[i].sevs & BIT(sev)))
+                    break;
+            }
+            filter->first[producer][sev] = i;
+        }
+    }
+
+    return filter;
+
+err:
+    kfree(copy);
+    kfree(filter);
+    return ERR_PTR(ret);
+}
+
+static void tm_filter_install(struct test_module_state *state, struct tm_filter *filter)
+{
+    struct tm_filter *old;
+
+    old = rcu_replace_pointer(state->filter, filter, lockdep_is_held(&state->producers_lock));
+    if (old) {
+        kfree_rcu(old, rcu);
+    }
+}
+
+/* Пересобирает фильтр из filter_rules, вызывается под producers_lock */
+static int tm_filter_rebuild(struct test_module_state *state)
+{
+    struct tm_filter *filter;
+
+    lockdep_assert_held(&state->producers_lock);
+
+    filter = tm_filter_compile(state, filter_rules);
+    if (IS_ERR(filter)) {
+        return PTR_ERR(filter);
+    }
+
+    tm_filter_install(state, filter);
+    return 0;
+}
+
+static int filter_set(const char *val, const struct kernel_param *kp)
+{
+    struct test_module_state *state = module_state;
+    struct tm_filter *filter;
+    char *copy;
+    char *rules;
+
+    if (strlen(val) >= TM_FILTER_RULES_LEN) {
+        return -ENOSPC;
+    }
+
+    copy = kstrdup(val, GFP_KERNEL);
+    if (!copy) {
+        return -ENOMEM;
+    }
+    rules = strim(copy);
+
+    if (state) {
+        mutex_lock(&state->producers_lock);
+    }
+
+    /* До инициализации модуля только проверяем синтаксис */
+    filter = tm_filter_compile(state, rules);
+    if (!IS_ERR(filter)) {
+        strscpy(filter_rules, rules, sizeof(filter_rules));
+        if (state)
+            tm_filter_install(state, filter);
+        else
+            kfree(filter);
+    }
+
+    if (state) {
+        mutex_unlock(&state->producers_lock);
+    }
+
+    kfree(copy);
+    return PTR_ERR_OR_ZERO(filter);
+}
+
+static int filter_get(char *buffer, const struct kernel_param *kp)
+{
+    return scnprintf(buffer, PAGE_SIZE, "%s\n", filter_rules);
+}
+
+static const struct kernel_param_ops filter_ops = {
+    .set = filter_set,
+    .get = filter_get,
+};
+
+module_param_cb(filter, &filter_ops, NULL, 0644);
+MODULE_PARM_DESC(filter, "Record filter rules, e.g. \"drop producer=bench; keep sev>=warn; drop stream=1\" (empty - write everything)");
+
+static char *stream_path(struct tm_stream *stream)
+{
+    char *path = NULL;
+
+    unsigned int id = stream->parent->id;
+
+    kernel_param_lock(THIS_MODULE);
+    if (filename && is_valid_path(filename)) {
+        if (stream->shard == 0 && id == 0)
+            path = kstrdup(filename, GFP_KERNEL);
+        else if (stream->shard == 0)
+            path = kasprintf(GFP_KERNEL, "%s.%u", filename, id);
+        else if (id == 0)
+            path = kasprintf(GFP_KERNEL, "%s.shard%u", filename, stream->shard);
+        else
+            path = kasprintf(GFP_KERNEL, "%s.%u.shard%u", filename, id, stream->shard);
+    }
+    kernel_param_unlock(THIS_MODULE);
+
+    if (path)
+        tm_mem_charge(stream, TM_MEM_CONFIG, strlen(path) + 1);
+
+    return path;
+}
+
+static void tm_path_free(struct tm_stream *stream, char *path)
+{
+    if (!path)
+        return;
+
+    tm_mem_uncharge(stream, TM_MEM_CONFIG, strlen(path) + 1);
+    kfree(path);
+}
+
+static inline struct tm_record *tm_slot(struct tm_buf *buf, unsigned int slot)
+{
+    return (struct tm_record *)(buf->slots + (size_t)slot * TM_SLOT_SIZE);
+}
+
+static inline unsigned int tm_record_slots(unsigned int len)
+{
+    return DIV_ROUND_UP(sizeof(struct tm_record) + len + 1, TM_SLOT_SIZE);
+}
+
+#ifdef MAX_PAGE_ORDER
+#define TM_MAX_RING_ORDER MAX_PAGE_ORDER
+#else
+#define TM_MAX_RING_ORDER (MAX_ORDER - 1)
+#endif
+
+static int tm_stream_node(struct tm_stream *stream)
+{
+    return ring_node[stream->id] == NUMA_NO_NODE ? numa_node_id() : ring_node[stream->id];
+}
+
+/*
+ * Все буферы потока - срезы одной области на заданном NUMA-узле. Если
+ * она помещается в одну аллокацию buddy, берем непрерывные страницы из
+ * linear map: там, где он отображен большими страницами (зависит от
+ * архитектуры и отладочных опций), копирование буфера меньше тратит TLB.
+ * Хвост блока за ring_size сразу возвращается buddy, как в
+ * alloc_pages_exact(): бюджет и shrinker видят столько же страниц, сколько
+ * занято на самом деле. Иначе (или если память фрагментирована) - vmalloc
+ * с узла.
+ */
+static int tm_ring_alloc(struct tm_stream *stream)
+{
+    int node = tm_stream_node(stream);
+    struct page *page = NULL;
+
+    stream->ring_size = (size_t)buffer_kb * 1024 * nr_buffers;
+    stream->ring_order = get_order(stream->ring_size);
+
+    if (ring_contig && stream->ring_order <= TM_MAX_RING_ORDER) {
+        page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN |
+                                __GFP_NORETRY | __GFP_THISNODE, stream->ring_order);
+    }
+
+    if (page) {
+        stream->ring = page_address(page);
+        split_page(page, stream->ring_order);
+        free_pages_exact(stream->ring + PAGE_ALIGN(stream->ring_size),
+                         (PAGE_SIZE << stream->ring_order) - PAGE_ALIGN(stream->ring_size));
+    } else {
+        stream->ring = vzalloc_node(stream->ring_size, node);
+        if (!stream->ring) {
+            return -ENOMEM;
+        }
+        stream->ring_order = -1;
+        page = vmalloc_to_page(stream->ring);
+    }
+    stream->ring_nid = page_to_nid(page);
+    tm_mem_charge(stream, TM_MEM_RECORDS, PAGE_ALIGN(stream->ring_size));
+
+    return 0;
+}
+
+static void tm_ring_free(struct tm_stream *stream)
+{
+    if (!stream->ring) {
+        return;
+    }
+
+    if (stream->ring_order < 0) {
+        vfree(stream->ring);
+    } else {
+        free_pages_exact(stream->ring, stream->ring_size);
+    }
+    stream->ring = NULL;
+    tm_mem_uncharge(stream, TM_MEM_RECORDS, PAGE_ALIGN(stream->ring_size));
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+typedef unsigned int blk_opf_t;
+#endif
+
+/*
+ * Блочное устройство bdev_path открывается эксклюзивно на все время
+ * работы модуля и размечается заново при каждой загрузке.
+ */
+static struct {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    struct file *file;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    struct bdev_handle *handle;
+#endif
+    struct block_device *bdev;
+    u64 segment_size;
+    u64 segments_per_region;
+    u64 format_ns;
+} tm_bdev;
+
+/* Синхронная запись len байт из vmalloc-памяти по смещению pos устройства */
+static int tm_bdev_io(void *addr, u64 pos, size_t len, blk_opf_t opf)
+{
+    unsigned int nr = DIV_ROUND_UP(len, PAGE_SIZE);
+    struct bio *bio;
+    size_t done;
+    unsigned int n;
+    int ret;
+
+    flush_kernel_vmap_range(addr, len);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    bio = bio_alloc(tm_bdev.bdev, nr, REQ_OP_WRITE | opf, GFP_KERNEL);
+#else
+    bio = bio_alloc(GFP_KERNEL, nr);
+    bio_set_dev(bio, tm_bdev.bdev);
+    bio->bi_opf = REQ_OP_WRITE | opf;
+#endif
+    bio->bi_iter.bi_sector = pos >> SECTOR_SHIFT;
+
+    for (done = 0; done < len; done += n) {
+        n = min_t(size_t, PAGE_SIZE - offset_in_page(addr + done), len - done);
+        if (bio_add_page(bio, vmalloc_to_page(addr + done), n, offset_in_page(addr + done)) != n) {
+            bio_put(bio);
+            return -EIO;
+        }
+    }
+
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+    return ret;
+}
+
+static void tm_bdev_close(void)
+{
+    if (!tm_bdev.bdev) {
+        return;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    fput(tm_bdev.file);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    bdev_release(tm_bdev.handle);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    blkdev_put(tm_bdev.bdev, &tm_bdev);
+#else
+    blkdev_put(tm_bdev.bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+#endif
+    tm_bdev.bdev = NULL;
+}
+
+/* Делит устройство на области writer'ов и пишет суперблок */
+static int tm_bdev_open(unsigned int nr_regions)
+{
+    struct tm_bdev_super *super;
+    u64 size;
+    int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    tm_bdev.file = bdev_file_open_by_path(bdev_path, BLK_OPEN_READ | BLK_OPEN_WRITE, &tm_bdev, NULL);
+    if (IS_ERR(tm_bdev.file))
+        return PTR_ERR(tm_bdev.file);
+    tm_bdev.bdev = file_bdev(tm_bdev.file);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    tm_bdev.handle = bdev_open_by_path(bdev_path, BLK_OPEN_READ | BLK_OPEN_WRITE, &tm_bdev, NULL);
+    if (IS_ERR(tm_bdev.handle))
+        return PTR_ERR(tm_bdev.handle);
+    tm_bdev.bdev = tm_bdev.handle->bdev;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    tm_bdev.bdev = blkdev_get_by_path(bdev_path, BLK_OPEN_READ | BLK_OPEN_WRITE, &tm_bdev, NULL);
+    if (IS_ERR(tm_bdev.bdev)) {
+        ret = PTR_ERR(tm_bdev.bdev);
+        tm_bdev.bdev = NULL;
+        return ret;
+    }
+#else
+    tm_bdev.bdev = blkdev_get_by_path(bdev_path, FMODE_READ | FMODE_WRITE | FMODE_EXCL, &tm_bdev);
+    if (IS_ERR(tm_bdev.bdev)) {
+        ret = PTR_ERR(tm_bdev.bdev);
+        tm_bdev.bdev = NULL;
+        return ret;
+    }
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    size = bdev_nr_bytes(tm_bdev.bdev);
+#else
+    size = i_size_read(tm_bdev.bdev->bd_inode);
+#endif
+
+    tm_bdev.segment_size = (u64)bdev_segment_kb * 1024;
+    tm_bdev.segments_per_region = size > TM_BDEV_BLOCK ?
+        div64_u64(size - TM_BDEV_BLOCK, tm_bdev.segment_size * nr_regions) : 0;
+    tm_bdev.format_ns = ktime_get_real_ns();
+
+    if (bdev_logical_block_size(tm_bdev.bdev) > TM_BDEV_BLOCK || tm_bdev.segments_per_region < 2) {
+        pr_err("test_module: %s is too small for %u regions of 2 segments\n", bdev_path, nr_regions);
+        tm_bdev_close();
+        return -ENOSPC;
+    }
+
+    super = vzalloc(TM_BDEV_BLOCK);
+    if (!super) {
+        tm_bdev_close();
+        return -ENOMEM;
+    }
+
+    super->magic = TM_BDEV_MAGIC;
+    super->version = TM_BDEV_VERSION;
+    super->block_size = TM_BDEV_BLOCK;
+    super->nr_regions = nr_regions;
+    super->segment_size = tm_bdev.segment_size;
+    super->segments_per_region = tm_bdev.segments_per_region;
+    super->format_ns = tm_bdev.format_ns;
+
+    ret = tm_bdev_io(super, 0, TM_BDEV_BLOCK, REQ_PREFLUSH | REQ_FUA);
+    vfree(super);
+    if (ret < 0) {
+        tm_bdev_close();
+        return ret;
+    }
+
+    pr_info("test_module: Logging to %s: %u regions of %llu segments of %u KiB\n",
+            bdev_path, nr_regions, tm_bdev.segments_per_region, bdev_segment_kb);
+    return 0;
+}
+
+static int tm_bdev_log_alloc(struct tm_stream *stream)
+{
+    struct tm_bdev_log *log;
+
+    log = kzalloc(sizeof(*log), GFP_KERNEL);
+    if (!log) {
+        return -ENOMEM;
+    }
+
+    log->segment = vzalloc(tm_bdev.segment_size);
+    if (!log->segment) {
+        kfree(log);
+        return -ENOMEM;
+    }
+    tm_mem_charge(stream, TM_MEM_SINK, tm_bdev.segment_size + sizeof(*log));
+
+    log->start = TM_BDEV_BLOCK + (u64)stream->id * tm_bdev.segments_per_region * tm_bdev.segment_size;
+    log->seq = 1;
+    stream->bdev_log = log;
+    return 0;
+}
+
+static void tm_bdev_log_free(struct tm_stream *stream)
+{
+    if (!stream->bdev_log) {
+        return;
+    }
+
+    vfree(stream->bdev_log->segment);
+    kfree(stream->bdev_log);
+    stream->bdev_log = NULL;
+    tm_mem_uncharge(stream, TM_MEM_SINK, tm_bdev.segment_size + sizeof(struct tm_bdev_log));
+}
+
+/*
+ * Лог в памяти (shm_kb): shmem-файл с заголовком и кольцом на каждого
+ * writer'а, постоянно отображенный в ядро через vmap. Пользователь
+ * получает его только для чтения через TM_IOC_SHM_FD и отображает сам.
+ */
+static struct {
+    struct file *file;
+    struct page **pages;
+    unsigned int nr_pages;
+    struct tm_shm_header *header;
+} tm_shm;
+
+static void tm_shm_destroy(void)
+{
+    unsigned int i;
+
+    if (!tm_shm.file) {
+        return;
+    }
+
+    if (tm_shm.header) {
+        vunmap(tm_shm.header);
+        tm_shm.header = NULL;
+    }
+
+    for (i = 0; i < tm_shm.nr_pages && tm_shm.pages[i]; i++) {
+        put_page(tm_shm.pages[i]);
+    }
+    mapping_clear_unevictable(tm_shm.file->f_mapping);
+    kvfree(tm_shm.pages);
+    tm_shm.pages = NULL;
+    tm_mem_uncharge(NULL, TM_MEM_SINK, (size_t)tm_shm.nr_pages * PAGE_SIZE);
+    tm_mem_uncharge(NULL, TM_MEM_CONFIG, tm_shm.nr_pages * sizeof(*tm_shm.pages));
+
+    /* Открытые пользователем fd держат свои ссылки на файл */
+    fput(tm_shm.file);
+    tm_shm.file = NULL;
+}
+
+static int tm_shm_create(unsigned int nr_regions)
+{
+    u64 region_size = round_up((u64)shm_kb * 1024, PAGE_SIZE);
+    u64 size = PAGE_SIZE + nr_regions * region_size;
+    struct inode *inode;
+    unsigned int i;
+
+    BUILD_BUG_ON(sizeof(struct tm_shm_header) > PAGE_SIZE);
+
+    tm_shm.file = shmem_file_setup("test_module_shm", size, VM_NORESERVE);
+    if (IS_ERR(tm_shm.file)) {
+        int ret = PTR_ERR(tm_shm.file);
+
+        tm_shm.file = NULL;
+        return ret;
+    }
+
+    /* Размер и содержимое меняет только модуль: запись через fd и mmap запрещены печатями */
+    inode = file_inode(tm_shm.file);
+    SHMEM_I(inode)->seals = F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+    mapping_set_unevictable(tm_shm.file->f_mapping);
+
+    tm_shm.nr_pages = size >> PAGE_SHIFT;
+    tm_shm.pages = kvcalloc(tm_shm.nr_pages, sizeof(*tm_shm.pages), GFP_KERNEL);
+    if (!tm_shm.pages) {
+        fput(tm_shm.file);
+        tm_shm.file = NULL;
+        return -ENOMEM;
+    }
+    tm_mem_charge(NULL, TM_MEM_CONFIG, tm_shm.nr_pages * sizeof(*tm_shm.pages));
+    tm_mem_charge(NULL, TM_MEM_SINK, size);
+
+    for (i = 0; i < tm_shm.nr_pages; i++) {
+        struct page *page = shmem_read_mapping_page(tm_shm.file->f_mapping, i);
+
+        if (IS_ERR(page)) {
+            tm_shm_destroy();
+            return PTR_ERR(page);
+        }
+        set_page_dirty(page);
+        tm_shm.pages[i] = page;
+    }
+
+    tm_shm.header = vmap(tm_shm.pages, tm_shm.nr_pages, VM_MAP, PAGE_KERNEL);
+    if (!tm_shm.header) {
+        tm_shm_destroy();
+        return -ENOMEM;
+    }
+
+    tm_shm.header->magic = TM_SHM_MAGIC;
+    tm_shm.header->version = TM_SHM_VERSION;
+    tm_shm.header->nr_regions = nr_regions;
+    tm_shm.header->format_ns = ktime_get_real_ns();
+    for (i = 0; i < nr_regions; i++) {
+        tm_shm.header->regions[i].data_offset = PAGE_SIZE + i * region_size;
+        tm_shm.header->regions[i].size = region_size;
+    }
+
+    pr_info("test_module: Logging to shared memory: %u regions of %llu KiB\n",
+            nr_regions, region_size / 1024);
+    return 0;
+}
+
+/* Новый fd только для чтения на shmem-файл лога */
+static int tm_shm_fd(void)
+{
+    struct file *file;
+    int fd;
+
+    if (!tm_shm.file) {
+        return -ENODEV;
+    }
+
+    fd = get_unused_fd_flags(O_CLOEXEC);
+    if (fd < 0) {
+        return fd;
+    }
+
+    file = dentry_open(&tm_shm.file->f_path, O_RDONLY | O_LARGEFILE, current_cred());
+    if (IS_ERR(file)) {
+        put_unused_fd(fd);
+        return PTR_ERR(file);
+    }
+
+    fd_install(fd, file);
+    return fd;
+}
+
+static void tm_stream_set_bufs(struct tm_stream *stream, char *base, size_t buf_size)
+{
+    unsigned int i;
+
+    for (i = 0; i < stream->nr_bufs; i++) {
+        struct tm_buf *buf = &stream->bufs[i];
+
+        buf->slots = base + i * buf_size;
+        WRITE_ONCE(buf->nr_slots, buf_size / TM_SLOT_SIZE);
+        atomic_set(&buf->committed, 0);
+        atomic_set(&buf->io_pending, 0);
+    }
+}
+
+static int tm_stream_alloc_bufs(struct tm_stream *stream)
+{
+    if (tm_ring_alloc(stream) < 0) {
+        return -ENOMEM;
+    }
+
+    stream->reserve = kvzalloc_node((size_t)reserve_kb * 1024 * nr_buffers, GFP_KERNEL,
+                                    tm_stream_node(stream));
+    if (!stream->reserve) {
+        tm_ring_free(stream);
+        return -ENOMEM;
+    }
+    tm_mem_charge(stream, TM_MEM_RECORDS, (size_t)reserve_kb * 1024 * nr_buffers);
+
+    if (recent_records) {
+        stream->recent = kvcalloc(recent_records, sizeof(*stream->recent), GFP_KERNEL);
+        if (!stream->recent) {
+            kvfree(stream->reserve);
+            stream->reserve = NULL;
+            tm_mem_uncharge(stream, TM_MEM_RECORDS, (size_t)reserve_kb * 1024 * nr_buffers);
+            tm_ring_free(stream);
+            return -ENOMEM;
+        }
+        tm_mem_charge(stream, TM_MEM_RECORDS, recent_records * sizeof(*stream->recent));
+    }
+
+    stream->nr_bufs = nr_buffers;
+    tm_stream_set_bufs(stream, stream->ring, (size_t)buffer_kb * 1024);
+    atomic64_set(&stream->head, TM_HEAD(0, 0));
+    stream->last_busy = jiffies;
+
+    if (tm_bdev.bdev && tm_bdev_log_alloc(stream) < 0) {
+        tm_stream_free_bufs(stream);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void tm_stream_free_bufs(struct tm_stream *stream)
+{
+    tm_ring_free(stream);
+    if (stream->reserve) {
+        kvfree(stream->reserve);
+        stream->reserve = NULL;
+        tm_mem_uncharge(stream, TM_MEM_RECORDS, (size_t)reserve_kb * 1024 * stream->nr_bufs);
+    }
+    if (stream->recent) {
+        kvfree(stream->recent);
+        stream->recent = NULL;
+        tm_mem_uncharge(stream, TM_MEM_RECORDS, recent_records * sizeof(*stream->recent));
+    }
+    tm_bdev_log_free(stream);
+}
+
+static size_t tm_stream_backlog(struct tm_stream *stream)
+{
+    size_t slots = min(TM_HEAD_SLOT(atomic64_read(&stream->head)), stream->bufs[0].nr_slots);
+    unsigned int i;
+
+    for (i = 0; i < stream->nr_bufs; i++) {
+        if (READ_ONCE(stream->bufs[i].busy))
+            slots += READ_ONCE(stream->bufs[i].used);
+    }
+
+    return slots * TM_SLOT_SIZE;
+}
+
+/*
+ * Ждет завершения асинхронных запросов. Если какой-то из них не дописал
+ * свои записи, файл обрезается по началу первой недописанной: иначе перед
+ * данными следующих запросов в логе осталась бы дыра из нулей. Записи
+ * успевших завершиться запросов за этой точкой тоже теряются: они
+ * вычитаются из bytes_written и last_seq и, как все отброшенные записи,
+ * считаются в overflow.
+ */
+static void tm_stream_io_settle(struct tm_stream *stream)
+{
+    unsigned long flags;
+    loff_t fail_pos;
+    u64 fail_rec;
+    u64 lost_bytes;
+    u64 lost_records;
+    u64 records;
+    int ret;
+
+    wait_event(stream->io_wait, atomic_read(&stream->io_inflight) == 0);
+
+    spin_lock_irqsave(&stream->io_lock, flags);
+    fail_pos = stream->io_fail_pos;
+    fail_rec = stream->io_fail_rec;
+    lost_bytes = stream->io_lost_bytes;
+    lost_records = stream->io_lost_records;
+    stream->io_fail_pos = -1;
+    stream->io_lost_bytes = 0;
+    stream->io_lost_records = 0;
+    spin_unlock_irqrestore(&stream->io_lock, flags);
+
+    records = stream->io_records;
+    stream->io_records = 0;
+
+    if (fail_pos < 0 || !stream->filp) {
+        return;
+    }
+
+    /* Все, что не попало в счетчики, лежит за первой недописанной записью */
+    atomic64_sub(stream->write_pos - fail_pos - lost_bytes, &stream->bytes_written);
+    atomic64_sub(records - fail_rec - lost_records, &stream->last_seq);
+    atomic64_add(records - fail_rec, &stream->overflow);
+    pr_warn_ratelimited("test_module: Discarding %llu records (%lld bytes) of stream %u after a failed write\n",
+                        records - fail_rec, stream->write_pos - fail_pos, stream->id);
+
+    ret = vfs_truncate(&stream->filp->f_path, fail_pos);
+    if (ret < 0) {
+        atomic64_inc(&stream->write_errors);
+        pr_err_ratelimited("test_module: Failed to truncate stream %u, error: %d\n", stream->id, ret);
+    }
+    stream->write_pos = fail_pos;
+}
+
+static void tm_stream_close(struct tm_stream *stream)
+{
+    if (stream->filp) {
+        filp_close(stream->filp, NULL);
+        stream->filp = NULL;
+    }
+
+    tm_path_free(stream, stream->filp_path);
+    stream->filp_path = NULL;
+}
+
+/*
+ * Файл держится открытым между пакетами. Переоткрываем его, если сменился
+ * filename или файл по этому пути был удален/переименован (ротация логов).
+ */
+static int tm_stream_open(struct tm_stream *stream)
+{
+    struct file *filp;
+    struct path path;
+    char *filepath;
+    bool same = false;
+
+    filepath = stream_path(stream);
+    if (!filepath) {
+        pr_err("test_module: Failed to resolve file path for stream %u\n", stream->id);
+        return -EINVAL;
+    }
+
+    if (stream->filp && strcmp(filepath, stream->filp_path) == 0 &&
+        kern_path(filepath, LOOKUP_FOLLOW, &path) == 0) {
+        same = d_inode(path.dentry) == file_inode(stream->filp);
+        path_put(&path);
+    }
+
+    if (same) {
+        tm_path_free(stream, filepath);
+        return 0;
+    }
+
+    /* Запросы в полете и откат после ошибки относятся к старому файлу */
+    tm_stream_io_settle(stream);
+    tm_stream_close(stream);
+
+    filp = open_log_file(filepath);
+    if (IS_ERR(filp)) {
+        tm_path_free(stream, filepath);
+        return PTR_ERR(filp);
+    }
+
+    stream->filp = filp;
+    stream->filp_path = filepath;
+    stream->write_pos = i_size_read(file_inode(filp));
+    return 0;
+}
+
+#define TM_IOV_BYTES (TM_MAX_IOV * sizeof(struct kvec))
+
+static void tm_stream_free_sink_buf(struct tm_stream *stream)
+{
+    if (stream->buf) {
+        kvfree(stream->buf);
+        tm_mem_uncharge(stream, TM_MEM_SINK, stream->buf_size);
+    }
+    stream->buf = NULL;
+    stream->buf_size = 0;
+}
+
+static void tm_stream_free_sink(struct tm_stream *stream)
+{
+    tm_stream_free_sink_buf(stream);
+
+    if (stream->iov) {
+        kvfree(stream->iov);
+        stream->iov = NULL;
+        tm_mem_uncharge(stream, TM_MEM_SINK, TM_IOV_BYTES);
+    }
+}
+
+static void tm_stream_buffer(struct tm_stream *stream)
+{
+    size_t size = max(READ_ONCE(flush_max_bytes), READ_ONCE(flush_min_bytes));
+
+    if (READ_ONCE(write_vectored)) {
+        if (!stream->iov && tm_mem_try_charge(stream, TM_MEM_SINK, TM_IOV_BYTES)) {
+            stream->iov = kvmalloc_array(TM_MAX_IOV, sizeof(*stream->iov), GFP_KERNEL);
+            if (!stream->iov)
+                tm_mem_uncharge(stream, TM_MEM_SINK, TM_IOV_BYTES);
+        }
+        if (stream->iov)
+            return;
+    }
+
+    if (stream->buf && stream->buf_size == size) {
+        return;
+    }
+
+    tm_stream_free_sink_buf(stream);
+    if (tm_mem_try_charge(stream, TM_MEM_SINK, size)) {
+        stream->buf = kvmalloc(size, GFP_KERNEL);
+        if (stream->buf)
+            stream->buf_size = size;
+        else
+            tm_mem_uncharge(stream, TM_MEM_SINK, size);
+    }
+    if (!stream->buf) {
+        pr_warn_ratelimited("test_module: No batch buffer for stream %u, writing records one by one\n",
+                            stream->id);
+    }
+}
+
+static u64 tm_stream_write(struct tm_stream *stream, const char *data, size_t len)
+{
+    ktime_t start = ktime_get();
+    ssize_t written;
+    loff_t pos;
+
+    pos = i_size_read(file_inode(stream->filp));
+
+    written = kernel_write(stream->filp, data, len, &pos);
+    if (written < 0) {
+        atomic64_inc(&stream->write_errors);
+        pr_err_ratelimited("test_module: Failed to write to file, error: %zd\n", written);
+    } else {
+        atomic64_add(written, &stream->bytes_written);
+        if ((size_t)written != len) {
+            atomic64_inc(&stream->write_errors);
+            pr_warn_ratelimited("test_module: Partial write: %zd of %zu bytes\n", written, len);
+        }
+    }
+
+    return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static u64 tm_stream_writev(struct tm_stream *stream, unsigned int nr, size_t len)
+{
+    ktime_t start = ktime_get();
+    struct iov_iter iter;
+    ssize_t written;
+    loff_t pos;
+
+    pos = i_size_read(file_inode(stream->filp));
+
+    iov_iter_kvec(&iter, ITER_SOURCE, stream->iov, nr, len);
+    written = vfs_iter_write(stream->filp, &iter, &pos, 0);
+    if (written < 0) {
+        atomic64_inc(&stream->write_errors);
+        pr_err_ratelimited("test_module: Failed to write to file, error: %zd\n", written);
+    } else {
+        atomic64_add(written, &stream->bytes_written);
+        if ((size_t)written != len) {
+            atomic64_inc(&stream->write_errors);
+            pr_warn_ratelimited("test_module: Partial write: %zd of %zu bytes\n", written, len);
+        }
+    }
+
+    return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/* Пакет уходит в файл прямо из слотов буфера, без промежуточного копирования */
+static u64 tm_flush_vectored(struct tm_stream *stream, struct tm_buf *buf,
+                             unsigned int first, size_t *bytes)
+{
+    struct tm_record *record;
+    unsigned int slot;
+    unsigned int nr = 0;
+    size_t len = 0;
+    u64 io_ns = 0;
+
+    for (slot = first; slot < buf->used; slot += max(record->slots, 1U)) {
+        record = tm_slot(buf, slot);
+        if (!record->len)
+            continue;
+
+        if (nr == TM_MAX_IOV) {
+            io_ns += tm_stream_writev(stream, nr, len);
+            nr = 0;
+            len = 0;
+        }
+
+        stream->iov[nr].iov_base = record->data;
+        stream->iov[nr].iov_len = record->len;
+        nr++;
+        len += record->len;
+        *bytes += record->len;
+        atomic64_inc(&stream->last_seq);
+    }
+
+    if (nr) {
+        io_ns += tm_stream_writev(stream, nr, len);
+    }
+
+    return io_ns;
+}
+
+static u64 tm_flush_copy(struct tm_stream *stream, struct tm_buf *buf,
+                         unsigned int first, size_t *bytes)
+{
+    struct tm_record *record;
+    unsigned int slot;
+    size_t used = 0;
+    u64 io_ns = 0;
+
+    for (slot = first; slot < buf->used; slot += max(record->slots, 1U)) {
+        record = tm_slot(buf, slot);
+        if (!record->len)
+            continue;
+
+        *bytes += record->len;
+        atomic64_inc(&stream->last_seq);
+
+        if (used + record->len > stream->buf_size && used) {
+            io_ns += tm_stream_write(stream, stream->buf, used);
+            used = 0;
+        }
+
+        if (record->len > stream->buf_size) {
+            io_ns += tm_stream_write(stream, record->data, record->len);
+        } else {
+            memcpy(stream->buf + used, record->data, record->len);
+            used += record->len;
+        }
+    }
+
+    if (used) {
+        io_ns += tm_stream_write(stream, stream->buf, used);
+    }
+
+    return io_ns;
+}
+
+/* Пишет заголовок текущего сегмента области с заданным used */
+static int tm_bdev_write_header(struct tm_stream *stream, u64 pos, u32 used, blk_opf_t opf)
+{
+    struct tm_bdev_log *log = stream->bdev_log;
+    struct tm_bdev_segment *header = (struct tm_bdev_segment *)log->segment;
+
+    header->magic = TM_BDEV_SEGMENT_MAGIC;
+    header->region = stream->id;
+    header->seq = log->seq;
+    header->format_ns = tm_bdev.format_ns;
+    header->used = used;
+    header->write_ns = ktime_get_real_ns();
+    return tm_bdev_io(header, pos, TM_BDEV_BLOCK, opf);
+}
+
+/*
+ * Дописывает на устройство данные сегмента после synced и его заголовок.
+ * Данные пишутся раньше заголовка, поэтому used на устройстве никогда не
+ * опережает данные; с flush_fsync заголовок пишется с PREFLUSH|FUA.
+ * После круга кольца на месте сегмента лежит заголовок старого seq с
+ * его used: перед первыми данными сегмента он заменяется заголовком
+ * нового seq с used = 0 (с FUA, чтобы и после сбоя старый заголовок не
+ * описывал новые данные).
+ */
+static void tm_bdev_sync(struct tm_stream *stream, bool durable)
+{
+    struct tm_bdev_log *log = stream->bdev_log;
+    u64 pos = log->start + log->index * tm_bdev.segment_size;
+    u32 from = round_down(log->synced, TM_BDEV_BLOCK);
+    u32 to = round_up(log->used, TM_BDEV_BLOCK);
+    int ret = 0;
+
+    if (log->used == log->synced) {
+        return;
+    }
+
+    if (log->synced == 0) {
+        ret = tm_bdev_write_header(stream, pos, 0, REQ_FUA);
+    }
+    if (ret == 0) {
+        ret = tm_bdev_io(log->segment + TM_BDEV_BLOCK + from, pos + TM_BDEV_BLOCK + from, to - from, 0);
+    }
+    if (ret == 0) {
+        ret = tm_bdev_write_header(stream, pos, log->used, durable ? REQ_PREFLUSH | REQ_FUA : 0);
+    }
+
+    if (ret < 0) {
+        atomic64_inc(&stream->write_errors);
+        pr_err_ratelimited("test_module: Failed to write to %s, error: %d\n", bdev_path, ret);
+        return;
+    }
+
+    atomic64_add(log->used - log->synced, &stream->bytes_written);
+    log->synced = log->used;
+}
+
+/* Записи, не помещающиеся в текущий сегмент, начинают следующий: запись не делится между сегментами */
+static u64 tm_bdev_flush(struct tm_stream *stream, struct tm_buf *buf, size_t *bytes)
+{
+    struct tm_bdev_log *log = stream->bdev_log;
+    size_t room = tm_bdev.segment_size - TM_BDEV_BLOCK;
+    ktime_t start = ktime_get();
+    struct tm_record *record;
+    unsigned int slot;
+
+    for (slot = 0; slot < buf->used; slot += max(record->slots, 1U)) {
+        record = tm_slot(buf, slot);
+        if (!record->len)
+            continue;
+
+        if (log->used + record->len > room) {
+            tm_bdev_sync(stream, false);
+            log->index = (log->index + 1) % tm_bdev.segments_per_region;
+            log->seq++;
+            log->used = 0;
+            log->synced = 0;
+        }
+
+        memcpy(log->segment + TM_BDEV_BLOCK + log->used, record->data, record->len);
+        log->used += record->len;
+        *bytes += record->len;
+        atomic64_inc(&stream->last_seq);
+    }
+
+    tm_bdev_sync(stream, READ_ONCE(flush_fsync));
+
+    return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/* Копирует len <= size байт в кольцо области начиная с байта pos */
+static void tm_shm_copy(struct tm_shm_region *region, u64 pos, const char *src, size_t len)
+{
+    char *data = (char *)tm_shm.header + region->data_offset;
+    size_t n;
+    u32 off;
+
+    div_u64_rem(pos, region->size, &off);
+    n = min_t(size_t, len, region->size - off);
+    memcpy(data + off, src, n);
+    memcpy(data, src + n, len - n);
+}
+
+/*
+ * Протокол с читателями описан в test_module_uapi.h: reserved сдвигается
+ * до копирования, head публикуется после. Из пакета больше size байт
+ * копируется только хвост, остальное все равно было бы перезаписано.
+ */
+static u64 tm_shm_flush(struct tm_stream *stream, struct tm_buf *buf, size_t *bytes)
+{
+    struct tm_shm_region *region = &tm_shm.header->regions[stream->id];
+    ktime_t start = ktime_get();
+    struct tm_record *record;
+    u64 head = region->head;
+    u64 pos = head;
+    u64 low;
+    u64 records = 0;
+    size_t total = 0;
+    unsigned int slot;
+
+    for (slot = 0; slot < buf->used; slot += max(record->slots, 1U)) {
+        record = tm_slot(buf, slot);
+        total += record->len;
+    }
+
+    if (!total) {
+        return 0;
+    }
+
+    low = total > region->size ? head + total - region->size : head;
+    WRITE_ONCE(region->reserved, head + total);
+    smp_wmb();
+
+    for (slot = 0; slot < buf->used; slot += max(record->slots, 1U)) {
+        const char *src;
+        size_t len;
+
+        record = tm_slot(buf, slot);
+        if (!record->len)
+            continue;
+
+        src = record->data;
+        len = record->len;
+        if (pos < low) {
+            size_t skip = min_t(u64, low - pos, len);
+
+            src += skip;
+            len -= skip;
+        }
+        if (len)
+            tm_shm_copy(region, pos + record->len - len, src, len);
+
+        pos += record->len;
+        records++;
+        atomic64_inc(&stream->last_seq);
+    }
+
+    smp_store_release(&region->head, head + total);
+    WRITE_ONCE(region->records, region->records + records);
+
+    *bytes += total;
+    atomic64_add(total, &stream->bytes_written);
+
+    return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/*
+ * AIMD: пока пакет пишется быстрее flush_target_us, размер пакета растет на
+ * flush_min_bytes, при превышении - уменьшается вдвое. Дедлайн выбирается
+ * так, чтобы writer тратил на I/O не больше 1/TM_FLUSH_DUTY времени.
+ */
+static void tm_flush_adapt(struct tm_stream *stream, u64 io_ns, size_t bytes)
+{
+    unsigned int min_bytes = READ_ONCE(flush_min_bytes);
+    unsigned int max_bytes = max(READ_ONCE(flush_max_bytes), min_bytes);
+    unsigned int buf_bytes = stream->bufs[0].nr_slots * TM_SLOT_SIZE;
+    unsigned int min_ms = READ_ONCE(flush_min_ms);
+    unsigned int max_ms = max(READ_ONCE(flush_max_ms), min_ms);
+    unsigned int lat_us = (unsigned int)min_t(u64, div_u64(io_ns, NSEC_PER_USEC),
+                                              60 * USEC_PER_SEC);
+    unsigned int batch = stream->batch_bytes;
+    unsigned int deadline;
+
+    stream->write_lat_us = (stream->write_lat_us * 7 + lat_us) / 8;
+
+    if (lat_us > READ_ONCE(flush_target_us)) {
+        batch /= 2;
+    } else if (bytes >= batch) {
+        batch += min_bytes;
+    }
+
+    deadline = DIV_ROUND_UP(stream->write_lat_us * TM_FLUSH_DUTY, USEC_PER_MSEC);
+
+    /* Пакет не может быть больше одного буфера */
+    max_bytes = min(max_bytes, buf_bytes);
+    min_bytes = min(min_bytes, max_bytes);
+
+    WRITE_ONCE(stream->batch_bytes, clamp(batch, min_bytes, max_bytes));
+    WRITE_ONCE(stream->deadline_ms, clamp(deadline, min_ms, max_ms));
+}
+
+/*
+ * Копирует счетчики потока в страницу статистики. Вызывается под io_lock,
+ * поэтому писатель у записи потока в странице всегда один.
+ */
+static void tm_stats_publish(struct tm_stream *stream)
+{
+    struct tm_stats_page *page = stream->state->stats_page;
+    struct tm_stats_stream *s;
+
+    if (!page) {
+        return;
+    }
+
+    s = &page->streams[stream->id];
+
+    WRITE_ONCE(s->seq, s->seq + 1);
+    smp_wmb();
+
+    s->write_lat_us = stream->write_lat_us;
+    s->write_counter = atomic_read(&stream->write_counter);
+    s->accepted = atomic64_read(&stream->counters.accepted);
+    s->dropped = atomic64_read(&stream->counters.dropped);
+    s->overflow = atomic64_read(&stream->overflow);
+    s->bytes_written = atomic64_read(&stream->bytes_written);
+    s->write_errors = atomic64_read(&stream->write_errors);
+    s->flushes = atomic64_read(&stream->flushes);
+    s->last_seq = atomic64_read(&stream->last_seq);
+    s->last_write_ns = stream->last_write_ns;
+    s->backlog_bytes = tm_stream_backlog(stream);
+    s->lat_sum_ns = stream->lat_sum_ns;
+    memcpy(s->lat_hist, stream->lat_hist, sizeof(s->lat_hist));
+
+    smp_wmb();
+    WRITE_ONCE(s->seq, s->seq + 1);
+
+    atomic64_inc(&stream->state->stats_gen);
+    if (wq_has_sleeper(&stream->state->stats_wait)) {
+        wake_up_interruptible(&stream->state->stats_wait);
+    }
+}
+
+/* Публикует номер и время тика для watchdog'ов; вызывается под io_lock */
+static void tm_heartbeat_publish(struct tm_stream *stream, unsigned int tick)
+{
+    struct tm_heartbeat_page *page = stream->state->heartbeat_page;
+    struct tm_heartbeat_stream *hb;
+
+    if (!page) {
+        return;
+    }
+
+    hb = &page->streams[stream->id];
+
+    WRITE_ONCE(hb->seq, hb->seq + 1);
+    smp_wmb();
+
+    hb->period_ms = READ_ONCE(timer_period) * MSEC_PER_SEC;
+    hb->tick = tick;
+    hb->mono_ns = ktime_get_ns();
+
+    smp_wmb();
+    WRITE_ONCE(hb->seq, hb->seq + 1);
+}
+
+/* Учитывает завершенную запись в файл; вызывается под io_lock */
+static void tm_stats_account_write(struct tm_stream *stream, u64 io_ns)
+{
+    u64 us = div_u64(io_ns, NSEC_PER_USEC);
+    unsigned int bucket = us ? min_t(unsigned int, fls64(us), TM_LAT_BUCKETS - 1) : 0;
+
+    stream->lat_hist[bucket]++;
+    stream->lat_sum_ns += io_ns;
+    stream->last_write_ns = ktime_get_real_ns();
+    tm_stats_publish(stream);
+}
+
+static void tm_buf_release(struct tm_stream *stream, struct tm_buf *buf)
+{
+    struct test_module_state *state = stream->state;
+
+    atomic_set(&buf->committed, 0);
+    WRITE_ONCE(buf->used, 0);
+    smp_store_release(&buf->busy, false);
+
+    wake_up_all(&stream->io_wait);
+    if (wq_has_sleeper(&stream->space_wait)) {
+        wake_up_all(&stream->space_wait);
+    }
+
+    /* Активный буфер мог заполниться, пока этот писался */
+    if (state->module_active &&
+        TM_HEAD_SLOT(atomic64_read(&stream->head)) >= stream->bufs[0].nr_slots) {
+        mod_delayed_work(state->wq, &stream->flush_work, 0);
+    }
+}
+
+static void tm_buf_put(struct tm_stream *stream, struct tm_buf *buf)
+{
+    if (atomic_dec_and_test(&buf->io_pending)) {
+        tm_buf_release(stream, buf);
+    }
+}
+
+/*
+ * Делает активным следующий буфер и отдает writer'у заполненный. Резервации,
+ * сделанные до обмена, дописываются producer'ами с выключенной preemption,
+ * поэтому ожидание committed короткое.
+ */
+static struct tm_buf *tm_stream_swap(struct tm_stream *stream)
+{
+    struct tm_buf *buf;
+    struct tm_buf *next;
+    unsigned int idx;
+    unsigned int next_idx;
+    s64 head;
+
+    head = atomic64_read(&stream->head);
+    if (TM_HEAD_SLOT(head) == 0) {
+        return NULL;
+    }
+
+    idx = TM_HEAD_BUF(head);
+    next_idx = (idx + 1) % stream->nr_bufs;
+    next = &stream->bufs[next_idx];
+
+    /* Следующий буфер может еще писаться асинхронно */
+    wait_event(stream->io_wait, !smp_load_acquire(&next->busy));
+
+    head = atomic64_xchg(&stream->head, TM_HEAD(next_idx, 0));
+
+    buf = &stream->bufs[idx];
+    WRITE_ONCE(buf->used, min(TM_HEAD_SLOT(head), buf->nr_slots));
+    WRITE_ONCE(buf->busy, true);
+    atomic_set(&buf->io_pending, 1);
+
+    while (atomic_read_acquire(&buf->committed) < buf->used) {
+        cpu_relax();
+    }
+
+    if (wq_has_sleeper(&stream->space_wait)) {
+        wake_up_all(&stream->space_wait);
+    }
+
+    return buf;
+}
+
+#define TM_AIO_BYTES (sizeof(struct tm_aio) + TM_IOV_BYTES)
+
+static void tm_aio_free(struct tm_aio *aio)
+{
+    tm_mem_uncharge(aio->stream, TM_MEM_WORK, TM_AIO_BYTES);
+    kfree(aio->iov);
+    kfree(aio);
+}
+
+/*
+ * Завершает запрос, записавший done байт из len (err - причина
+ * недописанного остатка). Целиком записанные записи попадают в
+ * bytes_written и last_seq, остальные - в io_lost_* до
+ * tm_stream_io_settle().
+ */
+static void tm_aio_complete(struct tm_aio *aio, size_t done, int err)
+{
+    struct tm_stream *stream = aio->stream;
+    u64 lat_ns = ktime_to_ns(ktime_sub(ktime_get(), aio->submitted));
+    unsigned long flags;
+    size_t kept = 0;
+    unsigned int nr;
+
+    for (nr = 0; nr < aio->nr && kept + aio->iov[nr].iov_len <= done; nr++) {
+        kept += aio->iov[nr].iov_len;
+    }
+
+    if (err && err != -ECANCELED) {
+        atomic64_inc(&stream->write_errors);
+        pr_err_ratelimited("test_module: Asynchronous write failed after %zu of %zu bytes, error: %d\n",
+                           done, aio->len, err);
+    }
+    atomic64_add(kept, &stream->bytes_written);
+    atomic64_add(nr, &stream->last_seq);
+
+    atomic64_inc(&stream->flushes);
+    atomic64_add(lat_ns, &stream->io_ns);
+
+    spin_lock_irqsave(&stream->io_lock, flags);
+    if (nr < aio->nr) {
+        if (stream->io_fail_pos < 0 || aio->pos + (loff_t)kept < stream->io_fail_pos) {
+            WRITE_ONCE(stream->io_fail_pos, aio->pos + kept);
+            stream->io_fail_rec = aio->first_rec + nr;
+        }
+        stream->io_lost_bytes += aio->len - kept;
+        stream->io_lost_records += aio->nr - nr;
+    }
+    stream->io_lat_us = (stream->io_lat_us * 7 + (unsigned int)div_u64(lat_ns, NSEC_PER_USEC)) / 8;
+    tm_flush_adapt(stream, lat_ns, aio->len);
+    tm_stats_account_write(stream, lat_ns);
+    spin_unlock_irqrestore(&stream->io_lock, flags);
+
+    tm_buf_put(stream, aio->buf);
+    fput(aio->iocb.ki_filp);
+    tm_aio_free(aio);
+
+    atomic_dec(&stream->io_inflight);
+    wake_up_all(&stream->io_wait);
+}
+
+/*
+ * Пишет iter с позиции pos в обход O_APPEND, с которым открыт файл: без
+ * этого параллельные запросы легли бы в порядке завершения, а не в
+ * зарезервированные диапазоны. С 6.9 это vfs_iter_write() с RWF_NOAPPEND;
+ * на старых ядрах ->write_iter() со сброшенным в tm_flush_async()
+ * IOCB_APPEND, а проверку диапазона и fsnotify_modify() (по нему tm_tail
+ * -f узнает о новых данных) делаем сами: rw_verify_area() модулю
+ * недоступна.
+ */
+static ssize_t tm_aio_write(struct tm_aio *aio, struct iov_iter *iter, loff_t pos)
+{
+    struct file *filp = aio->iocb.ki_filp;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    return vfs_iter_write(filp, iter, &pos, RWF_NOAPPEND);
+#else
+    size_t count = iov_iter_count(iter);
+    ssize_t ret;
+
+    if (pos < 0 || count > MAX_RW_COUNT || pos > LLONG_MAX - (loff_t)count) {
+        return -EINVAL;
+    }
+
+    aio->iocb.ki_pos = pos;
+    file_start_write(filp);
+    ret = filp->f_op->write_iter(&aio->iocb, iter);
+    file_end_write(filp);
+    if (ret > 0) {
+        fsnotify_modify(filp);
+    }
+
+    return ret;
+#endif
+}
+
+/*
+ * Обычная буферизованная запись, выполняемая синхронно в отдельной
+ * очереди, а не в flush_work: writer тем временем готовит следующий пакет.
+ * Недописанный остаток запрос отправляет заново, пока запись продвигается.
+ * Если ниже по файлу запрос уже не дописан, этот не пишется вовсе: его
+ * данные все равно отрезала бы tm_stream_io_settle().
+ */
+static void tm_aio_work(struct work_struct *work)
+{
+    struct tm_aio *aio = container_of(work, struct tm_aio, work);
+    struct tm_stream *stream = aio->stream;
+    struct file *filp = aio->iocb.ki_filp;
+    struct iov_iter iter;
+    loff_t fail_pos;
+    size_t done = 0;
+    ssize_t ret;
+    int err = 0;
+
+    iov_iter_kvec(&iter, ITER_SOURCE, aio->iov, aio->nr, aio->len);
+
+    while (done < aio->len) {
+        fail_pos = READ_ONCE(stream->io_fail_pos);
+        if (fail_pos >= 0 && fail_pos <= aio->pos) {
+            err = -ECANCELED;
+            break;
+        }
+
+        ret = tm_aio_write(aio, &iter, aio->pos + done);
+        if (ret <= 0) {
+            err = ret < 0 ? ret : -EIO;
+            break;
+        }
+        done += ret;
+    }
+
+    if (done && READ_ONCE(flush_fsync)) {
+        ret = vfs_fsync_range(filp, aio->pos, aio->pos + done - 1, 1);
+        if (ret < 0) {
+            atomic64_inc(&stream->write_errors);
+            pr_err_ratelimited("test_module: fsync failed, error: %zd\n", ret);
+        }
+    }
+
+    tm_aio_complete(aio, done, err);
+}
+
+/*
+ * Раздает буфер запросам к очереди test_module_io по TM_MAX_IOV записей,
+ * не больше io_depth в полете. Каждый запрос пишет в заранее
+ * зарезервированный диапазон файла, поэтому порядок их завершения не
+ * важен. Буфер освобождается последним завершившимся запросом.
+ * Возвращает слот, с которого отправить не удалось (нехватка памяти).
+ */
+static unsigned int tm_flush_async(struct tm_stream *stream, struct tm_buf *buf)
+{
+    struct test_module_state *state = stream->state;
+    struct tm_record *record;
+    struct tm_aio *aio;
+    unsigned int slot = 0;
+    unsigned int next;
+    unsigned int depth;
+    unsigned int inflight;
+
+    while (slot < buf->used) {
+        if (!tm_mem_try_charge(stream, TM_MEM_WORK, TM_AIO_BYTES)) {
+            break;
+        }
+
+        aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+        if (aio)
+            aio->iov = kmalloc_array(TM_MAX_IOV, sizeof(*aio->iov), GFP_KERNEL);
+        if (!aio || !aio->iov) {
+            kfree(aio);
+            tm_mem_uncharge(stream, TM_MEM_WORK, TM_AIO_BYTES);
+            break;
+        }
+        aio->stream = stream;
+
+        for (next = slot; next < buf->used && aio->nr < TM_MAX_IOV;
+             next += max(record->slots, 1U)) {
+            record = tm_slot(buf, next);
+            if (!record->len)
+                continue;
+
+            aio->iov[aio->nr].iov_base = record->data;
+            aio->iov[aio->nr].iov_len = record->len;
+            aio->nr++;
+            aio->len += record->len;
+        }
+        slot = next;
+
+        if (!aio->nr) {
+            tm_aio_free(aio);
+            break;
+        }
+
+        depth = clamp(READ_ONCE(io_depth), 1U, (unsigned int)TM_MAX_IO_DEPTH);
+        wait_event(stream->io_wait, atomic_read(&stream->io_inflight) < depth);
+
+        /*
+         * После неудачной записи следующие запросы легли бы за дырой: ждем
+         * остальные и откатываем write_pos. Без запросов в полете догоняем
+         * размер файла: в него мог писать кто-то еще.
+         */
+        if (atomic_read(&stream->io_inflight) == 0 || READ_ONCE(stream->io_fail_pos) >= 0) {
+            tm_stream_io_settle(stream);
+            stream->write_pos = max(stream->write_pos, i_size_read(file_inode(stream->filp)));
+        }
+
+        aio->buf = buf;
+        init_sync_kiocb(&aio->iocb, get_file(stream->filp));
+        aio->iocb.ki_pos = stream->write_pos;
+        aio->iocb.ki_flags &= ~IOCB_APPEND;
+        aio->pos = stream->write_pos;
+        aio->first_rec = stream->io_records;
+        stream->write_pos += aio->len;
+        stream->io_records += aio->nr;
+
+        inflight = atomic_inc_return(&stream->io_inflight);
+        if (inflight > stream->io_peak)
+            WRITE_ONCE(stream->io_peak, inflight);
+
+        atomic_inc(&buf->io_pending);
+        aio->submitted = ktime_get();
+        INIT_WORK(&aio->work, tm_aio_work);
+        queue_work(state->io_wq, &aio->work);
+    }
+
+    return slot;
+}
+
+static bool tm_stream_io_busy(struct tm_stream *stream)
+{
+    unsigned int i;
+
+    for (i = 0; i < stream->nr_bufs; i++) {
+        if (smp_load_acquire(&stream->bufs[i].busy))
+            return true;
+    }
+
+    return false;
+}
+
+/* Сброс, которому не хватило бы половины резервного буфера, считается активностью */
+static bool tm_stream_bulk(struct tm_buf *buf)
+{
+    return buf->used * TM_SLOT_SIZE >= reserve_kb * 1024 / 2;
+}
+
+static bool tm_stream_idle(struct tm_stream *stream)
+{
+    unsigned int idle_s = READ_ONCE(shrink_idle_s);
+
+    return idle_s && !READ_ONCE(stream->shrunk) &&
+           time_after(jiffies, READ_ONCE(stream->last_busy) + idle_s * HZ);
+}
+
+/*
+ * Сколько освободит tm_stream_shrink(): ring и буферы sink'а. Кольцо
+ * recent и сегмент bdev тоже учтены в бюджете, но остаются у потока.
+ * Читается без ring_lock, поэтому только оценка.
+ */
+static size_t tm_stream_reclaimable(struct tm_stream *stream)
+{
+    size_t bytes = READ_ONCE(stream->buf_size);
+
+    if (READ_ONCE(stream->ring)) {
+        bytes += PAGE_ALIGN(READ_ONCE(stream->ring_size));
+    }
+    if (READ_ONCE(stream->iov)) {
+        bytes += TM_IOV_BYTES;
+    }
+
+    return bytes;
+}
+
+/*
+ * Переводит простаивающий поток на резервные буферы и освобождает ring и
+ * буферы writer'а. Вызывается под ring_lock. Пустой активный буфер
+ * паркуется через cmpxchg: если producer успел зарезервировать место,
+ * поток не простаивает и трогать его нельзя.
+ */
+static bool tm_stream_shrink(struct tm_stream *stream)
+{
+    s64 head = atomic64_read(&stream->head);
+
+    if (stream->shrunk || TM_HEAD_SLOT(head) != 0 || tm_stream_io_busy(stream)) {
+        return false;
+    }
+
+    if (!atomic64_try_cmpxchg(&stream->head, &head, TM_HEAD(TM_HEAD_BUF(head), TM_HEAD_PARKED))) {
+        return false;
+    }
+
+    tm_stream_set_bufs(stream, stream->reserve, (size_t)reserve_kb * 1024);
+    tm_ring_free(stream);
+    tm_stream_free_sink(stream);
+    WRITE_ONCE(stream->shrunk, true);
+
+    atomic64_set_release(&stream->head, TM_HEAD(0, 0));
+    wake_up_all(&stream->space_wait);
+    return true;
+}
+
+/*
+ * Возвращает потоку полноразмерные буферы, когда трафик возобновился.
+ * Записи адресуются относительно начала буфера, поэтому недописанный
+ * активный резервный буфер просто копируется в начало нового ring.
+ */
+static void tm_stream_regrow(struct tm_stream *stream)
+{
+    struct tm_buf *active;
+    unsigned int used;
+    s64 head;
+
+    wait_event(stream->io_wait, !tm_stream_io_busy(stream));
+
+    if (tm_mem_exceeds((size_t)buffer_kb * 1024 * nr_buffers)) {
+        atomic64_inc(&tm_mem_denied);
+        return;
+    }
+
+    if (tm_ring_alloc(stream) < 0) {
+        pr_warn_ratelimited("test_module: Failed to regrow buffers of stream %u\n", stream->id);
+        return;
+    }
+
+    head = atomic64_xchg(&stream->head, TM_HEAD(0, TM_HEAD_PARKED));
+    active = &stream->bufs[TM_HEAD_BUF(head)];
+    used = min(TM_HEAD_SLOT(head), active->nr_slots);
+
+    while (atomic_read_acquire(&active->committed) < used) {
+        cpu_relax();
+    }
+
+    memcpy(stream->ring, active->slots, (size_t)used * TM_SLOT_SIZE);
+    tm_stream_set_bufs(stream, stream->ring, (size_t)buffer_kb * 1024);
+    atomic_set(&stream->bufs[0].committed, used);
+    WRITE_ONCE(stream->shrunk, false);
+
+    atomic64_set_release(&stream->head, TM_HEAD(0, used));
+    wake_up_all(&stream->space_wait);
+}
+
+static unsigned int tm_recent_index(u64 seq)
+{
+    u32 rem;
+
+    div_u64_rem(seq, recent_records, &rem);
+    return rem;
+}
+
+/*
+ * Копирует готовую запись в кольцо потока при commit, а не при сбросе:
+ * запись видна в /proc, даже пока writer стоит на зависшей записи и
+ * активный буфер не обменивается. Может вызываться из прерывания. Слот
+ * занимается cmpxchg его version; если слот еще копирует запись прошлого
+ * круга (recent_records commit'ов одновременно), эта запись в кольцо не
+ * попадает.
+ */
+static void tm_recent_add(struct tm_stream *stream, const struct tm_record *record)
+{
+    u64 seq = atomic64_inc_return(&stream->recent_seq) - 1;
+    struct tm_recent *entry = &stream->recent[tm_recent_index(seq)];
+    s64 version = atomic64_read(&entry->version);
+
+    if ((version & 1) || version > 2 * seq ||
+        !atomic64_try_cmpxchg(&entry->version, &version, 2 * seq + 1)) {
+        return;
+    }
+
+    entry->seq = seq;
+    entry->stream = stream->id;
+    entry->len = min_t(unsigned int, record->len, sizeof(entry->data));
+    memcpy(entry->data, record->data, entry->len);
+    atomic64_set_release(&entry->version, 2 * seq + 2);
+}
+
+/*
+ * Отключает читателей, чьи неподтвержденные данные окажутся перезаписаны,
+ * когда кольцо дойдет до head: writer никогда не ждет читателей.
+ */
+static void tm_readers_reclaim(struct test_module_state *state, u64 head)
+{
+    u64 low = head > state->rd_size ? head - state->rd_size : 0;
+    struct tm_reader *reader;
+
+    list_for_each_entry(reader, &state->readers, node) {
+        if (reader->detached || reader->acked >= low)
+            continue;
+
+        WRITE_ONCE(reader->detached, true);
+        reader->detach_lag = state->rd_head - reader->acked;
+        state->nr_attached--;
+        atomic64_inc(&state->readers_detached);
+        pr_warn_ratelimited("test_module: Reader %u (%s, pid %d) lagged by %llu bytes and was detached\n",
+                            reader->id, reader->comm, reader->pid, reader->detach_lag);
+    }
+}
+
+/* Копирует записи буфера в кольцо читателей; из пакета больше кольца - только хвост */
+static void tm_readers_feed(struct tm_stream *stream, struct tm_buf *buf)
+{
+    struct test_module_state *state = stream->state;
+    struct tm_record *record;
+    unsigned int slot;
+    size_t total = 0;
+    u64 pos;
+    u64 low;
+
+    if (!READ_ONCE(state->nr_attached)) {
+        return;
+    }
+
+    for (slot = 0; slot < buf->used; slot += max(record->slots, 1U)) {
+        record = tm_slot(buf, slot);
+        total += record->len;
+    }
+
+    if (!total) {
+        return;
+    }
+
+    mutex_lock(&state->readers_lock);
+    tm_readers_reclaim(state, state->rd_head + total);
+
+    pos = state->rd_head;
+    low = total > state->rd_size ? pos + total - state->rd_size : pos;
+    for (slot = 0; slot < buf->used; slot += max(record->slots, 1U)) {
+        const char *src;
+        size_t len;
+        size_t n;
+        u32 off;
+
+        record = tm_slot(buf, slot);
+        src = record->data;
+        len = record->len;
+        if (pos < low) {
+            size_t skip = min_t(u64, low - pos, len);
+
+            src += skip;
+            len -= skip;
+        }
+
+        div_u64_rem(pos + record->len - len, state->rd_size, &off);
+        n = min_t(size_t, len, state->rd_size - off);
+        memcpy(state->rd_ring + off, src, n);
+        memcpy(state->rd_ring, src + n, len - n);
+        pos += record->len;
+    }
+    WRITE_ONCE(state->rd_head, pos);
+    mutex_unlock(&state->readers_lock);
+
+    if (wq_has_sleeper(&state->readers_wait)) {
+        wake_up_interruptible(&state->readers_wait);
+    }
+}
+
+static void flush_work_handler(struct work_struct *work)
+{
+    struct tm_stream *stream = container_of(to_delayed_work(work), struct tm_stream, flush_work);
+    struct tm_buf *buf;
+    unsigned int first = 0;
+    size_t total = 0;
+    u64 io_ns = 0;
+    u64 fsync_ns;
+    ktime_t start;
+    unsigned long flags;
+    bool bulk;
+    int ret;
+
+    mutex_lock(&stream->ring_lock);
+
+    buf = tm_stream_swap(stream);
+    if (!buf) {
+        goto out;
+    }
+
+    bulk = tm_stream_bulk(buf);
+    if (bulk) {
+        WRITE_ONCE(stream->last_busy, jiffies);
+    }
+
+    tm_readers_feed(stream, buf);
+
+    /* Лог на блочном устройстве: без файла, kiocb и fsync */
+    if (stream->bdev_log) {
+        io_ns = tm_bdev_flush(stream, buf, &total);
+        tm_buf_put(stream, buf);
+        goto account;
+    }
+
+    /* Лог в shmem: копия в кольцо, читатели ждут через poll /dev/test_module */
+    if (tm_shm.header) {
+        io_ns = tm_shm_flush(stream, buf, &total);
+        tm_buf_put(stream, buf);
+        goto account;
+    }
+
+    ret = tm_stream_open(stream);
+    if (ret < 0) {
+        atomic64_inc(&stream->write_errors);
+        tm_buf_put(stream, buf);
+        goto out;
+    }
+
+    if (READ_ONCE(io_depth) && stream->state->io_wq && stream->filp->f_op->write_iter) {
+        first = tm_flush_async(stream, buf);
+        if (first >= buf->used) {
+            tm_buf_put(stream, buf);
+            goto regrow;
+        }
+    }
+
+    /*
+     * Синхронная запись идет в конец файла: сначала ждем запросы этого и
+     * прошлых пакетов (io_depth могли выключить, пока они в полете).
+     */
+    tm_stream_io_settle(stream);
+
+    tm_stream_buffer(stream);
+
+    if (READ_ONCE(write_vectored) && stream->iov)
+        io_ns = tm_flush_vectored(stream, buf, first, &total);
+    else
+        io_ns = tm_flush_copy(stream, buf, first, &total);
+
+    tm_buf_put(stream, buf);
+
+    if (READ_ONCE(flush_fsync)) {
+        start = ktime_get();
+        ret = vfs_fsync(stream->filp, 1);
+        if (ret < 0) {
+            atomic64_inc(&stream->write_errors);
+            pr_err_ratelimited("test_module: fsync failed, error: %d\n", ret);
+        }
+        fsync_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+        stream->fsync_lat_us = (unsigned int)div_u64(fsync_ns, NSEC_PER_USEC);
+        io_ns += fsync_ns;
+    }
+
+account:
+    atomic64_inc(&stream->flushes);
+    atomic64_add(io_ns, &stream->io_ns);
+
+    spin_lock_irqsave(&stream->io_lock, flags);
+    tm_flush_adapt(stream, io_ns, total);
+    tm_stats_account_write(stream, io_ns);
+    spin_unlock_irqrestore(&stream->io_lock, flags);
+
+regrow:
+    if (bulk && stream->shrunk && stream->state->module_active) {
+        tm_stream_regrow(stream);
+    }
+out:
+    mutex_unlock(&stream->ring_lock);
+}
+
+/*
+ * Шард потока для записи: по CPU - записи одного CPU идут в один файл без
+ * конкуренции за head, по producer'у - записи producer'а остаются в одном файле.
+ */
+static struct tm_stream *tm_shard(struct tm_producer *producer)
+{
+    struct tm_stream *stream = producer->stream;
+    struct test_module_state *state = stream->state;
+    unsigned int shard;
+
+    if (state->nr_shards <= 1) {
+        return stream;
+    }
+
+    if (READ_ONCE(shard_by_cpu))
+        shard = raw_smp_processor_id() % state->nr_shards;
+    else
+        shard = producer->id % state->nr_shards;
+
+    if (shard == 0) {
+        return stream;
+    }
+
+    return &state->streams[state->nr_streams + stream->id * (state->nr_shards - 1) + shard - 1];
+}
+
+/*
+ * Точка входа всех записей: проверка лимитов и резервирование места в
+ * активном буфере потока. При успехе возвращает 0 с выключенной preemption;
+ * producer заполняет ref->data и обязан вызвать tm_commit(). Если
+ * gfp допускает сон, при заполненных буферах producer ждет обмена буферов
+ * до backpressure_ms вместо немедленного отбрасывания записи.
+ */
+static int tm_reserve(struct tm_producer *producer, unsigned int len, gfp_t gfp,
+                      struct tm_slot_ref *ref)
+{
+    struct tm_stream *stream = tm_shard(producer);
+    struct test_module_state *state = stream->state;
+    unsigned int hdr = state->nr_shards > 1 ? TM_SHARD_HDR_LEN : 0;
+    unsigned int slots = tm_record_slots(hdr + len);
+    struct tm_record *record;
+    struct tm_buf *buf;
+    unsigned int idx;
+    unsigned int slot;
+    bool waited = false;
+    s64 head;
+
+    if (!state->wq || !state->module_active) {
+        return -ESHUTDOWN;
+    }
+
+    if (tm_ratelimit(producer) == TM_DROP) {
+        return -EBUSY;
+    }
+
+retry:
+    /* Превышение бюджета памяти обрабатывается так же, как заполненный буфер */
+    if (tm_mem_over_budget()) {
+        idx = TM_HEAD_BUF(atomic64_read(&stream->head));
+        goto full;
+    }
+
+    preempt_disable();
+
+    /* Не сдвигаем head заполненного буфера, иначе счетчик слотов может переполниться */
+    head = atomic64_read(&stream->head);
+    idx = TM_HEAD_BUF(head);
+    if (TM_HEAD_SLOT(head) >= READ_ONCE(stream->bufs[idx].nr_slots)) {
+        preempt_enable();
+        goto full;
+    }
+
+    head = atomic64_fetch_add(slots, &stream->head);
+    idx = TM_HEAD_BUF(head);
+    slot = TM_HEAD_SLOT(head);
+    buf = &stream->bufs[idx];
+
+    if (slot + slots <= buf->nr_slots) {
+        record = tm_slot(buf, slot);
+        record->len = hdr + len;
+        record->slots = slots;
+
+        /*
+         * seq берется отдельно от слота: прерывание или другой CPU между
+         * ними может занять следующий слот с меньшим seq. Блокировка на
+         * каждую запись стоила бы больше, чем почти-порядок внутри шарда,
+         * который tm_merge упорядочивает окном.
+         */
+        if (hdr) {
+            snprintf(record->data, hdr + 1, "%016llx %016llx ",
+                     (u64)atomic64_inc_return(&stream->parent->shard_seq), ktime_get_real_ns());
+        }
+
+        ref->stream = stream;
+        ref->buf = buf;
+        ref->record = record;
+        ref->data = record->data + hdr;
+        ref->slot = slot;
+        return 0;
+    }
+
+    if (slot < buf->nr_slots) {
+        /* Запись не поместилась в хвост буфера: помечаем хвост пустым и будим writer */
+        record = tm_slot(buf, slot);
+        record->len = 0;
+        record->slots = buf->nr_slots - slot;
+        atomic_add_return_release(record->slots, &buf->committed);
+        preempt_enable();
+        mod_delayed_work(state->wq, &stream->flush_work, 0);
+    } else {
+        preempt_enable();
+    }
+
+full:
+    if (!waited && gfpflags_allow_blocking(gfp) && READ_ONCE(backpressure_ms)) {
+        waited = true;
+        wait_event_timeout(stream->space_wait,
+                           !state->module_active ||
+                           (!tm_mem_over_budget() &&
+                            (TM_HEAD_BUF(atomic64_read(&stream->head)) != idx ||
+                             TM_HEAD_SLOT(atomic64_read(&stream->head)) <
+                             READ_ONCE(stream->bufs[idx].nr_slots))),
+                           msecs_to_jiffies(READ_ONCE(backpressure_ms)));
+        if (state->module_active)
+            goto retry;
+    }
+
+    atomic64_inc(&stream->overflow);
+    return -ENOBUFS;
+}
+
+static void tm_commit(struct tm_slot_ref *ref)
+{
+    struct tm_stream *stream = ref->stream;
+    struct test_module_state *state = stream->state;
+    unsigned int batch = DIV_ROUND_UP(READ_ONCE(stream->batch_bytes), TM_SLOT_SIZE);
+    unsigned int end = ref->slot + ref->record->slots;
+
+    if (stream->recent)
+        tm_recent_add(stream, ref->record);
+
+    atomic_add_return_release(ref->record->slots, &ref->buf->committed);
+    preempt_enable();
+
+    /* Будим writer немедленно только при пересечении порога пакета */
+    if (end >= batch && ref->slot < batch) {
+        mod_delayed_work(state->wq, &stream->flush_work, 0);
+    } else if (ref->slot == 0) {
+        queue_delayed_work(state->wq, &stream->flush_work,
+                           msecs_to_jiffies(READ_ONCE(stream->deadline_ms)));
+    }
+}
+
+static void tm_stream_arm(struct tm_stream *stream)
+{
+    unsigned long delay;
+
+    delay = msecs_to_jiffies(READ_ONCE(timer_period) * 1000);
+    if (delay == 0)
+        delay = 1;
+
+    if (READ_ONCE(process_ticks)) {
+        if (READ_ONCE(timer_deferrable[stream->id])) {
+            delay = round_jiffies_relative(delay);
+            stream->expires = jiffies + delay;
+            queue_delayed_work(system_unbound_wq, &stream->idle_tick_work, delay);
+        } else {
+            stream->expires = jiffies + delay;
+            queue_delayed_work(system_unbound_wq, &stream->tick_work, delay);
+        }
+    } else if (READ_ONCE(timer_deferrable[stream->id])) {
+        /* round_jiffies() выравнивает на границу секунды, чтобы тики разных таймеров совпадали */
+        stream->expires = round_jiffies(jiffies + delay);
+        mod_timer(&stream->idle_timer, stream->expires);
+    } else {
+        stream->expires = jiffies + delay;
+        mod_timer(&stream->write_timer, stream->expires);
+    }
+}
+
+/*
+ * Таймеры и tick work могут перевзводить друг друга при смене режима,
+ * поэтому после сброса module_active останавливаем их в таком порядке.
+ */
+static void tm_stream_stop_ticks(struct tm_stream *stream)
+{
+    timer_delete_sync(&stream->write_timer);
+    timer_delete_sync(&stream->idle_timer);
+    cancel_delayed_work_sync(&stream->tick_work);
+    cancel_delayed_work_sync(&stream->idle_tick_work);
+    timer_delete_sync(&stream->write_timer);
+    timer_delete_sync(&stream->idle_timer);
+}
+
+static void stream_tick(struct tm_stream *stream)
+{
+    struct test_module_state *state;
+    struct tm_producer *heartbeat;
+    struct tm_slot_ref ref;
+    char line[64];
+    int len;
+    unsigned int counter;
+    unsigned int late_us;
+    unsigned int cost_ns;
+    bool softirq = !in_task();
+    gfp_t gfp = softirq ? GFP_ATOMIC : GFP_KERNEL;
+    ktime_t start = ktime_get();
+    unsigned long flags;
+
+    state = stream->state;
+
+    if (!state || !module_state || state != module_state) {
+        pr_warn("test_module: Timer callback called with invalid state\n");
+        return;
+    }
+
+    if (!state->module_active) {
+        pr_warn("test_module: Timer callback called after module deactivation\n");
+        return;
+    }
+
+    late_us = jiffies_to_usecs(time_after(jiffies, stream->expires) ? jiffies - stream->expires : 0);
+    WRITE_ONCE(stream->tick_late_us, (stream->tick_late_us * 7 + late_us) / 8);
+
+    counter = atomic_inc_return(&stream->write_counter);
+
+    if (counter == 0) {
+        atomic_set(&stream->write_counter, 1);
+        counter = 1;
+    }
+
+    len = snprintf(line, sizeof(line), "Hello from kernel module (%u)\n", counter);
+    if (len < 0) {
+        pr_err("test_module: snprintf failed\n");
+        goto reschedule;
+    }
+
+    /* Heartbeat-producer потока i всегда занимает слот i */
+    heartbeat = &state->producers[stream->id];
+    if (!tm_filter_drops(heartbeat, TM_SEV_INFO, line, len) &&
+        tm_reserve(heartbeat, len, gfp, &ref) == 0) {
+        memcpy(ref.data, line, len + 1);
+        tm_commit(&ref);
+    }
+
+    cost_ns = (unsigned int)min_t(s64, ktime_to_ns(ktime_sub(ktime_get(), start)), NSEC_PER_SEC);
+    if (softirq) {
+        WRITE_ONCE(stream->tick_softirq_ns, (stream->tick_softirq_ns * 7 + cost_ns) / 8);
+    } else {
+        WRITE_ONCE(stream->tick_process_ns, (stream->tick_process_ns * 7 + cost_ns) / 8);
+    }
+
+    /* Счетчики отброшенных записей меняются и без сбросов, публикуем их каждый тик */
+    spin_lock_irqsave(&stream->io_lock, flags);
+    tm_heartbeat_publish(stream, counter);
+    tm_stats_publish(stream);
+    spin_unlock_irqrestore(&stream->io_lock, flags);
+
+reschedule:
+    /* Проверяем module_active еще раз перед перепланированием таймера */
+    spin_lock_irqsave(&stream->tick_lock, flags);
+    if (state && state->module_active && timer_period > 0) {
+        tm_stream_arm(stream);
+    }
+    spin_unlock_irqrestore(&stream->tick_lock, flags);
+}
+
+static void timer_callback(struct timer_list *t)
+{
+    stream_tick(container_of(t, struct tm_stream, write_timer));
+}
+
+static void deferrable_timer_callback(struct timer_list *t)
+{
+    stream_tick(container_of(t, struct tm_stream, idle_timer));
+}
+
+static void tick_work_handler(struct work_struct *work)
+{
+    stream_tick(container_of(to_delayed_work(work), struct tm_stream, tick_work));
+}
+
+static void idle_tick_work_handler(struct work_struct *work)
+{
+    stream_tick(container_of(to_delayed_work(work), struct tm_stream, idle_tick_work));
+}
+
+struct tm_producer *tm_producer_register(const char *name, unsigned int stream)
+{
+    struct test_module_state *state = module_state;
+    struct tm_producer *producer = ERR_PTR(-ENOSPC);
+    unsigned int i;
+
+    if (!state || !state->module_active) {
+        return ERR_PTR(-ESHUTDOWN);
+    }
+
+    if (!name || stream >= state->nr_streams) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    mutex_lock(&state->producers_lock);
+    for (i = 0; i < TM_MAX_PRODUCERS; i++) {
+        struct tm_producer *p = &state->producers[i];
+
+        if (p->in_use || p->retiring)
+            continue;
+
+        memset(p, 0, sizeof(*p));
+        p->id = i;
+        p->stream = &state->streams[stream];
+        strscpy(p->name, name, sizeof(p->name));
+        p->in_use = true;
+        producer = p;
+
+        /* Правила с условиями на поток и имя должны увидеть нового producer'а */
+        if (filter_rules[0] && tm_filter_rebuild(state) < 0)
+            pr_warn("test_module: Failed to update the filter for %s\n", name);
+        break;
+    }
+    mutex_unlock(&state->producers_lock);
+
+    if (IS_ERR(producer)) {
+        pr_warn("test_module: No free producer slots for %s\n", name);
+    } else {
+        pr_info("test_module: Registered producer %u (%s) on stream %u\n",
+                producer->id, producer->name, stream);
+    }
+
+    return producer;
+}
+EXPORT_SYMBOL_GPL(tm_producer_register);
+
+void tm_producer_unregister(struct tm_producer *producer)
+{
+    struct test_module_state *state = module_state;
+
+    if (IS_ERR_OR_NULL(producer) || !state) {
+        return;
+    }
+
+    mutex_lock(&state->producers_lock);
+    WRITE_ONCE(producer->in_use, false);
+    producer->retiring = true;
+    mutex_unlock(&state->producers_lock);
+
+    /*
+     * tm_vlog() проверяет in_use и пишет запись под rcu_read_lock(): после
+     * grace period ни один tm_log() этого producer'а уже не выполняется, и
+     * слот можно отдать следующему tm_producer_register().
+     */
+    synchronize_rcu();
+
+    mutex_lock(&state->producers_lock);
+    producer->retiring = false;
+    mutex_unlock(&state->producers_lock);
+}
+EXPORT_SYMBOL_GPL(tm_producer_unregister);
+
+/*
+ * Фильтр проверяется до форматирования: отброшенная по потоку, producer'у
+ * или уровню запись стоит одного поиска в таблице. Если решение зависит
+ * от префикса, он получается тем же vsnprintf(), что считает длину.
+ */
+static int tm_vlog(struct tm_producer *producer, unsigned int sev, const char *fmt, va_list args)
+{
+    char prefix[TM_FILTER_PREFIX_MAX + 1];
+    enum tm_filter_verdict verdict = TM_FILTER_KEEP;
+    struct tm_filter *filter;
+    struct tm_slot_ref ref;
+    va_list copy;
+    int len = 0;
+    int ret;
+
+    if (IS_ERR_OR_NULL(producer) || !fmt || sev >= TM_SEV_NR) {
+        return -EINVAL;
+    }
+
+    /* Держится до tm_commit(): tm_producer_unregister() ждет grace period */
+    rcu_read_lock();
+    if (!READ_ONCE(producer->in_use)) {
+        ret = -EINVAL;
+        goto out_unlock;
+    }
+
+    filter = rcu_dereference(producer->stream->state->filter);
+    if (filter)
+        verdict = tm_filter_match(filter, producer->id, sev, NULL, 0);
+
+    va_copy(copy, args);
+    if (verdict == TM_FILTER_TEXT) {
+        len = vsnprintf(prefix, sizeof(prefix), fmt, copy);
+        if (len >= 0)
+            verdict = tm_filter_match(filter, producer->id, sev, prefix,
+                                      min_t(unsigned int, len, sizeof(prefix) - 1));
+    } else if (verdict == TM_FILTER_KEEP) {
+        len = vsnprintf(NULL, 0, fmt, copy);
+    }
+    va_end(copy);
+
+    if (verdict == TM_FILTER_DROP) {
+        tm_filter_count(producer);
+        ret = 0;
+        goto out_unlock;
+    }
+
+    if (len <= 0) {
+        ret = len < 0 ? -EINVAL : 0;
+        goto out_unlock;
+    }
+
+    len = min(len, TM_MAX_RECORD_LEN);
+
+    ret = tm_reserve(producer, len, GFP_ATOMIC, &ref);
+    if (ret < 0) {
+        goto out_unlock;
+    }
+
+    vsnprintf(ref.data, len + 1, fmt, args);
+
+    tm_commit(&ref);
+
+out_unlock:
+    rcu_read_unlock();
+    return ret;
+}
+
+int tm_log(struct tm_producer *producer, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = tm_vlog(producer, TM_SEV_INFO, fmt, args);
+    va_end(args);
+
+    return ret;
+}
+EXPORT_SYMBOL_GPL(tm_log);
+
+int tm_log_sev(struct tm_producer *producer, enum tm_severity sev, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = tm_vlog(producer, sev, fmt, args);
+    va_end(args);
+
+    return ret;
+}
+EXPORT_SYMBOL_GPL(tm_log_sev);
+
+/* Продолжает строку stats байтами по классам аллокаций и завершает ее */
+static int tm_mem_show(struct tm_mem *mem, bool peaks, char *buffer, size_t size)
+{
+    int len = 0;
+    int cls;
+
+    for (cls = 0; cls < TM_MEM_NR; cls++) {
+        len += scnprintf(buffer + len, size - len, " mem_%s=%lld",
+                         tm_mem_names[cls], atomic64_read(&mem->live[cls]));
+        if (peaks)
+            len += scnprintf(buffer + len, size - len, " mem_%s_peak=%lld",
+                             tm_mem_names[cls], atomic64_read(&mem->peak[cls]));
+    }
+
+    len += scnprintf(buffer + len, size - len, "\n");
+    return len;
+}
+
+/*
+ * Сводка для параметра stats, который ограничен PAGE_SIZE: по строке на
+ * writer и общие счетчики. Все поля writer'ов, producer'ы и читатели -
+ * в /proc/test_module/{streams,producers,readers}.
+ */
+static int stats_get(char *buffer, const struct kernel_param *kp)
+{
+    static const char truncated[] = "\n(truncated)\n";
+    struct test_module_state *state = module_state;
+    unsigned int producers = 0;
+    int len = 0;
+    unsigned int i;
+
+    if (!state) {
+        return scnprintf(buffer, PAGE_SIZE, "inactive\n");
+    }
+
+    for (i = 0; i < state->nr_writers; i++) {
+        struct tm_stream *stream = &state->streams[i];
+
+        len += scnprintf(buffer + len, PAGE_SIZE - len,
+                         "stream %u: parent=%u shard=%u accepted=%lld dropped=%lld filtered=%lld "
+                         "overflow=%lld backlog=%zu bytes=%lld write_errors=%lld mem=%lld\n",
+                         i, stream->parent->id, stream->shard,
+                         atomic64_read(&stream->counters.accepted),
+                         atomic64_read(&stream->counters.dropped),
+                         atomic64_read(&stream->counters.filtered),
+                         atomic64_read(&stream->overflow),
+                         tm_stream_backlog(stream),
+                         atomic64_read(&stream->bytes_written),
+                         atomic64_read(&stream->write_errors),
+                         atomic64_read(&stream->mem.total));
+    }
+
+    len += scnprintf(buffer + len, PAGE_SIZE - len,
+                     "memory: budget_kb=%u live=%lld peak=%lld denied=%lld",
+                     READ_ONCE(mem_budget_kb),
+                     atomic64_read(&tm_mem_global.total),
+                     atomic64_read(&tm_mem_global.total_peak),
+                     atomic64_read(&tm_mem_denied));
+    len += tm_mem_show(&tm_mem_global, true, buffer + len, PAGE_SIZE - len);
+    len += scnprintf(buffer + len, PAGE_SIZE - len, "config: generation=%lld\n",
+                     atomic64_read(&state->config_gen));
+
+    mutex_lock(&state->producers_lock);
+    for (i = 0; i < TM_MAX_PRODUCERS; i++) {
+        if (state->producers[i].in_use)
+            producers++;
+    }
+    mutex_unlock(&state->producers_lock);
+    len += scnprintf(buffer + len, PAGE_SIZE - len, "producers: registered=%u\n", producers);
+
+    if (state->rd_ring) {
+        mutex_lock(&state->readers_lock);
+        len += scnprintf(buffer + len, PAGE_SIZE - len,
+                         "readers: ring_kb=%u head=%llu attached=%u detached=%lld\n",
+                         reader_ring_kb, state->rd_head, state->nr_attached,
+                         atomic64_read(&state->readers_detached));
+        mutex_unlock(&state->readers_lock);
+    }
+
+    /* scnprintf() молча отбрасывает хвост: помечаем обрезанный вывод */
+    if (len >= PAGE_SIZE - 1) {
+        memcpy(buffer + PAGE_SIZE - sizeof(truncated), truncated, sizeof(truncated));
+        len = PAGE_SIZE - 1;
+        pr_warn_once("test_module: stats output exceeds %lu bytes and was truncated\n", PAGE_SIZE);
+    }
+
+    return len;
+}
+
+static const struct kernel_param_ops stats_ops = {
+    .get = stats_get,
+};
+
+module_param_cb(stats, &stats_ops, NULL, 0444);
+MODULE_PARM_DESC(stats, "Summary counters (read-only); details in /proc/test_module/{streams,producers,readers}");
+
+/* Нагрузочный producer для сравнения режимов записи: "N" или "stream N" */
+static void bench_work_handler(struct work_struct *work)
+{
+    struct test_module_state *state = container_of(work, struct test_module_state, bench_work);
+    struct tm_producer *producer;
+    struct tm_slot_ref ref;
+    char line[32];
+    int remaining;
+    int len;
+
+    producer = tm_producer_register("bench", state->bench_stream);
+    if (IS_ERR(producer)) {
+        atomic_set(&state->bench_remaining, 0);
+        return;
+    }
+
+    while (state->module_active &&
+           (remaining = atomic_dec_return(&state->bench_remaining)) >= 0) {
+        len = snprintf(line, sizeof(line), "Benchmark record %d\n", remaining);
+        if (!tm_filter_drops(producer, TM_SEV_DEBUG, line, len) &&
+            tm_reserve(producer, len, GFP_KERNEL, &ref) == 0) {
+            memcpy(ref.data, line, len + 1);
+            tm_commit(&ref);
+        }
+        cond_resched();
+    }
+
+    atomic_set(&state->bench_remaining, 0);
+    tm_producer_unregister(producer);
+}
+
+static int bench_set(const char *val, const struct kernel_param *kp)
+{
+    struct test_module_state *state = module_state;
+    unsigned int stream = 0;
+    unsigned int count;
+
+    if (!state || !state->module_active) {
+        return -ENODEV;
+    }
+
+    if (sscanf(val, "%u %u", &stream, &count) != 2) {
+        stream = 0;
+        if (kstrtouint(val, 10, &count) != 0) {
+            return -EINVAL;
+        }
+    }
+
+    if (stream >= state->nr_streams || count == 0 || count > INT_MAX) {
+        return -EINVAL;
+    }
+
+    if (atomic_read(&state->bench_remaining) > 0 || work_pending(&state->bench_work)) {
+        return -EBUSY;
+    }
+
+    state->bench_stream = stream;
+    atomic_set(&state->bench_remaining, count);
+    queue_work(system_unbound_wq, &state->bench_work);
+
+    return 0;
+}
+
+static int bench_get(char *buffer, const struct kernel_param *kp)
+{
+    struct test_module_state *state = module_state;
+
+    return scnprintf(buffer, PAGE_SIZE, "%d\n",
+                     state ? max(atomic_read(&state->bench_remaining), 0) : 0);
+}
+
+static const struct kernel_param_ops bench_ops = {
+    .set = bench_set,
+    .get = bench_get,
+};
+
+module_param_cb(bench_records, &bench_ops, NULL, 0644);
+MODULE_PARM_DESC(bench_records, "Generate N benchmark records (\"N\" or \"stream N\"), reads back the remaining count");
+
+/*
+ * Все параметры модуля одним чтением: "generation=N" и строки
+ * "name=value". sysfs вызывает get() под kernel_param_lock(), поэтому
+ * значения согласованы между собой и с поколением.
+ */
+static int config_get(char *buffer, const struct kernel_param *kp)
+{
+    struct test_module_state *state = module_state;
+    const struct kernel_param *param;
+    char *value;
+    unsigned int i;
+    int len;
+    int n;
+
+    value = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!value) {
+        return -ENOMEM;
+    }
+
+    len = scnprintf(buffer, PAGE_SIZE, "generation=%lld\n",
+                    state ? atomic64_read(&state->config_gen) : 0);
+
+    for (i = 0; i < THIS_MODULE->num_kp; i++) {
+        param = &THIS_MODULE->kp[i];
+
+        /* Пропускаем себя, счетчики и параметры без значения */
+        if (param == kp || !param->ops->get || param->ops->get == stats_get ||
+            param->ops->get == bench_get)
+            continue;
+
+        n = param->ops->get(value, param);
+        if (n < 0)
+            continue;
+        while (n > 0 && value[n - 1] == '\n')
+            n--;
+
+        if (len + strlen(param->name) + n + 2 >= PAGE_SIZE) {
+            kfree(value);
+            return -E2BIG;
+        }
+
+        len += scnprintf(buffer + len, PAGE_SIZE - len, "%s=%.*s\n", param->name, n, value);
+    }
+
+    kfree(value);
+    return len;
+}
+
+static const struct kernel_param_ops config_ops = {
+    .get = config_get,
+};
+
+module_param_cb(config, &config_ops, NULL, 0444);
+MODULE_PARM_DESC(config, "All parameters and the config generation (counts TM_IOC_SET_PARAM changes only) in one read (read-only)");
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+#define pde_data(inode) PDE_DATA(inode)
+#endif
+
+/* Копирует запись seq потока; false, если она не дописана или уже перезаписана */
+static bool tm_recent_read(struct tm_stream *stream, u64 seq, struct tm_recent *copy)
+{
+    struct tm_recent *entry = &stream->recent[tm_recent_index(seq)];
+    s64 version = atomic64_read_acquire(&entry->version);
+
+    if (version != 2 * seq + 2) {
+        return false;
+    }
+
+    copy->seq = entry->seq;
+    copy->stream = entry->stream;
+    copy->len = min_t(unsigned int, READ_ONCE(entry->len), sizeof(copy->data));
+    memcpy(copy->data, entry->data, copy->len);
+
+    smp_rmb();
+    return atomic64_read(&entry->version) == version;
+}
+
+static void tm_recent_enter(struct test_module_state *state, struct tm_recent_iter *iter,
+                            unsigned int i)
+{
+    iter->stream = i;
+    iter->seq = 0;
+    iter->end = 0;
+    if (i < state->nr_writers && state->streams[i].recent) {
+        iter->end = atomic64_read(&state->streams[i].recent_seq);
+        iter->seq = iter->end > recent_records ? iter->end - recent_records : 0;
+    }
+}
+
+/*
+ * Ищет первую еще целую запись начиная с iter: перезаписанные с прошлого
+ * read() пропускаются, записи новее end достанутся следующему open().
+ */
+static struct tm_recent *tm_recent_find(struct test_module_state *state,
+                                        struct tm_recent_iter *iter)
+{
+    struct tm_stream *stream;
+    u64 head;
+
+    for (; iter->stream < state->nr_writers; tm_recent_enter(state, iter, iter->stream + 1)) {
+        stream = &state->streams[iter->stream];
+        if (!stream->recent)
+            continue;
+
+        head = atomic64_read(&stream->recent_seq);
+        if (head > recent_records && iter->seq < head - recent_records)
+            iter->seq = head - recent_records;
+
+        for (; iter->seq < iter->end; iter->seq++) {
+            if (tm_recent_read(stream, iter->seq, &iter->entry))
+                return &iter->entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * /proc/test_module/recent: последние записи всех потоков из памяти,
+ * поток за потоком от старых к новым. seq_file вызывает start на каждый
+ * read(), а producer'ы тем временем пополняют кольца, поэтому итератор
+ * продолжает с номера записи (iter->seq), а не с позиции от начала кольца.
+ */
+static void *tm_recent_start(struct seq_file *m, loff_t *pos)
+{
+    struct test_module_state *state = pde_data(file_inode(m->file));
+    struct tm_recent_iter *iter = m->private;
+
+    if (*pos == 0) {
+        tm_recent_enter(state, iter, 0);
+        iter->pos = 0;
+    } else if (*pos != iter->pos) {
+        return NULL;
+    }
+
+    return tm_recent_find(state, iter);
+}
+
+static void *tm_recent_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    struct test_module_state *state = pde_data(file_inode(m->file));
+    struct tm_recent_iter *iter = m->private;
+
+    iter->seq++;
+    iter->pos = ++*pos;
+    return tm_recent_find(state, iter);
+}
+
+static void tm_recent_stop(struct seq_file *m, void *v)
+{
+}
+
+static int tm_recent_show(struct seq_file *m, void *v)
+{
+    struct tm_recent *entry = v;
+
+    seq_printf(m, "stream %u #%llu: ", entry->stream, entry->seq);
+    seq_write(m, entry->data, entry->len);
+    if (entry->len == 0 || entry->data[entry->len - 1] != '\n')
+        seq_putc(m, '\n');
+
+    return 0;
+}
+
+static const struct seq_operations tm_recent_seq_ops = {
+    .start = tm_recent_start,
+    .next = tm_recent_next,
+    .stop = tm_recent_stop,
+    .show = tm_recent_show,
+};
+
+/* /proc/test_module/streams: все поля каждого writer'а (потоки и шарды) */
+static int tm_streams_show(struct seq_file *m, void *v)
+{
+    struct test_module_state *state = m->private;
+    char mem[TM_MEM_NR * 48];
+    unsigned int i;
+
+    for (i = 0; i < state->nr_writers; i++) {
+        struct tm_stream *stream = &state->streams[i];
+
+        tm_mem_show(&stream->mem, false, mem, sizeof(mem));
+        seq_printf(m,
+                   "stream %u: parent=%u shard=%u writes=%u accepted=%lld dropped=%lld sampled=%lld filtered=%lld "
+                   "overflow=%lld backlog=%zu flushes=%lld bytes=%lld write_errors=%lld "
+                   "batch_bytes=%u deadline_ms=%u write_lat_us=%u fsync_lat_us=%u "
+                   "timer=%s tick_late_us=%u tick_softirq_ns=%u tick_process_ns=%u "
+                   "io_ns=%lld write_mode=%s io_inflight=%d io_peak=%u io_lat_us=%u "
+                   "buffers=%u buffer_kb=%u ring_node=%d ring_order=%d ring_alloc=%s "
+                   "mem=%lld mem_peak=%lld%s",
+                   i, stream->parent->id, stream->shard, atomic_read(&stream->write_counter),
+                   atomic64_read(&stream->counters.accepted),
+                   atomic64_read(&stream->counters.dropped),
+                   atomic64_read(&stream->counters.sampled),
+                   atomic64_read(&stream->counters.filtered),
+                   atomic64_read(&stream->overflow),
+                   tm_stream_backlog(stream),
+                   atomic64_read(&stream->flushes),
+                   atomic64_read(&stream->bytes_written),
+                   atomic64_read(&stream->write_errors),
+                   READ_ONCE(stream->batch_bytes),
+                   READ_ONCE(stream->deadline_ms),
+                   READ_ONCE(stream->write_lat_us),
+                   READ_ONCE(stream->fsync_lat_us),
+                   READ_ONCE(timer_deferrable[i]) ? "deferrable" : "precise",
+                   READ_ONCE(stream->tick_late_us),
+                   READ_ONCE(stream->tick_softirq_ns),
+                   READ_ONCE(stream->tick_process_ns),
+                   atomic64_read(&stream->io_ns),
+                   READ_ONCE(write_vectored) && stream->iov ? "vectored" : "copy",
+                   atomic_read(&stream->io_inflight),
+                   READ_ONCE(stream->io_peak),
+                   READ_ONCE(stream->io_lat_us),
+                   stream->nr_bufs, buffer_kb, stream->ring_nid,
+                   stream->ring_order,
+                   READ_ONCE(stream->shrunk) ? "reserve" :
+                   stream->ring_order < 0 ? "vmalloc" : "contig",
+                   atomic64_read(&stream->mem.total),
+                   atomic64_read(&stream->mem.total_peak),
+                   mem);
+    }
+
+    return 0;
+}
+
+static int tm_producers_show(struct seq_file *m, void *v)
+{
+    struct test_module_state *state = m->private;
+    unsigned int i;
+
+    mutex_lock(&state->producers_lock);
+    for (i = 0; i < TM_MAX_PRODUCERS; i++) {
+        struct tm_producer *p = &state->producers[i];
+
+        if (!p->in_use)
+            continue;
+
+        seq_printf(m, "producer %u (%s) stream %u: accepted=%lld dropped=%lld sampled=%lld filtered=%lld\n",
+                   p->id, p->name, p->stream->id,
+                   atomic64_read(&p->counters.accepted),
+                   atomic64_read(&p->counters.dropped),
+                   atomic64_read(&p->counters.sampled),
+                   atomic64_read(&p->counters.filtered));
+    }
+    mutex_unlock(&state->producers_lock);
+
+    return 0;
+}
+
+static int tm_readers_show(struct seq_file *m, void *v)
+{
+    struct test_module_state *state = m->private;
+    struct tm_reader *reader;
+
+    mutex_lock(&state->readers_lock);
+    list_for_each_entry(reader, &state->readers, node) {
+        seq_printf(m, "reader %u (%s, pid %d): pos=%llu acked=%llu lag=%llu %s\n",
+                   reader->id, reader->comm, reader->pid, reader->pos, reader->acked,
+                   reader->detached ? reader->detach_lag : state->rd_head - reader->acked,
+                   reader->detached ? "detached" : "attached");
+    }
+    mutex_unlock(&state->readers_lock);
+
+    return 0;
+}
+
+static void tm_proc_create(struct test_module_state *state)
+{
+    state->proc_dir = proc_mkdir("test_module", NULL);
+    if (!state->proc_dir) {
+        pr_warn("test_module: Failed to create /proc/test_module\n");
+        return;
+    }
+
+    if (!proc_create_seq_private("recent", 0444, state->proc_dir, &tm_recent_seq_ops,
+                                 sizeof(struct tm_recent_iter), state)) {
+        pr_warn("test_module: Failed to create /proc/test_module/recent\n");
+    }
+
+    if (!proc_create_single_data("streams", 0444, state->proc_dir, tm_streams_show, state) ||
+        !proc_create_single_data("producers", 0444, state->proc_dir, tm_producers_show, state) ||
+        (state->rd_ring &&
+         !proc_create_single_data("readers", 0444, state->proc_dir, tm_readers_show, state))) {
+        pr_warn("test_module: Failed to create counters under /proc/test_module\n");
+    }
+}
+
+/*
+ * /dev/test_module: страницы статистики (TM_STATS_PGOFF) и heartbeat
+ * (TM_HEARTBEAT_PGOFF) отображаются только для чтения, по одной за mmap.
+ * Открытый fd и vm_file отображения держат ссылку на модуль через
+ * .owner, поэтому, пока программа держит устройство открытым или
+ * отображенным, rmmod завершается с EBUSY: страницы не освобождаются
+ * под отображением.
+ */
+static int tm_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct test_module_state *state = module_state;
+    void *page;
+
+    if (!state) {
+        return -ENODEV;
+    }
+
+    switch (vma->vm_pgoff) {
+    case TM_STATS_PGOFF:
+        page = state->stats_page;
+        break;
+    case TM_HEARTBEAT_PGOFF:
+        page = state->heartbeat_page;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (!page || vma->vm_end - vma->vm_start != PAGE_SIZE) {
+        return -EINVAL;
+    }
+
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return vm_insert_page(vma, vma->vm_start, virt_to_page(page));
+}
+
+/*
+ * read() возвращает поколение страницы статистики (u64) и блокируется,
+ * пока оно не изменится с прошлого read() этого файла; poll() сообщает
+ * о смене поколения. Так наблюдатели обновляются только при изменениях.
+ */
+struct tm_dev_file {
+    u64 seen_gen;
+};
+
+static int tm_dev_open(struct inode *inode, struct file *file)
+{
+    struct tm_dev_file *df;
+
+    df = kzalloc(sizeof(*df), GFP_KERNEL);
+    if (!df) {
+        return -ENOMEM;
+    }
+
+    file->private_data = df;
+    return 0;
+}
+
+static int tm_dev_release(struct inode *inode, struct file *file)
+{
+    kfree(file->private_data);
+    return 0;
+}
+
+static ssize_t tm_dev_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct test_module_state *state = module_state;
+    struct tm_dev_file *df = file->private_data;
+    u64 gen;
+    int ret;
+
+    if (!state) {
+        return -ENODEV;
+    }
+
+    if (count < sizeof(gen)) {
+        return -EINVAL;
+    }
+
+    gen = atomic64_read(&state->stats_gen);
+    if (gen == df->seen_gen) {
+        if (file->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+
+        ret = wait_event_interruptible(state->stats_wait,
+                                       atomic64_read(&state->stats_gen) != df->seen_gen);
+        if (ret) {
+            return ret;
+        }
+        gen = atomic64_read(&state->stats_gen);
+    }
+
+    if (copy_to_user(buf, &gen, sizeof(gen))) {
+        return -EFAULT;
+    }
+
+    df->seen_gen = gen;
+    return sizeof(gen);
+}
+
+static __poll_t tm_dev_poll(struct file *file, poll_table *wait)
+{
+    struct test_module_state *state = module_state;
+    struct tm_dev_file *df = file->private_data;
+
+    if (!state) {
+        return EPOLLERR;
+    }
+
+    poll_wait(file, &state->stats_wait, wait);
+
+    return atomic64_read(&state->stats_gen) != df->seen_gen ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/*
+ * Новый период применяем сразу, если он короче оставшегося до тика
+ * времени; более длинный вступит в силу со следующим тиком. Под
+ * tick_lock: тик, который уже сработал, перевзведет себя сам с новым
+ * периодом, а ожидающий не перевзводится дважды.
+ */
+static void tm_stream_rearm(struct tm_stream *stream)
+{
+    unsigned long delay;
+    unsigned long expires;
+    unsigned long flags;
+
+    delay = msecs_to_jiffies(READ_ONCE(timer_period) * 1000);
+    if (delay == 0)
+        delay = 1;
+
+    spin_lock_irqsave(&stream->tick_lock, flags);
+    expires = jiffies + delay;
+
+    if (!stream->state->module_active || !time_before(expires, stream->expires)) {
+        spin_unlock_irqrestore(&stream->tick_lock, flags);
+        return;
+    }
+
+    if (timer_pending(&stream->write_timer)) {
+        stream->expires = expires;
+        mod_timer(&stream->write_timer, expires);
+    } else if (timer_pending(&stream->idle_timer)) {
+        stream->expires = round_jiffies(expires);
+        mod_timer(&stream->idle_timer, stream->expires);
+    } else if (delayed_work_pending(&stream->tick_work)) {
+        stream->expires = expires;
+        mod_delayed_work(system_unbound_wq, &stream->tick_work, delay);
+    } else if (delayed_work_pending(&stream->idle_tick_work)) {
+        delay = round_jiffies_relative(delay);
+        stream->expires = jiffies + delay;
+        mod_delayed_work(system_unbound_wq, &stream->idle_tick_work, delay);
+    }
+    spin_unlock_irqrestore(&stream->tick_lock, flags);
+}
+
+/* Запись в sysfs и TM_IOC_SET_PARAM приходят сюда под kernel_param_lock() */
+static int timer_period_set(const char *val, const struct kernel_param *kp)
+{
+    struct test_module_state *state = module_state;
+    unsigned int period;
+    unsigned int i;
+    int ret;
+
+    ret = kstrtouint(val, 0, &period);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (period < MIN_PERIOD || period > MAX_PERIOD) {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(timer_period, period);
+
+    /* При загрузке модуля тики еще не взведены */
+    if (state && state->module_active) {
+        for (i = 0; i < state->nr_streams; i++) {
+            tm_stream_rearm(&state->streams[i]);
+        }
+    }
+
+    return 0;
+}
+
+static const struct kernel_param_ops timer_period_ops = {
+    .set = timer_period_set,
+    .get = param_get_uint,
+};
+
+module_param_cb(timer_period, &timer_period_ops, &timer_period, 0644);
+MODULE_PARM_DESC(timer_period, "Timer period in seconds (1-3600)");
+
+/* Те же проверки, что и при загрузке модуля; timer_period проверяет свой set() */
+static int tm_param_check(const char *name, const char *value)
+{
+    if (strcmp(name, "filename") == 0) {
+        return is_valid_path(value) ? 0 : -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Установка параметра по имени через таблицу параметров модуля: тот же
+ * ops->set() под kernel_param_lock(), что и при записи в sysfs, но без
+ * открытия файла на каждое изменение.
+ */
+static int tm_param_set(struct test_module_state *state, struct tm_param *param)
+{
+    const struct kernel_param *kp = NULL;
+    unsigned int i;
+    char *value;
+    int ret;
+
+    param->name[sizeof(param->name) - 1] = '\0';
+    param->value[sizeof(param->value) - 1] = '\0';
+    value = strim(param->value);
+
+    for (i = 0; i < THIS_MODULE->num_kp; i++) {
+        if (strcmp(THIS_MODULE->kp[i].name, param->name) == 0) {
+            kp = &THIS_MODULE->kp[i];
+            break;
+        }
+    }
+
+    if (!kp || !kp->ops->set) {
+        return -ENOENT;
+    }
+
+    /* 0444-параметры задаются только при загрузке */
+    if (!(kp->perm & 0222)) {
+        return -EPERM;
+    }
+
+    ret = tm_param_check(param->name, value);
+    if (ret < 0) {
+        return ret;
+    }
+
+    kernel_param_lock(THIS_MODULE);
+    ret = kp->ops->set(value, kp);
+    kernel_param_unlock(THIS_MODULE);
+    if (ret < 0) {
+        return ret;
+    }
+
+    param->generation = atomic64_inc_return(&state->config_gen);
+    return 0;
+}
+
+static long tm_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct test_module_state *state = module_state;
+    struct tm_param *param;
+    u64 gen;
+    long ret;
+
+    if (!state || !state->module_active) {
+        return -ENODEV;
+    }
+
+    switch (cmd) {
+    case TM_IOC_SET_PARAM:
+        if (!capable(CAP_SYS_ADMIN)) {
+            return -EPERM;
+        }
+
+        param = memdup_user((void __user *)arg, sizeof(*param));
+        if (IS_ERR(param)) {
+            return PTR_ERR(param);
+        }
+
+        ret = tm_param_set(state, param);
+        if (ret == 0 && copy_to_user((void __user *)arg, param, sizeof(*param))) {
+            ret = -EFAULT;
+        }
+
+        kfree(param);
+        return ret;
+
+    case TM_IOC_GET_GENERATION:
+        gen = atomic64_read(&state->config_gen);
+        return copy_to_user((void __user *)arg, &gen, sizeof(gen)) ? -EFAULT : 0;
+
+    case TM_IOC_SHM_FD:
+        return tm_shm_fd();
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct file_operations tm_dev_fops = {
+    .owner = THIS_MODULE,
+    .open = tm_dev_open,
+    .release = tm_dev_release,
+    .read = tm_dev_read,
+    .poll = tm_dev_poll,
+    .unlocked_ioctl = tm_dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = tm_dev_mmap,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice tm_miscdev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "test_module",
+    .fops = &tm_dev_fops,
+    .mode = 0444,
+};
+static bool tm_dev_registered;
+
+/*
+ * TM_LOG_DEVICE_PATH: каждое открытие - читатель кольца записей со своим
+ * курсором. Данные копируются пользователю без readers_lock: writer не
+ * перезаписывает неподтвержденные байты подключенного читателя, поэтому
+ * копия верна, если читатель не был отключен, пока она шла.
+ */
+static int tm_log_open(struct inode *inode, struct file *file)
+{
+    struct test_module_state *state = module_state;
+    struct tm_reader *reader;
+
+    if (!state || !state->rd_ring) {
+        return -ENODEV;
+    }
+
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!reader) {
+        return -ENOMEM;
+    }
+
+    reader->pid = task_tgid_nr(current);
+    get_task_comm(reader->comm, current);
+
+    mutex_lock(&state->readers_lock);
+    if (state->nr_readers >= TM_MAX_READERS) {
+        mutex_unlock(&state->readers_lock);
+        kfree(reader);
+        return -EBUSY;
+    }
+    reader->id = state->reader_ids++;
+    reader->pos = state->rd_head;
+    reader->acked = state->rd_head;
+    list_add_tail(&reader->node, &state->readers);
+    state->nr_readers++;
+    WRITE_ONCE(state->nr_attached, state->nr_attached + 1);
+    mutex_unlock(&state->readers_lock);
+
+    file->private_data = reader;
+    return stream_open(inode, file);
+}
+
+static int tm_log_release(struct inode *inode, struct file *file)
+{
+    struct test_module_state *state = module_state;
+    struct tm_reader *reader = file->private_data;
+
+    mutex_lock(&state->readers_lock);
+    list_del(&reader->node);
+    state->nr_readers--;
+    if (!reader->detached)
+        WRITE_ONCE(state->nr_attached, state->nr_attached - 1);
+    mutex_unlock(&state->readers_lock);
+
+    kfree(reader);
+    return 0;
+}
+
+static ssize_t tm_log_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct test_module_state *state = module_state;
+    struct tm_reader *reader = file->private_data;
+    size_t len;
+    size_t n;
+    u64 pos;
+    u32 off;
+    int ret;
+
+    mutex_lock(&state->readers_lock);
+    while (!reader->detached && reader->pos == state->rd_head) {
+        mutex_unlock(&state->readers_lock);
+        if (file->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+
+        ret = wait_event_interruptible(state->readers_wait,
+                                       READ_ONCE(reader->detached) ||
+                                       READ_ONCE(state->rd_head) != reader->pos);
+        if (ret) {
+            return ret;
+        }
+        mutex_lock(&state->readers_lock);
+    }
+
+    if (reader->detached) {
+        mutex_unlock(&state->readers_lock);
+        return -EPIPE;
+    }
+    pos = reader->pos;
+    len = min_t(u64, count, state->rd_head - pos);
+    mutex_unlock(&state->readers_lock);
+
+    div_u64_rem(pos, state->rd_size, &off);
+    n = min_t(size_t, len, state->rd_size - off);
+    if (copy_to_user(buf, state->rd_ring + off, n) ||
+        copy_to_user(buf + n, state->rd_ring, len - n)) {
+        return -EFAULT;
+    }
+
+    mutex_lock(&state->readers_lock);
+    if (reader->detached) {
+        mutex_unlock(&state->readers_lock);
+        return -EPIPE;
+    }
+    reader->pos = pos + len;
+    if (!reader->manual_ack)
+        reader->acked = reader->pos;
+    mutex_unlock(&state->readers_lock);
+
+    return len;
+}
+
+static __poll_t tm_log_poll(struct file *file, poll_table *wait)
+{
+    struct test_module_state *state = module_state;
+    struct tm_reader *reader = file->private_data;
+
+    poll_wait(file, &state->readers_wait, wait);
+
+    if (READ_ONCE(reader->detached)) {
+        return EPOLLERR;
+    }
+    return READ_ONCE(state->rd_head) != READ_ONCE(reader->pos) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static long tm_log_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct test_module_state *state = module_state;
+    struct tm_reader *reader = file->private_data;
+    struct tm_reader_status status;
+    u64 pos;
+
+    switch (cmd) {
+    case TM_IOC_READER_ACK:
+        if (get_user(pos, (u64 __user *)arg)) {
+            return -EFAULT;
+        }
+
+        mutex_lock(&state->readers_lock);
+        reader->manual_ack = true;
+        /* Подтвердить можно только прочитанное */
+        pos = min(pos, reader->pos);
+        if (pos > reader->acked)
+            reader->acked = pos;
+        mutex_unlock(&state->readers_lock);
+        return reader->detached ? -EPIPE : 0;
+
+    case TM_IOC_READER_STATUS:
+        memset(&status, 0, sizeof(status));
+        mutex_lock(&state->readers_lock);
+        status.head = state->rd_head;
+        status.pos = reader->pos;
+        status.acked = reader->acked;
+        status.lag = reader->detached ? reader->detach_lag : state->rd_head - reader->acked;
+        status.id = reader->id;
+        status.detached = reader->detached;
+        mutex_unlock(&state->readers_lock);
+        return copy_to_user((void __user *)arg, &status, sizeof(status)) ? -EFAULT : 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct file_operations tm_log_fops = {
+    .owner = THIS_MODULE,
+    .open = tm_log_open,
+    .release = tm_log_release,
+    .read = tm_log_read,
+    .poll = tm_log_poll,
+    .unlocked_ioctl = tm_log_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice tm_log_miscdev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "test_module_log",
+    .fops = &tm_log_fops,
+    .mode = 0444,
+};
+static bool tm_log_registered;
+
+/*
+ * Под давлением памяти простаивающие потоки отдают ring и буферы writer'а,
+ * оставляя себе reserve_kb на буфер. Память возвращается при первом
+ * крупном сбросе (tm_stream_regrow).
+ */
+static unsigned long tm_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+    struct test_module_state *state = module_state;
+    unsigned long pages = 0;
+    unsigned int i;
+
+    for (i = 0; i < state->nr_writers; i++) {
+        struct tm_stream *stream = &state->streams[i];
+
+        if (tm_stream_idle(stream))
+            pages += tm_stream_reclaimable(stream) >> PAGE_SHIFT;
+    }
+
+    return pages ? pages : SHRINK_EMPTY;
+}
+
+static unsigned long tm_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+    struct test_module_state *state = module_state;
+    unsigned long freed = 0;
+    unsigned long pages;
+    unsigned int i;
+
+    for (i = 0; i < state->nr_writers && freed < sc->nr_to_scan; i++) {
+        struct tm_stream *stream = &state->streams[i];
+
+        if (!tm_stream_idle(stream) || !mutex_trylock(&stream->ring_lock))
+            continue;
+
+        pages = tm_stream_reclaimable(stream) >> PAGE_SHIFT;
+        if (tm_stream_shrink(stream))
+            freed += pages;
+
+        mutex_unlock(&stream->ring_lock);
+    }
+
+    return freed ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *tm_shrinker;
+
+static int tm_shrinker_register(void)
+{
+    tm_shrinker = shrinker_alloc(0, "test_module");
+    if (!tm_shrinker) {
+        return -ENOMEM;
+    }
+
+    tm_shrinker->count_objects = tm_shrink_count;
+    tm_shrinker->scan_objects = tm_shrink_scan;
+    shrinker_register(tm_shrinker);
+    return 0;
+}
+
+static void tm_shrinker_unregister(void)
+{
+    shrinker_free(tm_shrinker);
+    tm_shrinker = NULL;
+}
+#else
+static struct shrinker tm_shrinker_static = {
+    .count_objects = tm_shrink_count,
+    .scan_objects = tm_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+static struct shrinker *tm_shrinker;
+
+static int tm_shrinker_register(void)
+{
+    int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    ret = register_shrinker(&tm_shrinker_static, "test_module");
+#else
+    ret = register_shrinker(&tm_shrinker_static);
+#endif
+    if (ret == 0) {
+        tm_shrinker = &tm_shrinker_static;
+    }
+    return ret;
+}
+
+static void tm_shrinker_unregister(void)
+{
+    unregister_shrinker(tm_shrinker);
+    tm_shrinker = NULL;
+}
+#endif
+
+static int __init test_module_init(void)
+{
+    unsigned int i;
+
+    pr_info("test_module: Initializing module\n");
+    pr_info("test_module: Filename: %s\n", filename ? filename : "(NULL)");
+    pr_info("test_module: Timer period: %u seconds\n", timer_period);
+    pr_info("test_module: Streams: %u\n", nr_streams);
+
+    if (!filename || !is_valid_path(filename)) {
+        pr_err("test_module: Invalid filename parameter\n");
+        return -EINVAL;
+    }
+
+    if (timer_period < MIN_PERIOD || timer_period > MAX_PERIOD) {
+        pr_err("test_module: Timer period must be between %u and %u seconds\n",
+               MIN_PERIOD, MAX_PERIOD);
+        return -EINVAL;
+    }
+
+    if (nr_streams < 1 || nr_streams > TM_MAX_STREAMS) {
+        pr_err("test_module: Number of streams must be between 1 and %u\n",
+               TM_MAX_STREAMS);
+        return -EINVAL;
+    }
+
+    if (buffer_kb < TM_MIN_BUFFER_KB || buffer_kb > TM_MAX_BUFFER_KB ||
+        nr_buffers < 2 || nr_buffers > TM_MAX_BUFFERS) {
+        pr_err("test_module: Buffers must be %u-%u KiB, 2-%u per stream\n",
+               TM_MIN_BUFFER_KB, TM_MAX_BUFFER_KB, TM_MAX_BUFFERS);
+        return -EINVAL;
+    }
+
+    if (recent_records > TM_MAX_RECENT) {
+        pr_err("test_module: recent_records must be at most %u\n", TM_MAX_RECENT);
+        return -EINVAL;
+    }
+
+    if (reserve_kb < TM_MIN_RESERVE_KB || reserve_kb > buffer_kb) {
+        pr_err("test_module: Reserve must be between %u KiB and buffer_kb\n", TM_MIN_RESERVE_KB);
+        return -EINVAL;
+    }
+
+    if (bdev_path && *bdev_path &&
+        (bdev_segment_kb < 16 || bdev_segment_kb > 1024 || bdev_segment_kb % (TM_BDEV_BLOCK / 1024))) {
+        pr_err("test_module: bdev_segment_kb must be a multiple of 4 between 16 and 1024\n");
+        return -EINVAL;
+    }
+
+    if (shm_kb && (shm_kb < TM_MIN_BUFFER_KB || shm_kb > TM_MAX_SHM_KB)) {
+        pr_err("test_module: shm_kb must be between %u and %u\n", TM_MIN_BUFFER_KB, TM_MAX_SHM_KB);
+        return -EINVAL;
+    }
+
+    if (shm_kb && bdev_path && *bdev_path) {
+        pr_err("test_module: shm_kb and bdev_path are mutually exclusive\n");
+        return -EINVAL;
+    }
+
+    if (reader_ring_kb && (reader_ring_kb < TM_MIN_BUFFER_KB || reader_ring_kb > TM_MAX_BUFFER_KB)) {
+        pr_err("test_module: reader_ring_kb must be between %u and %u\n", TM_MIN_BUFFER_KB, TM_MAX_BUFFER_KB);
+        return -EINVAL;
+    }
+
+    if (nr_shards < 1 || nr_streams * nr_shards > TM_MAX_STREAMS) {
+        pr_err("test_module: nr_streams * nr_shards must be at most %u\n", TM_MAX_STREAMS);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nr_streams * nr_shards; i++) {
+        if (ring_node[i] != NUMA_NO_NODE &&
+            (ring_node[i] < 0 || ring_node[i] >= MAX_NUMNODES || !node_online(ring_node[i]))) {
+            pr_err("test_module: NUMA node %d for stream %u is not online\n", ring_node[i], i);
+            return -EINVAL;
+        }
+    }
+
+    BUILD_BUG_ON(TM_STATS_MAX_STREAMS != TM_MAX_STREAMS);
+    BUILD_BUG_ON(sizeof(struct tm_stats_page) > PAGE_SIZE);
+    BUILD_BUG_ON(sizeof(struct tm_heartbeat_page) > PAGE_SIZE);
+
+    module_state = kzalloc(sizeof(*module_state), GFP_KERNEL);
+    if (!module_state) {
+        pr_err("test_module: Failed to allocate memory for module state\n");
+        return -ENOMEM;
+    }
+
+    module_state->stats_page = (struct tm_stats_page *)get_zeroed_page(GFP_KERNEL);
+    if (!module_state->stats_page) {
+        pr_err("test_module: Failed to allocate stats page\n");
+        kfree(module_state);
+        return -ENOMEM;
+    }
+    module_state->stats_page->magic = TM_STATS_MAGIC;
+    module_state->stats_page->version = TM_STATS_VERSION;
+    module_state->stats_page->nr_streams = nr_streams * nr_shards;
+
+    module_state->heartbeat_page = (struct tm_heartbeat_page *)get_zeroed_page(GFP_KERNEL);
+    if (!module_state->heartbeat_page) {
+        pr_err("test_module: Failed to allocate heartbeat page\n");
+        free_page((unsigned long)module_state->stats_page);
+        kfree(module_state);
+        return -ENOMEM;
+    }
+    module_state->heartbeat_page->magic = TM_HEARTBEAT_MAGIC;
+    module_state->heartbeat_page->version = TM_HEARTBEAT_VERSION;
+    module_state->heartbeat_page->nr_streams = nr_streams;
+
+    module_state->module_active = false;
+    module_state->nr_streams = nr_streams;
+    module_state->nr_shards = nr_shards;
+    module_state->nr_writers = nr_streams * nr_shards;
+    mutex_init(&module_state->producers_lock);
+    mutex_init(&module_state->readers_lock);
+    INIT_LIST_HEAD(&module_state->readers);
+    init_waitqueue_head(&module_state->readers_wait);
+    init_waitqueue_head(&module_state->stats_wait);
+    INIT_WORK(&module_state->bench_work, bench_work_handler);
+
+    /* У каждого writer'а свой flush_work, поэтому шарды сбрасываются параллельно */
+    module_state->wq = alloc_workqueue("test_module_wq", WQ_MEM_RECLAIM,
+                                       module_state->nr_writers);
+    if (!module_state->wq) {
+        pr_err("test_module: Failed to create workqueue\n");
+        free_page((unsigned long)module_state->stats_page);
+        free_page((unsigned long)module_state->heartbeat_page);
+        kfree(module_state);
+        return -ENOMEM;
+    }
+
+    module_state->io_wq = alloc_workqueue("test_module_io", WQ_UNBOUND | WQ_MEM_RECLAIM,
+                                          TM_MAX_IO_DEPTH);
+    if (!module_state->io_wq) {
+        pr_err("test_module: Failed to create I/O workqueue\n");
+        destroy_workqueue(module_state->wq);
+        free_page((unsigned long)module_state->stats_page);
+        free_page((unsigned long)module_state->heartbeat_page);
+        kfree(module_state);
+        return -ENOMEM;
+    }
+
+    if (bdev_path && *bdev_path) {
+        int ret = tm_bdev_open(module_state->nr_writers);
+
+        if (ret < 0) {
+            pr_err("test_module: Failed to open %s, error: %d\n", bdev_path, ret);
+            destroy_workqueue(module_state->io_wq);
+            destroy_workqueue(module_state->wq);
+            free_page((unsigned long)module_state->stats_page);
+            free_page((unsigned long)module_state->heartbeat_page);
+            kfree(module_state);
+            return ret;
+        }
+    }
+
+    if (shm_kb) {
+        int ret = tm_shm_create(module_state->nr_writers);
+
+        if (ret < 0) {
+            pr_err("test_module: Failed to create shared-memory log, error: %d\n", ret);
+            destroy_workqueue(module_state->io_wq);
+            destroy_workqueue(module_state->wq);
+            free_page((unsigned long)module_state->stats_page);
+            free_page((unsigned long)module_state->heartbeat_page);
+            kfree(module_state);
+            return ret;
+        }
+    }
+
+    if (reader_ring_kb) {
+        module_state->rd_size = (u64)reader_ring_kb * 1024;
+        module_state->rd_ring = vmalloc(module_state->rd_size);
+        if (!module_state->rd_ring) {
+            pr_err("test_module: Failed to allocate the reader ring\n");
+            tm_bdev_close();
+            tm_shm_destroy();
+            destroy_workqueue(module_state->io_wq);
+            destroy_workqueue(module_state->wq);
+            free_page((unsigned long)module_state->stats_page);
+            free_page((unsigned long)module_state->heartbeat_page);
+            kfree(module_state);
+            return -ENOMEM;
+        }
+        tm_mem_charge(NULL, TM_MEM_RECORDS, module_state->rd_size);
+    }
+
+    for (i = 0; i < module_state->nr_writers; i++) {
+        struct tm_stream *stream = &module_state->streams[i];
+        struct tm_producer *heartbeat = &module_state->producers[i];
+
+        stream->state = module_state;
+        stream->id = i;
+        if (i < nr_streams) {
+            stream->parent = stream;
+        } else {
+            stream->parent = &module_state->streams[(i - nr_streams) / (nr_shards - 1)];
+            stream->shard = (i - nr_streams) % (nr_shards - 1) + 1;
+        }
+        atomic_set(&stream->write_counter, 0);
+        timer_setup(&stream->write_timer, timer_callback, 0);
+        timer_setup(&stream->idle_timer, deferrable_timer_callback, TIMER_DEFERRABLE);
+        INIT_DELAYED_WORK(&stream->tick_work, tick_work_handler);
+        INIT_DEFERRABLE_WORK(&stream->idle_tick_work, idle_tick_work_handler);
+        init_waitqueue_head(&stream->space_wait);
+        init_waitqueue_head(&stream->io_wait);
+        spin_lock_init(&stream->io_lock);
+        spin_lock_init(&stream->tick_lock);
+        stream->io_fail_pos = -1;
+        INIT_DELAYED_WORK(&stream->flush_work, flush_work_handler);
+        mutex_init(&stream->ring_lock);
+        stream->batch_bytes = flush_min_bytes;
+        stream->deadline_ms = flush_min_ms;
+
+        if (tm_stream_alloc_bufs(stream) < 0) {
+            pr_err("test_module: Failed to allocate buffers for stream %u\n", i);
+            while (i--) {
+                tm_stream_free_bufs(&module_state->streams[i]);
+            }
+            tm_bdev_close();
+            tm_shm_destroy();
+            vfree(module_state->rd_ring);
+            destroy_workqueue(module_state->io_wq);
+            destroy_workqueue(module_state->wq);
+            free_page((unsigned long)module_state->stats_page);
+            free_page((unsigned long)module_state->heartbeat_page);
+            kfree(module_state);
+            return -ENOMEM;
+        }
+
+        /* Шарды не тикают и не имеют своего heartbeat-producer'а */
+        if (i >= nr_streams)
+            continue;
+
+        heartbeat->id = i;
+        heartbeat->stream = stream;
+        snprintf(heartbeat->name, sizeof(heartbeat->name), "heartbeat%u", i);
+        heartbeat->in_use = true;
+    }
+
+    /* filter из параметров загрузки компилируется, когда heartbeat-producer'ы уже есть */
+    mutex_lock(&module_state->producers_lock);
+    if (filter_rules[0] && tm_filter_rebuild(module_state) < 0) {
+        pr_warn("test_module: Failed to compile the filter, writing all records\n");
+    }
+    mutex_unlock(&module_state->producers_lock);
+
+    tm_mem_charge(NULL, TM_MEM_CONFIG, sizeof(*module_state) + 2 * PAGE_SIZE);
+    module_state->module_active = true;
+
+    /* Без shrinker'а модуль работает, просто не отдает память простаивающих потоков */
+    if (tm_shrinker_register() < 0) {
+        pr_warn("test_module: Failed to register shrinker\n");
+    }
+
+    tm_proc_create(module_state);
+
+    /* Без устройства статистика доступна только через параметр stats */
+    if (misc_register(&tm_miscdev) < 0) {
+        pr_warn("test_module: Failed to register %s\n", TM_DEVICE_PATH);
+    } else {
+        tm_dev_registered = true;
+    }
+
+    if (module_state->rd_ring) {
+        if (misc_register(&tm_log_miscdev) < 0) {
+            pr_warn("test_module: Failed to register %s\n", TM_LOG_DEVICE_PATH);
+        } else {
+            tm_log_registered = true;
+        }
+    }
+
+    for (i = 0; i < module_state->nr_streams; i++) {
+        struct tm_stream *stream = &module_state->streams[i];
+
+        spin_lock_irq(&stream->tick_lock);
+        tm_stream_arm(stream);
+        spin_unlock_irq(&stream->tick_lock);
+    }
+
+    pr_info("test_module: Module initialized successfully\n");
+    return 0;
+}
+
+static void __exit test_module_exit(void)
+{
+    struct test_module_state *state = module_state;
+    unsigned int total_writes = 0;
+    unsigned int i;
+
+    pr_info("test_module: Removing module\n");
+
+    if (!state) {
+        pr_warn("test_module: Module state is NULL during exit\n");
+        return;
+    }
+
+    if (tm_dev_registered) {
+        misc_deregister(&tm_miscdev);
+        tm_dev_registered = false;
+    }
+
+    if (tm_log_registered) {
+        misc_deregister(&tm_log_miscdev);
+        tm_log_registered = false;
+    }
+
+    /* proc_remove() дожидается завершения текущих чтений */
+    proc_remove(state->proc_dir);
+    state->proc_dir = NULL;
+
+    if (tm_shrinker) {
+        tm_shrinker_unregister();
+    }
+
+    state->module_active = false;
+
+    /* tm_stream_rearm() из timer_period_set() увидит module_active под tick_lock */
+    for (i = 0; i < state->nr_writers; i++) {
+        spin_lock_irq(&state->streams[i].tick_lock);
+        spin_unlock_irq(&state->streams[i].tick_lock);
+    }
+
+    atomic_set(&state->bench_remaining, 0);
+    for (i = 0; i < state->nr_writers; i++) {
+        wake_up_all(&state->streams[i].space_wait);
+    }
+    cancel_work_sync(&state->bench_work);
+
+    for (i = 0; i < state->nr_writers; i++) {
+        tm_stream_stop_ticks(&state->streams[i]);
+        wake_up_all(&state->streams[i].space_wait);
+        total_writes += atomic_read(&state->streams[i].write_counter);
+    }
+
+    /* Дописываем накопленные записи синхронно, не дожидаясь дедлайна */
+    for (i = 0; i < state->nr_writers; i++) {
+        cancel_delayed_work_sync(&state->streams[i].flush_work);
+        flush_work_handler(&state->streams[i].flush_work.work);
+        tm_stream_io_settle(&state->streams[i]);
+    }
+
+    if (state->io_wq) {
+        destroy_workqueue(state->io_wq);
+        state->io_wq = NULL;
+    }
+
+    if (state->wq) {
+        flush_workqueue(state->wq);
+        destroy_workqueue(state->wq);
+        state->wq = NULL;
     }
 
     /* Записываем финальное сообщение только если filename валиден */
-    if (filename && is_valid_path(filename)) {
-        write_to_file("Module unloaded\n", filename);
+    for (i = 0; i < state->nr_writers; i++) {
+        struct tm_stream *stream = &state->streams[i];
+        char *filepath = stream_path(stream);
+
+        tm_stream_close(stream);
+        tm_stream_free_sink(stream);
+
+        if (filepath) {
+            if (!stream->bdev_log && !tm_shm.header)
+                write_to_file("Module unloaded\n", filepath);
+            tm_path_free(stream, filepath);
+        }
     }
 
-    kfree(module_state);
+    /* stats_get() читает module_state под kernel_param_lock */
+    kernel_param_lock(THIS_MODULE);
     module_state = NULL;
+    kernel_param_unlock(THIS_MODULE);
+
+    for (i = 0; i < state->nr_writers; i++) {
+        tm_stream_free_bufs(&state->streams[i]);
+    }
+    tm_bdev_close();
+    tm_shm_destroy();
+    if (state->rd_ring) {
+        vfree(state->rd_ring);
+        tm_mem_uncharge(NULL, TM_MEM_RECORDS, state->rd_size);
+    }
+    /* Producer'ов и тиков уже нет, читателей фильтра не осталось */
+    kfree(rcu_dereference_protected(state->filter, 1));
+    tm_mem_uncharge(NULL, TM_MEM_CONFIG, sizeof(*state) + 2 * PAGE_SIZE);
+    free_page((unsigned long)state->stats_page);
+    free_page((unsigned long)state->heartbeat_page);
+    kfree(state);
 
     pr_info("test_module: Module removed (total writes: %u)\n", total_writes);
 }
@@ -0,0 +1,37 @@
+#ifndef _TEST_MODULE_H
+#define _TEST_MODULE_H
+
+#include <linux/compiler.h>
+#include <linux/types.h>
+
+/*
+ * Интерфейс для других модулей ядра, пишущих записи через test_module.
+ * Каждый producer привязан к одному потоку (stream) и имеет собственный
+ * token bucket; записи сверх лимита отбрасываются или сэмплируются.
+ *
+ * tm_producer_unregister() может спать: он возвращается только после
+ * того, как завершились все tm_log() этого producer'а, уже начатые на
+ * других CPU. Новые вызовы с тем же указателем после этого недопустимы -
+ * слот может быть отдан другому producer'у.
+ */
+
+#define TM_MAX_STREAMS 8
+#define TM_PRODUCER_NAME_LEN 32
+
+/* Уровни записей для фильтра test_module (параметр filter); tm_log() пишет с TM_SEV_INFO */
+enum tm_severity {
+    TM_SEV_DEBUG,
+    TM_SEV_INFO,
+    TM_SEV_WARN,
+    TM_SEV_ERR,
+    TM_SEV_NR,
+};
+
+struct tm_producer;
+
+struct tm_producer *tm_producer_register(const char *name, unsigned int stream);
+void tm_producer_unregister(struct tm_producer *producer);
+__printf(2, 3) int tm_log(struct tm_producer *producer, const char *fmt, ...);
+__printf(3, 4) int tm_log_sev(struct tm_producer *producer, enum tm_severity sev, const char *fmt, ...);
+
+#endif /* _TEST_MODULE_H */
@@ -0,0 +1,211 @@
+#ifndef _TEST_MODULE_UAPI_H
+#define _TEST_MODULE_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Общие с пользовательскими программами определения. Страницы статистики
+ * и heartbeat отображаются через mmap(/dev/test_module) только для чтения,
+ * смещение mmap - номер страницы * размер страницы. Каждый поток
+ * публикуется под собственным счетчиком seq: нечетное значение - ядро
+ * обновляет поток, читатель повторяет чтение, пока seq не совпадет до и
+ * после копирования.
+ *
+ * Открытые fd устройств и их отображения держат ссылку на модуль:
+ * пока программа работает, rmmod test_module завершается с EBUSY.
+ * Перед выгрузкой модуля программы нужно остановить.
+ */
+
+#define TM_DEVICE_PATH "/dev/test_module"
+
+#define TM_STATS_MAGIC 0x746d7374 /* "tmst" */
+#define TM_STATS_VERSION 2
+#define TM_STATS_MAX_STREAMS 8
+#define TM_STATS_PGOFF 0
+
+#define TM_HEARTBEAT_MAGIC 0x746d6862 /* "tmhb" */
+#define TM_HEARTBEAT_VERSION 1
+#define TM_HEARTBEAT_PGOFF 1
+
+/* Гистограмма задержки записи: корзина 0 - меньше 1 мкс, i - [2^(i-1), 2^i) мкс */
+#define TM_LAT_BUCKETS 24
+
+struct tm_stats_stream {
+    __u32 seq;
+    __u32 write_lat_us;
+    __u64 write_counter;
+    __u64 accepted;
+    __u64 dropped;
+    __u64 overflow;
+    __u64 bytes_written;
+    __u64 write_errors;
+    __u64 flushes;
+    /* Число записей, отданных в файл */
+    __u64 last_seq;
+    /* CLOCK_REALTIME последней записи в файл, нс */
+    __u64 last_write_ns;
+    /* Данные, ожидающие writer'а, байт */
+    __u64 backlog_bytes;
+    /* Сумма задержек записи для гистограммы, нс */
+    __u64 lat_sum_ns;
+    __u64 lat_hist[TM_LAT_BUCKETS];
+};
+
+struct tm_stats_page {
+    __u32 magic;
+    __u32 version;
+    __u32 nr_streams;
+    __u32 reserved;
+    struct tm_stats_stream streams[TM_STATS_MAX_STREAMS];
+};
+
+/* Последний тик heartbeat потока */
+struct tm_heartbeat_stream {
+    __u32 seq;
+    /* Период тиков на момент тика, мс */
+    __u32 period_ms;
+    /* Номер тика (write_counter) */
+    __u64 tick;
+    /* CLOCK_MONOTONIC тика, нс */
+    __u64 mono_ns;
+};
+
+struct tm_heartbeat_page {
+    __u32 magic;
+    __u32 version;
+    __u32 nr_streams;
+    __u32 reserved;
+    struct tm_heartbeat_stream streams[TM_STATS_MAX_STREAMS];
+};
+
+/*
+ * Кольцевой лог на блочном устройстве (параметр bdev_path). Блок 0 -
+ * суперблок, за ним по области на каждый writer модуля (поток или шард).
+ * Область - кольцо из segments_per_region сегментов по segment_size байт:
+ * блок заголовка сегмента и данные записей (used байт). Сегмент с номером
+ * seq (с 1) лежит в позиции (seq - 1) % segments_per_region своей области.
+ * format_ns меняется при каждой загрузке модуля: сегменты с другим
+ * format_ns остались от прошлой разметки. Все поля little-endian хоста.
+ * Перед первыми данными сегмента модуль пишет его заголовок с новым seq
+ * и used = 0, а после данных - с новым used. Читатель, прочитав данные,
+ * перечитывает заголовок: если seq сменился или used уменьшился, данные
+ * могли принадлежать уже следующему кругу кольца.
+ */
+#define TM_BDEV_MAGIC 0x746d6264 /* "tmbd" */
+#define TM_BDEV_SEGMENT_MAGIC 0x746d7367 /* "tmsg" */
+#define TM_BDEV_VERSION 1
+#define TM_BDEV_BLOCK 4096
+
+struct tm_bdev_super {
+    __u32 magic;
+    __u32 version;
+    __u32 block_size;
+    __u32 nr_regions;
+    __u64 segment_size;
+    __u64 segments_per_region;
+    __u64 format_ns;
+};
+
+struct tm_bdev_segment {
+    __u32 magic;
+    __u32 region;
+    __u64 seq;
+    __u64 format_ns;
+    /* Байт данных после блока заголовка */
+    __u32 used;
+    __u32 reserved;
+    /* CLOCK_REALTIME последней записи сегмента, нс */
+    __u64 write_ns;
+};
+
+/*
+ * Лог в памяти (параметр shm_kb): shmem-файл, fd которого только для
+ * чтения выдает ioctl TM_IOC_SHM_FD. В начале файла - tm_shm_header, у
+ * каждого writer'а модуля своя область-кольцо size байт с data_offset.
+ *
+ * head и reserved - монотонные счетчики байт, записанных в область;
+ * байт с номером n лежит в data_offset + n % size. Writer сначала
+ * увеличивает reserved, затем копирует данные и публикует head (release).
+ * Читатель с курсором cursor:
+ *   1. h = head (acquire); если h - cursor > size, данные потеряны и
+ *      cursor = h - size;
+ *   2. копирует [cursor, h);
+ *   3. r = reserved (после acquire-барьера); если r - cursor > size, часть
+ *      скопированного уже перезаписана - начало копии отбрасывается до
+ *      r - size;
+ *   4. cursor = h.
+ */
+#define TM_SHM_MAGIC 0x746d7368 /* "tmsh" */
+#define TM_SHM_VERSION 1
+
+struct tm_shm_region {
+    __u64 head;
+    __u64 reserved;
+    /* Записей в области */
+    __u64 records;
+    __u64 data_offset;
+    __u64 size;
+    __u64 pad[3];
+};
+
+struct tm_shm_header {
+    __u32 magic;
+    __u32 version;
+    __u32 nr_regions;
+    __u32 reserved;
+    __u64 format_ns;
+    __u64 pad[5];
+    struct tm_shm_region regions[TM_STATS_MAX_STREAMS];
+};
+
+/*
+ * Управление через открытый дескриптор /dev/test_module: TM_IOC_SET_PARAM
+ * (нужен CAP_SYS_ADMIN) устанавливает параметр модуля так же, как запись
+ * в /sys/module/test_module/parameters/<name>, и возвращает новое
+ * поколение конфигурации. Поколение растет на каждое успешное изменение
+ * через ioctl; записи в файлы sysfs его не меняют.
+ */
+#define TM_PARAM_NAME_MAX 64
+#define TM_PARAM_VALUE_MAX 4096
+
+struct tm_param {
+    char name[TM_PARAM_NAME_MAX];
+    char value[TM_PARAM_VALUE_MAX];
+    /* Заполняется ядром: поколение после применения */
+    __u64 generation;
+};
+
+#define TM_IOC_MAGIC 't'
+#define TM_IOC_SET_PARAM _IOWR(TM_IOC_MAGIC, 1, struct tm_param)
+#define TM_IOC_GET_GENERATION _IOR(TM_IOC_MAGIC, 2, __u64)
+/* Возвращает новый fd shmem-файла лога (O_RDONLY | O_CLOEXEC) */
+#define TM_IOC_SHM_FD _IO(TM_IOC_MAGIC, 3)
+
+/*
+ * Читатели кольца записей (параметр reader_ring_kb): каждое открытие
+ * TM_LOG_DEVICE_PATH регистрирует читателя со своим курсором. Позиции -
+ * номера байт от загрузки модуля. read() отдает байты после pos; пока
+ * читатель не вызвал TM_IOC_READER_ACK, прочитанное подтверждается сразу,
+ * после первого вызова - только явно. Кольцо освобождает место лишь до
+ * подтверждения самого медленного читателя; читатель, отставший больше
+ * чем на размер кольца, отключается: read() возвращает EPIPE, poll() -
+ * POLLERR, а в статусе остается отставание на момент отключения.
+ */
+#define TM_LOG_DEVICE_PATH "/dev/test_module_log"
+
+struct tm_reader_status {
+    /* Байт, записанных в кольцо */
+    __u64 head;
+    __u64 pos;
+    __u64 acked;
+    /* head - acked, у отключенного читателя - на момент отключения */
+    __u64 lag;
+    __u32 id;
+    __u32 detached;
+};
+
+#define TM_IOC_READER_ACK _IOW(TM_IOC_MAGIC, 4, __u64)
+#define TM_IOC_READER_STATUS _IOR(TM_IOC_MAGIC, 5, struct tm_reader_status)
+
+#endif /* _TEST_MODULE_UAPI_H */
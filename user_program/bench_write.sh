@@ -0,0 +1,46 @@
+#!/bin/sh
+# Сравнивает пропускную способность writer'а при записи пакета одним
+# буфером (kernel_write) и напрямую из слотов записей (vfs_iter_write).
+#
+# Usage: sudo ./bench_write.sh [RECORDS] [STREAM]
+
+RECORDS=${1:-1000000}
+STREAM=${2:-0}
+PARAMS=/sys/module/test_module/parameters
+STREAMS=/proc/test_module/streams
+
+if [ ! -d "$PARAMS" ]; then
+    echo "Error: test_module is not loaded" >&2
+    exit 1
+fi
+
+stream_field() {
+    awk -v s="stream $STREAM:" -v f="$1" 'index($0, s) == 1 {
+        for (i = 1; i <= NF; i++) if (index($i, f "=") == 1) print substr($i, length(f) + 2)
+    }' "$STREAMS"
+}
+
+run() {
+    echo "$1" > "$PARAMS/write_vectored" || exit 1
+
+    BYTES0=$(stream_field bytes)
+    IO0=$(stream_field io_ns)
+
+    echo "$STREAM $RECORDS" > "$PARAMS/bench_records" || exit 1
+    while [ "$(cat "$PARAMS/bench_records")" -ne 0 ] || [ "$(stream_field backlog)" -ne 0 ]; do
+        sleep 0.2
+    done
+    sleep 1
+
+    BYTES1=$(stream_field bytes)
+    IO1=$(stream_field io_ns)
+
+    awk -v mode="$(stream_field write_mode)" -v b=$((BYTES1 - BYTES0)) -v t=$((IO1 - IO0)) 'BEGIN {
+        printf "%-9s %12d bytes in %10.3f ms of I/O: %8.1f MB/s\n",
+               mode, b, t / 1e6, t > 0 ? b * 1000 / t : 0
+    }'
+}
+
+echo "Writing $RECORDS records to stream $STREAM in each mode..."
+run N
+run Y
@@ -0,0 +1,165 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+
+#include "tm_stats.h"
+
+/*
+ * Следит за heartbeat test_module через отображенную страницу: тик
+ * считается пропущенным, если с последнего прошло больше PERIODS периодов.
+ * Проверка - чтение памяти и clock_gettime(), без файлового I/O.
+ */
+
+#define DEFAULT_PERIODS 3
+#define DEFAULT_INTERVAL_MS 100
+
+static void print_usage(const char *prog_name)
+{
+    printf("Usage: %s [OPTIONS]\n", prog_name);
+    printf("\nOptions:\n");
+    printf("  -s, --stream N         Stream to watch (default: all)\n");
+    printf("  -n, --periods N        Alarm when the heartbeat is N periods late (default: %d)\n",
+           DEFAULT_PERIODS);
+    printf("  -i, --interval MS      Check interval in milliseconds (default: %d)\n",
+           DEFAULT_INTERVAL_MS);
+    printf("  -1, --once             Check once; exit status 2 if any stream is late\n");
+}
+
+static int parse_uint(const char *str, unsigned int min, unsigned int max, unsigned int *out)
+{
+    char *endptr;
+    unsigned long value;
+
+    errno = 0;
+    value = strtoul(str, &endptr, 10);
+    if (endptr == str || *endptr != '\0' || errno == ERANGE || value < min || value > max) {
+        fprintf(stderr, "Error: Invalid value %s (expected %u-%u)\n", str, min, max);
+        return -1;
+    }
+
+    *out = (unsigned int)value;
+    return 0;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/* Возвращает true, если поток опаздывает; печатает переходы тревога/норма */
+static bool check_stream(const tm_stats_t *stats, unsigned int stream, unsigned int periods,
+                         bool *alarmed, bool verbose)
+{
+    struct tm_heartbeat_stream hb;
+    unsigned long long age_ns;
+    unsigned long long limit_ns;
+
+    if (tm_heartbeat_read(stats, stream, &hb) != 0) {
+        fprintf(stderr, "Failed to read heartbeat of stream %u: %s\n", stream, strerror(errno));
+        return true;
+    }
+
+    /* До первого тика mono_ns равен 0 */
+    if (hb.mono_ns == 0) {
+        return false;
+    }
+
+    age_ns = now_ns() - hb.mono_ns;
+    limit_ns = (unsigned long long)hb.period_ms * periods * 1000000ULL;
+
+    if (age_ns > limit_ns) {
+        if (!*alarmed || verbose) {
+            printf("ALARM stream %u: last tick %llu was %llu ms ago (period %u ms)\n",
+                   stream, (unsigned long long)hb.tick, age_ns / 1000000ULL, hb.period_ms);
+            fflush(stdout);
+        }
+        *alarmed = true;
+        return true;
+    }
+
+    if (*alarmed || verbose) {
+        printf("OK stream %u: tick %llu, %llu ms ago\n",
+               stream, (unsigned long long)hb.tick, age_ns / 1000000ULL);
+        fflush(stdout);
+    }
+    *alarmed = false;
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    tm_stats_t stats = { .fd = -1 };
+    unsigned int periods = DEFAULT_PERIODS;
+    unsigned int interval_ms = DEFAULT_INTERVAL_MS;
+    unsigned int stream = 0;
+    bool all_streams = true;
+    bool once = false;
+    bool alarmed[TM_STATS_MAX_STREAMS] = { false };
+    struct timespec interval;
+    unsigned int first;
+    unsigned int last;
+    unsigned int i;
+    bool late;
+
+    for (int a = 1; a < argc; a++) {
+        if ((strcmp(argv[a], "-s") == 0 || strcmp(argv[a], "--stream") == 0) && a + 1 < argc) {
+            if (parse_uint(argv[++a], 0, TM_STATS_MAX_STREAMS - 1, &stream) != 0)
+                return 1;
+            all_streams = false;
+        } else if ((strcmp(argv[a], "-n") == 0 || strcmp(argv[a], "--periods") == 0) && a + 1 < argc) {
+            if (parse_uint(argv[++a], 1, 1000, &periods) != 0)
+                return 1;
+        } else if ((strcmp(argv[a], "-i") == 0 || strcmp(argv[a], "--interval") == 0) && a + 1 < argc) {
+            if (parse_uint(argv[++a], 1, 3600000, &interval_ms) != 0)
+                return 1;
+        } else if (strcmp(argv[a], "-1") == 0 || strcmp(argv[a], "--once") == 0) {
+            once = true;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[a]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (tm_stats_open(&stats) != 0) {
+        fprintf(stderr, "Failed to map %s: %s\n", TM_DEVICE_PATH, strerror(errno));
+        return 1;
+    }
+
+    if (stream >= tm_stats_nr_streams(&stats)) {
+        fprintf(stderr, "Error: Stream %u is not configured\n", stream);
+        tm_stats_close(&stats);
+        return 1;
+    }
+
+    first = all_streams ? 0 : stream;
+    last = all_streams ? tm_stats_nr_streams(&stats) - 1 : stream;
+
+    interval.tv_sec = interval_ms / 1000;
+    interval.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+
+    for (;;) {
+        late = false;
+        for (i = first; i <= last; i++) {
+            late |= check_stream(&stats, i, periods, &alarmed[i], once);
+        }
+
+        if (once) {
+            break;
+        }
+
+        nanosleep(&interval, NULL);
+    }
+
+    tm_stats_close(&stats);
+    return late ? 2 : 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Сравнивает время, потраченное системой в softirq, и число TIMER softirq
+# за интервал. Запускать при process_ticks=0 и process_ticks=1.
+#
+# Usage: ./measure_softirq.sh [SECONDS]
+
+DURATION=${1:-30}
+STATS=/proc/test_module/streams
+
+softirq_ticks() {
+    awk '/^cpu / { print $8 }' /proc/stat
+}
+
+timer_softirqs() {
+    awk '/TIMER:/ { s = 0; for (i = 2; i <= NF; i++) s += $i; print s }' /proc/softirqs
+}
+
+HZ=$(getconf CLK_TCK)
+
+echo "process_ticks: $(cat /sys/module/test_module/parameters/process_ticks 2>/dev/null)"
+echo "Measuring for $DURATION seconds..."
+
+SI0=$(softirq_ticks)
+TS0=$(timer_softirqs)
+sleep "$DURATION"
+SI1=$(softirq_ticks)
+TS1=$(timer_softirqs)
+
+awk -v si=$((SI1 - SI0)) -v ts=$((TS1 - TS0)) -v hz="$HZ" -v d="$DURATION" 'BEGIN {
+    printf "softirq time:      %.1f ms/s\n", si * 1000 / hz / d
+    printf "TIMER softirqs:    %.1f /s\n", ts / d
+}'
+
+if [ -r "$STATS" ]; then
+    grep '^stream' "$STATS" | grep -o '^stream [0-9]*\|tick_[a-z]*_ns=[0-9]*' | paste -d ' ' - - -
+fi
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Считает пробуждения CPU из простоя и срабатывания таймеров test_module
+# через tracepoints power:cpu_idle и timer:timer_expire_entry.
+#
+# Usage: sudo ./measure_wakeups.sh [SECONDS]
+
+DURATION=${1:-30}
+TRACEFS=/sys/kernel/tracing
+[ -d "$TRACEFS/events" ] || TRACEFS=/sys/kernel/debug/tracing
+
+if [ ! -d "$TRACEFS/events" ]; then
+    echo "Error: tracefs is not mounted" >&2
+    exit 1
+fi
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "This script requires root privileges. Please run with sudo." >&2
+    exit 1
+fi
+
+INSTANCE="$TRACEFS/instances/test_module_wakeups"
+mkdir "$INSTANCE" || exit 1
+trap 'echo 0 > "$INSTANCE/tracing_on"; rmdir "$INSTANCE"' EXIT INT TERM
+
+echo 'state == 4294967295' > "$INSTANCE/events/power/cpu_idle/filter"
+echo 1 > "$INSTANCE/events/power/cpu_idle/enable"
+echo 1 > "$INSTANCE/events/timer/timer_expire_entry/enable"
+echo 16384 > "$INSTANCE/buffer_size_kb"
+
+echo "Timer mode per stream: $(cat /sys/module/test_module/parameters/timer_deferrable 2>/dev/null)"
+echo "Tracing for $DURATION seconds..."
+
+echo 1 > "$INSTANCE/tracing_on"
+sleep "$DURATION"
+echo 0 > "$INSTANCE/tracing_on"
+
+# cpu_idle с state=-1 - выход CPU из простоя, т.е. пробуждение
+awk -v d="$DURATION" '
+    / cpu_idle: / { wakeups++ }
+    / timer_expire_entry: / && /function=(deferrable_)?timer_callback/ { ticks++ }
+    END {
+        printf "CPU wakeups:        %d (%.2f/s)\n", wakeups, wakeups / d
+        printf "test_module ticks:  %d (%.2f/s)\n", ticks, ticks / d
+    }' "$INSTANCE/trace"
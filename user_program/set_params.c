@@ -8,6 +8,18 @@
 #include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <signal.h>
+#include <libgen.h>
+
+#include "tm_stats.h"
 
 #define MODULE_NAME "test_module"
 #define SYSFS_BASE "/sys/module/" MODULE_NAME "/parameters"
@@ -17,12 +29,48 @@
 #define MIN_PERIOD 1
 #define MAX_FILENAME_LEN (PATH_MAX - 1)
 #define PERIOD_STR_BUF_SIZE 32
+#define DEFAULT_WATCH_INTERVAL_MS 1000
+#define MIN_WATCH_INTERVAL_MS 100
+#define MAX_WATCH_INTERVAL_MS 60000
+#define MAX_CONFIG_ENTRIES 256
+#define MAX_PARAM_NAME_LEN 64
+#define MAX_PARAM_VALUE_LEN (PATH_MAX + 1)
+/* Все параметры-массивы модуля - по одному элементу на поток */
+#define MAX_ARRAY_ELEMENTS TM_STATS_MAX_STREAMS
+#define ARRAY_ELEMENT_LEN (MAX_PARAM_VALUE_LEN / MAX_ARRAY_ELEMENTS)
+#define MAX_BENCH_ITERATIONS 1000
+#define BENCH_TIMEOUT_MS 15000
+#define PARAM_BENCH_RECORDS SYSFS_BASE "/bench_records"
+#define CONFIG_DUMP_SIZE 16384
 
 typedef struct {
     const char *filename;
     unsigned int period;
+    bool watch;
+    unsigned int watch_interval_ms;
+    const char *config;
+    bool dry_run;
+    bool daemon;
+    unsigned int bench_iterations;
+    bool verify;
+    bool json;
 } module_params_t;
 
+/* Строка конфигурации: "name = value" или "name[index] = value" для параметров-массивов */
+typedef struct {
+    char name[MAX_PARAM_NAME_LEN];
+    int index;
+    char value[MAX_PARAM_VALUE_LEN];
+    unsigned int line;
+} config_entry_t;
+
+/* Параметр, который нужно изменить: текущее и желаемое значение */
+typedef struct {
+    char name[MAX_PARAM_NAME_LEN];
+    char current[MAX_PARAM_VALUE_LEN];
+    char desired[MAX_PARAM_VALUE_LEN];
+} param_change_t;
+
 static void params_init(module_params_t *params)
 {
     if (!params) {
@@ -30,8 +78,20 @@ static void params_init(module_params_t *params)
     }
     params->filename = NULL;
     params->period = 0;
+    params->watch = false;
+    params->watch_interval_ms = DEFAULT_WATCH_INTERVAL_MS;
+    params->config = NULL;
+    params->dry_run = false;
+    params->daemon = false;
+    params->bench_iterations = 0;
+    params->verify = false;
+    params->json = false;
 }
 
+/* С --json stdout занят отчетом, поэтому сообщения о ходе работы идут в stderr */
+static FILE *msg_out;
+static bool json_output;
+
 void print_usage(const char *prog_name)
 {
     if (!prog_name) {
@@ -42,10 +102,31 @@ void print_usage(const char *prog_name)
     printf("\nOptions:\n");
     printf("  -f, --filename PATH    Set the log file path\n");
     printf("  -p, --period SECONDS   Set the timer period in seconds (1-3600)\n");
+    printf("  -c, --config FILE      Apply the desired state from FILE ('-' for stdin)\n");
+    printf("  -n, --dry-run          With --config, only print the planned changes\n");
+    printf("  -d, --daemon           With --config, re-apply FILE every time it is saved\n");
+    printf("  -V, --verify           Read all parameters back in one read and compare\n");
+    printf("                         (the reported generation counts %s ioctl changes only)\n", TM_DEVICE_PATH);
+    printf("  -j, --json             With --verify, print the result as JSON\n");
+    printf("  -b, --bench-reconfig N Measure N period and N filename changes until they show up\n");
+    printf("  -w, --watch            Show live per-stream stats until interrupted\n");
+    printf("  -i, --interval MS      Refresh interval for --watch (%d-%d, default %d)\n",
+           MIN_WATCH_INTERVAL_MS, MAX_WATCH_INTERVAL_MS, DEFAULT_WATCH_INTERVAL_MS);
     printf("\nExamples:\n");
     printf("  sudo %s -p 1                    # Change timer period to 1 second\n", prog_name);
     printf("  sudo %s -f /var/tmp/test_module/log.txt -p 5\n", prog_name);
     printf("  sudo %s -f /var/tmp/test_module/log.txt -p 10\n", prog_name);
+    printf("  %s --watch -i 500\n", prog_name);
+    printf("  sudo %s --bench-reconfig 20\n", prog_name);
+    printf("  sudo %s --config /etc/test_module.conf --dry-run\n", prog_name);
+    printf("  sudo %s --config /etc/test_module.conf --daemon\n", prog_name);
+    printf("  sudo %s --config /etc/test_module.conf --verify --json\n", prog_name);
+    printf("  %s --config /etc/test_module.conf --dry-run --verify   # check only\n", prog_name);
+    printf("\nConfig file format (one parameter per line, '#' starts a comment):\n");
+    printf("  filename = /var/tmp/test_module/log.txt\n");
+    printf("  timer_period = 5\n");
+    printf("  stream_rate = 100,0,50     # whole array\n");
+    printf("  stream_rate[1] = 20        # single element, others keep their values\n");
 }
 
 int validate_filepath(const char *filename)
@@ -177,9 +258,1059 @@ static int parse_period(const char *str, unsigned int *period_out)
     return 0;
 }
 
+static char *trim(char *str)
+{
+    char *end;
+
+    while (isspace((unsigned char)*str))
+        str++;
+
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1]))
+        end--;
+    *end = '\0';
+
+    return str;
+}
+
+int read_sysfs_param(const char *name, char *value, size_t size)
+{
+    char path[PATH_MAX];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), SYSFS_BASE "/%s", name);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            fprintf(stderr, "Error: Unknown module parameter '%s' (is test_module loaded?)\n", name);
+        } else {
+            fprintf(stderr, "Failed to open sysfs parameter file %s: %s\n", path, strerror(errno));
+        }
+        return -1;
+    }
+
+    n = read(fd, value, size - 1);
+    close(fd);
+    if (n < 0) {
+        fprintf(stderr, "Failed to read sysfs parameter file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    value[n] = '\0';
+
+    memmove(value, trim(value), strlen(trim(value)) + 1);
+    return 0;
+}
+
+/* bool-параметры ядро показывает как Y/N; приводим к этому виду значения из конфигурации */
+static void normalize_bool(char *value)
+{
+    static const char *const yes[] = { "1", "y", "yes", "true", "on" };
+    static const char *const no[] = { "0", "n", "no", "false", "off" };
+    size_t i;
+
+    for (i = 0; i < sizeof(yes) / sizeof(yes[0]); i++) {
+        if (strcasecmp(value, yes[i]) == 0) {
+            strcpy(value, "Y");
+            return;
+        }
+        if (strcasecmp(value, no[i]) == 0) {
+            strcpy(value, "N");
+            return;
+        }
+    }
+}
+
+static int parse_config_line(char *line, unsigned int line_no, config_entry_t *entry)
+{
+    char *eq;
+    char *name;
+    char *value;
+    char *bracket;
+    char *endptr;
+    long index = -1;
+
+    eq = strchr(line, '=');
+    if (!eq) {
+        fprintf(stderr, "Error: line %u: expected 'name = value'\n", line_no);
+        return -1;
+    }
+    *eq = '\0';
+    name = trim(line);
+    value = trim(eq + 1);
+
+    bracket = strchr(name, '[');
+    if (bracket) {
+        index = strtol(bracket + 1, &endptr, 10);
+        if (endptr == bracket + 1 || strcmp(endptr, "]") != 0 ||
+            index < 0 || index >= MAX_ARRAY_ELEMENTS) {
+            fprintf(stderr, "Error: line %u: invalid array index in '%s'\n", line_no, name);
+            return -1;
+        }
+        *bracket = '\0';
+    }
+
+    if (*name == '\0' || strlen(name) >= sizeof(entry->name) || strchr(name, '/') ||
+        strlen(value) >= sizeof(entry->value)) {
+        fprintf(stderr, "Error: line %u: invalid parameter name or value\n", line_no);
+        return -1;
+    }
+
+    if (strcmp(name, "filename") == 0 && validate_filepath(value) != 0) {
+        return -1;
+    }
+
+    if (strcmp(name, "timer_period") == 0) {
+        unsigned int period;
+
+        if (parse_period(value, &period) != 0)
+            return -1;
+    }
+
+    strcpy(entry->name, name);
+    strcpy(entry->value, value);
+    entry->index = (int)index;
+    entry->line = line_no;
+    return 0;
+}
+
+static int parse_config(const char *path, config_entry_t *entries, unsigned int *nr_entries)
+{
+    FILE *file;
+    char *line = NULL;
+    size_t cap = 0;
+    unsigned int line_no = 0;
+    char *content;
+    char *comment;
+    int ret = 0;
+
+    file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open config file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    *nr_entries = 0;
+    while (getline(&line, &cap, file) >= 0) {
+        line_no++;
+
+        comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+        content = trim(line);
+        if (*content == '\0')
+            continue;
+
+        if (*nr_entries >= MAX_CONFIG_ENTRIES) {
+            fprintf(stderr, "Error: Too many config entries (max %d)\n", MAX_CONFIG_ENTRIES);
+            ret = -1;
+            break;
+        }
+
+        if (parse_config_line(content, line_no, &entries[*nr_entries]) != 0) {
+            ret = -1;
+            break;
+        }
+        (*nr_entries)++;
+    }
+
+    free(line);
+    if (file != stdin)
+        fclose(file);
+    return ret;
+}
+
+/*
+ * Разбивает "a, b,c" на элементы без окружающих пробелов. Возвращает их
+ * число; больше MAX_ARRAY_ELEMENTS - значение не массив модуля.
+ */
+static int split_array(const char *value, char elements[][ARRAY_ELEMENT_LEN])
+{
+    char copy[MAX_PARAM_VALUE_LEN];
+    char *token = copy;
+    char *comma;
+    int count = 0;
+
+    snprintf(copy, sizeof(copy), "%s", value);
+    for (;;) {
+        comma = strchr(token, ',');
+        if (comma)
+            *comma = '\0';
+        if (count == MAX_ARRAY_ELEMENTS)
+            return count + 1;
+        snprintf(elements[count++], ARRAY_ELEMENT_LEN, "%s", trim(token));
+        if (!comma)
+            return count;
+        token = comma + 1;
+    }
+}
+
+static void join_array(char *array, size_t size, char elements[][ARRAY_ELEMENT_LEN], int count)
+{
+    size_t len = 0;
+    int i;
+
+    array[0] = '\0';
+    for (i = 0; i < count && len < size; i++)
+        len += (size_t)snprintf(array + len, size - len, "%s%s", i ? "," : "", elements[i]);
+}
+
+/*
+ * Массивы модуля (bool, int, uint) ядро показывает целиком, по
+ * MAX_ARRAY_ELEMENTS элементов; строки вроде filter с запятыми - не массивы.
+ */
+static bool is_array_value(const char *current)
+{
+    char elements[MAX_ARRAY_ELEMENTS][ARRAY_ELEMENT_LEN];
+    char *end;
+    int i;
+
+    if (split_array(current, elements) != MAX_ARRAY_ELEMENTS)
+        return false;
+
+    for (i = 0; i < MAX_ARRAY_ELEMENTS; i++) {
+        if (strcmp(elements[i], "Y") == 0 || strcmp(elements[i], "N") == 0)
+            continue;
+        strtoll(elements[i], &end, 0);
+        if (end == elements[i] || *end != '\0')
+            return false;
+    }
+
+    return true;
+}
+
+/* Заменяет элемент index в значении массива "a,b,c" */
+static int set_array_element(char *array, size_t size, int index, const char *value)
+{
+    char elements[MAX_ARRAY_ELEMENTS][ARRAY_ELEMENT_LEN];
+    int count;
+
+    count = split_array(array, elements);
+    if (count > MAX_ARRAY_ELEMENTS || index >= count) {
+        fprintf(stderr, "Error: Index %d is beyond the current array length %d\n", index, count);
+        return -1;
+    }
+
+    snprintf(elements[index], sizeof(elements[0]), "%s", value);
+    join_array(array, size, elements, count);
+    return 0;
+}
+
+/*
+ * Запись "a,b" в массив меняет только первые элементы, остальные ядро
+ * сохраняет; дописываем их из текущего значения, чтобы сравнение с ним
+ * и проверка после применения видели массив целиком.
+ */
+static void pad_array(char *desired, size_t size, const char *current)
+{
+    char cur[MAX_ARRAY_ELEMENTS][ARRAY_ELEMENT_LEN];
+    char want[MAX_ARRAY_ELEMENTS][ARRAY_ELEMENT_LEN];
+    int count;
+    int i;
+
+    if (!is_array_value(current))
+        return;
+
+    split_array(current, cur);
+    count = split_array(desired, want);
+    if (count >= MAX_ARRAY_ELEMENTS)
+        return;
+
+    for (i = count; i < MAX_ARRAY_ELEMENTS; i++)
+        strcpy(want[i], cur[i]);
+    join_array(desired, size, want, MAX_ARRAY_ELEMENTS);
+}
+
+/* Элементы равны, если совпадают как числа (как их разбирает ядро), как bool или как строки */
+static bool element_equal(const char *a, const char *b)
+{
+    char bool_a[ARRAY_ELEMENT_LEN];
+    char bool_b[ARRAY_ELEMENT_LEN];
+    char *end_a;
+    char *end_b;
+    long long num_a;
+    long long num_b;
+
+    if (strcmp(a, b) == 0)
+        return true;
+
+    errno = 0;
+    num_a = strtoll(a, &end_a, 0);
+    num_b = strtoll(b, &end_b, 0);
+    if (errno == 0 && end_a != a && *end_a == '\0' && end_b != b && *end_b == '\0')
+        return num_a == num_b;
+
+    snprintf(bool_a, sizeof(bool_a), "%s", a);
+    snprintf(bool_b, sizeof(bool_b), "%s", b);
+    normalize_bool(bool_a);
+    normalize_bool(bool_b);
+    return strcmp(bool_a, bool_b) == 0;
+}
+
+/*
+ * Сравнивает значение параметра из sysfs с желаемым: массивы - поэлементно,
+ * без учета пробелов и записи чисел, остальное - как одно значение.
+ */
+static bool values_equal(const char *current, const char *desired)
+{
+    char cur[MAX_ARRAY_ELEMENTS][ARRAY_ELEMENT_LEN];
+    char want[MAX_ARRAY_ELEMENTS][ARRAY_ELEMENT_LEN];
+    char trimmed[MAX_PARAM_VALUE_LEN];
+    int count;
+    int i;
+
+    if (!is_array_value(current)) {
+        if (strlen(desired) >= ARRAY_ELEMENT_LEN || strlen(current) >= ARRAY_ELEMENT_LEN)
+            return strcmp(current, desired) == 0;
+        snprintf(trimmed, sizeof(trimmed), "%s", desired);
+        return element_equal(current, trim(trimmed));
+    }
+
+    split_array(current, cur);
+    count = split_array(desired, want);
+    if (count != MAX_ARRAY_ELEMENTS)
+        return false;
+
+    for (i = 0; i < count; i++) {
+        if (!element_equal(cur[i], want[i]))
+            return false;
+    }
+
+    return true;
+}
+
+static void normalize_value(char *value, const char *current)
+{
+    char copy[MAX_PARAM_VALUE_LEN];
+    char *saveptr = NULL;
+    char *token;
+    size_t len = 0;
+
+    /* Для bool-массивов ("Y,N,...") нормализуем каждый элемент */
+    if (current[0] != 'Y' && current[0] != 'N') {
+        return;
+    }
+
+    snprintf(copy, sizeof(copy), "%s", value);
+    value[0] = '\0';
+    for (token = strtok_r(copy, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        token = trim(token);
+        normalize_bool(token);
+        len += (size_t)snprintf(value + len, MAX_PARAM_VALUE_LEN - len, "%s%s", len ? "," : "", token);
+        if (len >= MAX_PARAM_VALUE_LEN)
+            break;
+    }
+}
+
+/*
+ * Сводит записи конфигурации к итоговому значению каждого параметра
+ * рядом с текущим. Элементы массивов одного параметра сливаются в
+ * одно значение, поэтому на параметр приходится не больше одной записи в sysfs.
+ */
+static int plan_changes(const config_entry_t *entries, unsigned int nr_entries,
+                        param_change_t *changes, unsigned int *nr_changes)
+{
+    unsigned int i;
+    unsigned int j;
+    param_change_t *change;
+
+    *nr_changes = 0;
+    for (i = 0; i < nr_entries; i++) {
+        change = NULL;
+        for (j = 0; j < *nr_changes; j++) {
+            if (strcmp(changes[j].name, entries[i].name) == 0) {
+                change = &changes[j];
+                break;
+            }
+        }
+
+        if (!change) {
+            change = &changes[(*nr_changes)++];
+            strcpy(change->name, entries[i].name);
+            if (read_sysfs_param(change->name, change->current, sizeof(change->current)) != 0)
+                return -1;
+            strcpy(change->desired, change->current);
+        }
+
+        if (entries[i].index >= 0) {
+            char element[MAX_PARAM_VALUE_LEN];
+
+            snprintf(element, sizeof(element), "%s", entries[i].value);
+            normalize_value(element, change->current);
+            if (set_array_element(change->desired, sizeof(change->desired),
+                                  entries[i].index, element) != 0) {
+                fprintf(stderr, "Error: line %u: cannot set %s[%d]\n",
+                        entries[i].line, entries[i].name, entries[i].index);
+                return -1;
+            }
+        } else {
+            strcpy(change->desired, entries[i].value);
+            normalize_value(change->desired, change->current);
+            pad_array(change->desired, sizeof(change->desired), change->current);
+        }
+    }
+
+    return 0;
+}
+
+static void json_string(const char *str)
+{
+    const unsigned char *c;
+
+    putchar('"');
+    for (c = (const unsigned char *)str; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            printf("\\%c", *c);
+        else if (*c < 0x20)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    putchar('"');
+}
+
+/* Ищет "name=value" в выводе параметра config; value обрезается до конца строки */
+static const char *config_lookup(char *dump, const char *name, char *value, size_t size)
+{
+    size_t name_len = strlen(name);
+    char *line = dump;
+    char *end;
+
+    while (line && *line) {
+        end = strchr(line, '\n');
+        if (strncmp(line, name, name_len) == 0 && line[name_len] == '=') {
+            snprintf(value, size, "%.*s", (int)((end ? end : line + strlen(line)) - line - name_len - 1),
+                     line + name_len + 1);
+            return value;
+        }
+        line = end ? end + 1 : NULL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Сверяет targets[].desired с действующими значениями, прочитанными одним
+ * чтением параметра config (модуль формирует его под kernel_param_lock,
+ * поэтому значения согласованы). Массивы сравниваются поэлементно, как
+ * в plan_changes(). error != NULL - отчет о сбое до сверки. С --json
+ * результат печатается одним объектом в stdout. generation считает только
+ * изменения через TM_IOC_SET_PARAM: записи в файлы sysfs его не меняют.
+ */
+static int verify_params(const param_change_t *targets, unsigned int nr_targets, const char *error)
+{
+    static char dump[CONFIG_DUMP_SIZE];
+    char actual[MAX_PARAM_VALUE_LEN];
+    char generation[32] = "0";
+    bool json = json_output;
+    bool ok;
+    bool all_ok;
+    unsigned int i;
+
+    if (!error && read_sysfs_param("config", dump, sizeof(dump)) != 0) {
+        error = "failed to read " SYSFS_BASE "/config";
+    }
+
+    if (error) {
+        if (json) {
+            printf("{\"ok\":false,\"error\":");
+            json_string(error);
+            printf("}\n");
+        } else {
+            fprintf(stderr, "Verification failed: %s\n", error);
+        }
+        return -1;
+    }
+
+    config_lookup(dump, "generation", generation, sizeof(generation));
+
+    all_ok = true;
+    for (i = 0; i < nr_targets; i++) {
+        all_ok &= config_lookup(dump, targets[i].name, actual, sizeof(actual)) &&
+                  values_equal(actual, targets[i].desired);
+    }
+
+    if (json) {
+        printf("{\"ok\":%s,\"generation\":%s,\"params\":[", all_ok ? "true" : "false", generation);
+    }
+
+    for (i = 0; i < nr_targets; i++) {
+        ok = config_lookup(dump, targets[i].name, actual, sizeof(actual)) != NULL;
+        if (!ok)
+            actual[0] = '\0';
+        ok = ok && values_equal(actual, targets[i].desired);
+
+        if (json) {
+            printf("%s{\"name\":", i ? "," : "");
+            json_string(targets[i].name);
+            printf(",\"expected\":");
+            json_string(targets[i].desired);
+            printf(",\"actual\":");
+            json_string(actual);
+            printf(",\"ok\":%s}", ok ? "true" : "false");
+        } else if (ok) {
+            printf("verified %s = %s\n", targets[i].name, actual);
+        } else {
+            printf("MISMATCH %s: expected %s, module has %s\n",
+                   targets[i].name, targets[i].desired, actual[0] ? actual : "(missing)");
+        }
+    }
+
+    if (json) {
+        printf("]}\n");
+    } else {
+        printf("%s: %u parameter(s) checked, config generation %s\n",
+               all_ok ? "OK" : "FAILED", nr_targets, generation);
+    }
+    fflush(stdout);
+
+    return all_ok ? 0 : -1;
+}
+
+/* Установка через управляющий дескриптор /dev/test_module, без открытия файлов sysfs */
+static int set_param_ioctl(int ctl_fd, const char *name, const char *value,
+                           unsigned long long *generation)
+{
+    static struct tm_param param;
+
+    if (strlen(name) >= sizeof(param.name) || strlen(value) >= sizeof(param.value)) {
+        fprintf(stderr, "Error: %s value is too long\n", name);
+        return -1;
+    }
+
+    memset(&param, 0, sizeof(param));
+    strcpy(param.name, name);
+    strcpy(param.value, value);
+
+    if (ioctl(ctl_fd, TM_IOC_SET_PARAM, &param) != 0) {
+        fprintf(stderr, "Failed to set %s via %s: %s\n", name, TM_DEVICE_PATH, strerror(errno));
+        return -1;
+    }
+
+    *generation = param.generation;
+    return 0;
+}
+
+/*
+ * Применяет конфигурацию. Если ctl_fd >= 0, параметры пишутся через ioctl
+ * на уже открытом /dev/test_module, иначе - в файлы sysfs.
+ */
+static int apply_config(const char *path, bool dry_run, int ctl_fd, bool verify)
+{
+    unsigned long long generation = 0;
+    static config_entry_t entries[MAX_CONFIG_ENTRIES];
+    static param_change_t changes[MAX_CONFIG_ENTRIES];
+    char param_path[PATH_MAX];
+    struct stat st;
+    unsigned int nr_entries;
+    unsigned int nr_targets;
+    unsigned int nr_changes = 0;
+    unsigned int i;
+    int ret = 0;
+
+    if (parse_config(path, entries, &nr_entries) != 0) {
+        return verify ? verify_params(NULL, 0, "invalid config") : -1;
+    }
+
+    if (plan_changes(entries, nr_entries, changes, &nr_targets) != 0) {
+        return verify ? verify_params(NULL, 0, "failed to read current parameters") : -1;
+    }
+
+    for (i = 0; i < nr_targets; i++) {
+        if (values_equal(changes[i].current, changes[i].desired))
+            continue;
+        fprintf(msg_out, "%s: %s -> %s\n", changes[i].name, changes[i].current, changes[i].desired);
+        nr_changes++;
+    }
+
+    if (nr_changes == 0) {
+        fprintf(msg_out, "Module state already matches %s\n", path);
+        goto out;
+    }
+
+    if (dry_run) {
+        fprintf(msg_out, "Dry run: %u change(s) not applied\n", nr_changes);
+        goto out;
+    }
+
+    for (i = 0; i < nr_targets; i++) {
+        if (values_equal(changes[i].current, changes[i].desired))
+            continue;
+
+        snprintf(param_path, sizeof(param_path), SYSFS_BASE "/%s", changes[i].name);
+        /* root проходит access(W_OK) и для 0444, поэтому смотрим на права файла */
+        if (stat(param_path, &st) == 0 && !(st.st_mode & S_IWUSR)) {
+            fprintf(stderr, "Error: %s is read-only, it can only be set when loading the module\n",
+                    changes[i].name);
+            ret = -1;
+            continue;
+        }
+
+        if (ctl_fd >= 0) {
+            if (set_param_ioctl(ctl_fd, changes[i].name, changes[i].desired, &generation) != 0)
+                ret = -1;
+        } else if (write_sysfs_param(param_path, changes[i].desired) != 0) {
+            fprintf(stderr, "Failed to set %s\n", changes[i].name);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && ctl_fd >= 0) {
+        fprintf(msg_out, "Applied %u change(s), config generation %llu\n", nr_changes, generation);
+    } else if (ret == 0) {
+        fprintf(msg_out, "Applied %u change(s)\n", nr_changes);
+    }
+
+out:
+    if (verify && verify_params(changes, nr_targets, NULL) != 0) {
+        ret = -1;
+    }
+    fflush(msg_out);
+    return ret;
+}
+
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig)
+{
+    (void)sig;
+    daemon_stop = 1;
+}
+
+/*
+ * Режим демона: /dev/test_module открывается один раз, inotify следит за
+ * каталогом файла конфигурации (редакторы часто сохраняют через rename),
+ * и при каждом сохранении применяются только изменившиеся параметры.
+ */
+static int run_daemon(const char *path)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    struct sigaction sa;
+    char *dir_copy;
+    char *base_copy;
+    const char *base;
+    bool changed;
+    ssize_t n;
+    int ctl_fd;
+    int in_fd;
+    int ret = 0;
+
+    if (strcmp(path, "-") == 0) {
+        fprintf(stderr, "Error: --daemon needs a config file, not stdin\n");
+        return -1;
+    }
+
+    ctl_fd = open(TM_DEVICE_PATH, O_RDONLY | O_CLOEXEC);
+    if (ctl_fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", TM_DEVICE_PATH, strerror(errno));
+        return -1;
+    }
+
+    dir_copy = strdup(path);
+    base_copy = strdup(path);
+    in_fd = inotify_init1(IN_CLOEXEC);
+    if (!dir_copy || !base_copy || in_fd < 0 ||
+        inotify_add_watch(in_fd, dirname(dir_copy), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Failed to watch %s: %s\n", path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+    base = basename(base_copy);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* Ошибки в конфигурации не останавливают демон: ждем следующего сохранения */
+    apply_config(path, false, ctl_fd, false);
+
+    while (!daemon_stop) {
+        n = read(in_fd, events, sizeof(events));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to read inotify events: %s\n", strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        changed = false;
+        for (char *ptr = events; ptr < events + n; ptr += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *)ptr;
+            if (event->len && strcmp(event->name, base) == 0)
+                changed = true;
+        }
+
+        if (changed) {
+            apply_config(path, false, ctl_fd, false);
+        }
+    }
+
+out:
+    if (in_fd >= 0)
+        close(in_fd);
+    free(dir_copy);
+    free(base_copy);
+    close(ctl_fd);
+    return ret;
+}
+
+static double elapsed_seconds(const struct timespec *from, const struct timespec *to)
+{
+    return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* Перцентиль по приросту гистограммы: верхняя граница корзины, мкс */
+static unsigned long long hist_percentile(const unsigned long long *delta, unsigned long long total,
+                                          double p)
+{
+    unsigned long long target;
+    unsigned long long seen = 0;
+    int b;
+
+    if (total == 0) {
+        return 0;
+    }
+
+    target = (unsigned long long)(total * p);
+    if (target == 0)
+        target = 1;
+
+    for (b = 0; b < TM_LAT_BUCKETS; b++) {
+        seen += delta[b];
+        if (seen >= target)
+            return 1ULL << b;
+    }
+
+    return 1ULL << (TM_LAT_BUCKETS - 1);
+}
+
+static void watch_draw(const struct tm_stats_stream *cur, const struct tm_stats_stream *prev,
+                       unsigned int nr_streams, double dt)
+{
+    unsigned long long delta[TM_LAT_BUCKETS];
+    unsigned long long total;
+    unsigned int i;
+    int b;
+
+    /* Курсор в начало и очистка экрана */
+    printf("\033[H\033[J");
+    printf("test_module: %u stream(s), interval %.2fs\n\n", nr_streams, dt);
+    printf("%-6s %10s %10s %10s %10s %10s %8s %8s %8s %8s\n",
+           "STREAM", "REC/S", "KB/S", "BACKLOG", "DROP/S", "OVFL/S", "ERRORS",
+           "P50us", "P90us", "P99us");
+
+    for (i = 0; i < nr_streams; i++) {
+        total = 0;
+        for (b = 0; b < TM_LAT_BUCKETS; b++) {
+            delta[b] = cur[i].lat_hist[b] - prev[i].lat_hist[b];
+            total += delta[b];
+        }
+
+        printf("%-6u %10.1f %10.1f %10llu %10.1f %10.1f %8llu %8llu %8llu %8llu\n",
+               i,
+               (cur[i].last_seq - prev[i].last_seq) / dt,
+               (cur[i].bytes_written - prev[i].bytes_written) / 1024.0 / dt,
+               (unsigned long long)cur[i].backlog_bytes,
+               (cur[i].dropped - prev[i].dropped) / dt,
+               (cur[i].overflow - prev[i].overflow) / dt,
+               (unsigned long long)cur[i].write_errors,
+               hist_percentile(delta, total, 0.50),
+               hist_percentile(delta, total, 0.90),
+               hist_percentile(delta, total, 0.99));
+    }
+    fflush(stdout);
+}
+
+/*
+ * Живой просмотр статистики. Счетчики читаются из отображенной страницы,
+ * а между обновлениями экрана программа спит в poll() на /dev/test_module
+ * до изменения статистики, а не перечитывает файлы.
+ */
+static int watch_stats(unsigned int interval_ms)
+{
+    tm_stats_t stats = { .fd = -1 };
+    struct tm_stats_stream prev[TM_STATS_MAX_STREAMS];
+    struct tm_stats_stream cur[TM_STATS_MAX_STREAMS];
+    struct timespec prev_ts;
+    struct timespec now;
+    struct timespec interval;
+    struct pollfd pfd;
+    unsigned int nr_streams;
+    unsigned int i;
+    uint64_t gen;
+
+    if (tm_stats_open(&stats) != 0) {
+        fprintf(stderr, "Failed to map %s: %s\n", TM_DEVICE_PATH, strerror(errno));
+        if (errno == ENOENT) {
+            fprintf(stderr, "Is test_module loaded?\n");
+        }
+        return -1;
+    }
+
+    nr_streams = tm_stats_nr_streams(&stats);
+    for (i = 0; i < nr_streams; i++) {
+        if (tm_stats_read_stream(&stats, i, &prev[i]) != 0)
+            memset(&prev[i], 0, sizeof(prev[i]));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &prev_ts);
+
+    interval.tv_sec = interval_ms / 1000;
+    interval.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+
+    pfd.fd = stats.fd;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        nanosleep(&interval, NULL);
+
+        /* Ждем изменения статистики; на простаивающем модуле экран обновляется раз в 10 интервалов */
+        if (poll(&pfd, 1, (int)interval_ms * 10) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd.revents & POLLIN) {
+            if (read(stats.fd, &gen, sizeof(gen)) < 0) {
+                fprintf(stderr, "Failed to read %s: %s\n", TM_DEVICE_PATH, strerror(errno));
+                break;
+            }
+        }
+
+        for (i = 0; i < nr_streams; i++) {
+            if (tm_stats_read_stream(&stats, i, &cur[i]) != 0)
+                cur[i] = prev[i];
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        watch_draw(cur, prev, nr_streams, elapsed_seconds(&prev_ts, &now));
+
+        memcpy(prev, cur, sizeof(cur[0]) * nr_streams);
+        prev_ts = now;
+    }
+
+    tm_stats_close(&stats);
+    return -1;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void bench_report(const char *what, double *lat_ms, unsigned int count, unsigned int missed)
+{
+    double sum = 0;
+    unsigned int i;
+
+    if (count == 0) {
+        printf("%-9s no changes observed (%u timed out)\n", what, missed);
+        return;
+    }
+
+    qsort(lat_ms, count, sizeof(lat_ms[0]), compare_double);
+    for (i = 0; i < count; i++)
+        sum += lat_ms[i];
+
+    printf("%-9s n=%-4u min=%9.3f p50=%9.3f p90=%9.3f p99=%9.3f max=%9.3f mean=%9.3f ms",
+           what, count, lat_ms[0], lat_ms[count / 2], lat_ms[count * 90 / 100],
+           lat_ms[count * 99 / 100], lat_ms[count - 1], sum / count);
+    if (missed)
+        printf(" (%u timed out)", missed);
+    printf("\n");
+}
+
+/*
+ * Новый период виден на странице heartbeat с первого тика после записи:
+ * ядро публикует period_ms, прочитанный в тике. Запись в timer_period
+ * перевзводит ожидающий тик, только если новый период короче оставшегося
+ * времени, поэтому задержка до первого тика с новым периодом - не больше
+ * нового периода при укорочении и не больше старого при удлинении.
+ * Направления измеряются и печатаются отдельно: lat_ms[0]/count[0] -
+ * переходы 2 -> 1 с, lat_ms[1]/count[1] - 1 -> 2 с.
+ */
+static int bench_period(const tm_stats_t *stats, unsigned int iterations,
+                        double *lat_ms[2], unsigned int count[2], unsigned int missed[2])
+{
+    struct tm_heartbeat_stream hb;
+    struct timespec start;
+    struct timespec now;
+    const struct timespec step = { 0, 100000 };
+    char value[PERIOD_STR_BUF_SIZE];
+    unsigned int period;
+    unsigned int dir;
+    unsigned int i;
+
+    for (i = 0; i < iterations; i++) {
+        /* Чередуем 1 и 2 с; первая запись 1 с может и не сменить период */
+        period = 1 + i % 2;
+        dir = period - 1;
+        snprintf(value, sizeof(value), "%u", period);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (write_sysfs_param(PARAM_TIMER_PERIOD, value) != 0)
+            return -1;
+
+        for (;;) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (tm_heartbeat_read(stats, 0, &hb) == 0 && hb.period_ms == period * 1000 &&
+                hb.mono_ns >= (unsigned long long)start.tv_sec * 1000000000ULL +
+                              (unsigned long long)start.tv_nsec) {
+                lat_ms[dir][count[dir]++] = elapsed_seconds(&start, &now) * 1000.0;
+                break;
+            }
+            if (elapsed_seconds(&start, &now) * 1000.0 > BENCH_TIMEOUT_MS) {
+                missed[dir]++;
+                break;
+            }
+            nanosleep(&step, NULL);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Новый filename виден, когда в новый файл приходят данные. Сразу после
+ * смены пишем одну запись через bench_records, чтобы не ждать тика;
+ * время сброса пакета writer'ом входит в измерение.
+ */
+static int bench_filename(const char *dir, unsigned int iterations,
+                          double *lat_ms, unsigned int *count, unsigned int *missed)
+{
+    static const char *const names[] = { "reconf_bench_a.log", "reconf_bench_b.log" };
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    char path[PATH_MAX];
+    struct timespec start;
+    struct timespec now;
+    struct pollfd pfd;
+    const char *name;
+    bool seen;
+    ssize_t n;
+    unsigned int i;
+    int timeout;
+    int ret = 0;
+
+    pfd.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (pfd.fd < 0 || inotify_add_watch(pfd.fd, dir, IN_MODIFY) < 0) {
+        fprintf(stderr, "Failed to watch %s: %s\n", dir, strerror(errno));
+        if (pfd.fd >= 0)
+            close(pfd.fd);
+        return -1;
+    }
+    pfd.events = POLLIN;
+
+    for (i = 0; i < iterations && ret == 0; i++) {
+        name = names[i % 2];
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+        /* Отбрасываем события предыдущей итерации */
+        while (read(pfd.fd, events, sizeof(events)) > 0)
+            ;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (write_sysfs_param(PARAM_FILENAME, path) != 0 ||
+            write_sysfs_param(PARAM_BENCH_RECORDS, "0 1") != 0) {
+            ret = -1;
+            break;
+        }
+
+        for (seen = false; !seen;) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout = BENCH_TIMEOUT_MS - (int)(elapsed_seconds(&start, &now) * 1000.0);
+            if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0) {
+                (*missed)++;
+                break;
+            }
+
+            n = read(pfd.fd, events, sizeof(events));
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            for (char *ptr = events; n > 0 && ptr < events + n; ptr += sizeof(*event) + event->len) {
+                event = (const struct inotify_event *)ptr;
+                if (event->len && strcmp(event->name, name) == 0)
+                    seen = true;
+            }
+        }
+
+        if (seen)
+            lat_ms[(*count)++] = elapsed_seconds(&start, &now) * 1000.0;
+    }
+
+    close(pfd.fd);
+    for (i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        unlink(path);
+    }
+    return ret;
+}
+
+/*
+ * Измеряет время от write_sysfs_param() до момента, когда изменение
+ * видно снаружи модуля. Исходные filename и timer_period восстанавливаются.
+ */
+static int bench_reconfig(unsigned int iterations)
+{
+    static double lat_ms[MAX_BENCH_ITERATIONS];
+    static double lat_long_ms[MAX_BENCH_ITERATIONS];
+    double *period_lat_ms[2] = { lat_ms, lat_long_ms };
+    unsigned int period_count[2] = { 0, 0 };
+    unsigned int period_missed[2] = { 0, 0 };
+    tm_stats_t stats = { .fd = -1 };
+    char old_filename[MAX_PARAM_VALUE_LEN];
+    char old_period[PERIOD_STR_BUF_SIZE];
+    char dir[MAX_PARAM_VALUE_LEN];
+    unsigned int count;
+    unsigned int missed;
+    int ret;
+
+    if (read_sysfs_param("filename", old_filename, sizeof(old_filename)) != 0 ||
+        read_sysfs_param("timer_period", old_period, sizeof(old_period)) != 0) {
+        return -1;
+    }
+
+    if (tm_stats_open(&stats) != 0) {
+        fprintf(stderr, "Failed to map %s: %s\n", TM_DEVICE_PATH, strerror(errno));
+        return -1;
+    }
+
+    printf("Measuring %u timer_period changes...\n", iterations);
+    fflush(stdout);
+    ret = bench_period(&stats, iterations, period_lat_ms, period_count, period_missed);
+    bench_report("shorten", lat_ms, period_count[0], period_missed[0]);
+    bench_report("lengthen", lat_long_ms, period_count[1], period_missed[1]);
+    tm_stats_close(&stats);
+
+    snprintf(dir, sizeof(dir), "%s", old_filename);
+    if (ret == 0) {
+        printf("Measuring %u filename changes in %s...\n", iterations, dirname(dir));
+        fflush(stdout);
+        count = 0;
+        missed = 0;
+        ret = bench_filename(dir, iterations, lat_ms, &count, &missed);
+        bench_report("filename", lat_ms, count, missed);
+    }
+
+    if (write_sysfs_param(PARAM_FILENAME, old_filename) != 0 ||
+        write_sysfs_param(PARAM_TIMER_PERIOD, old_period) != 0) {
+        fprintf(stderr, "Warning: Failed to restore filename=%s timer_period=%s\n",
+                old_filename, old_period);
+        ret = -1;
+    }
+
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
     module_params_t params;
+    static param_change_t targets[2];
+    unsigned int nr_targets = 0;
     int ret = 0;
 
     params_init(&params);
@@ -201,6 +1332,59 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "Error: -p requires a period value\n");
                 return 1;
             }
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) {
+            if (i + 1 < argc) {
+                params.config = argv[++i];
+            } else {
+                fprintf(stderr, "Error: -c requires a config file path or '-'\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--dry-run") == 0) {
+            params.dry_run = true;
+        } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--daemon") == 0) {
+            params.daemon = true;
+        } else if (strcmp(argv[i], "-V") == 0 || strcmp(argv[i], "--verify") == 0) {
+            params.verify = true;
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--json") == 0) {
+            params.json = true;
+        } else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--bench-reconfig") == 0) {
+            char *endptr;
+            long iterations;
+
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -b requires a number of iterations\n");
+                return 1;
+            }
+
+            errno = 0;
+            iterations = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || endptr == argv[i] || errno == ERANGE ||
+                iterations < 1 || iterations > MAX_BENCH_ITERATIONS) {
+                fprintf(stderr, "Error: Iterations must be between 1 and %d\n",
+                        MAX_BENCH_ITERATIONS);
+                return 1;
+            }
+            params.bench_iterations = (unsigned int)iterations;
+        } else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--watch") == 0) {
+            params.watch = true;
+        } else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--interval") == 0) {
+            char *endptr;
+            long interval;
+
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -i requires an interval in milliseconds\n");
+                return 1;
+            }
+
+            errno = 0;
+            interval = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || endptr == argv[i] || errno == ERANGE ||
+                interval < MIN_WATCH_INTERVAL_MS || interval > MAX_WATCH_INTERVAL_MS) {
+                fprintf(stderr, "Error: Interval must be between %d and %d ms\n",
+                        MIN_WATCH_INTERVAL_MS, MAX_WATCH_INTERVAL_MS);
+                return 1;
+            }
+            params.watch_interval_ms = (unsigned int)interval;
         } else {
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
             print_usage(argv[0]);
@@ -208,6 +1392,66 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (params.json && !params.verify) {
+        fprintf(stderr, "Error: --json requires --verify\n");
+        return 1;
+    }
+
+    if (params.verify && (params.daemon || params.watch || params.bench_iterations)) {
+        fprintf(stderr, "Error: --verify applies to -f/-p and --config\n");
+        return 1;
+    }
+
+    json_output = params.json;
+    msg_out = params.json ? stderr : stdout;
+
+    if (params.watch) {
+        if (params.filename || params.period > 0) {
+            fprintf(stderr, "Error: --watch cannot be combined with setting parameters\n");
+            return 1;
+        }
+        return watch_stats(params.watch_interval_ms) == 0 ? 0 : 1;
+    }
+
+    if (params.bench_iterations) {
+        if (params.filename || params.period > 0 || params.config) {
+            fprintf(stderr, "Error: --bench-reconfig cannot be combined with setting parameters\n");
+            return 1;
+        }
+        return bench_reconfig(params.bench_iterations) == 0 ? 0 : 1;
+    }
+
+    if (params.config) {
+        if (params.filename || params.period > 0) {
+            fprintf(stderr, "Error: --config cannot be combined with -f/-p\n");
+            return 1;
+        }
+        if (params.daemon) {
+            if (params.dry_run) {
+                fprintf(stderr, "Error: --daemon cannot be combined with --dry-run\n");
+                return 1;
+            }
+            return run_daemon(params.config) == 0 ? 0 : 1;
+        }
+        return apply_config(params.config, params.dry_run, -1, params.verify) == 0 ? 0 : 1;
+    }
+
+    if (params.dry_run || params.daemon) {
+        fprintf(stderr, "Error: --dry-run and --daemon require --config\n");
+        return 1;
+    }
+
+    if (params.verify) {
+        if (params.filename) {
+            strcpy(targets[nr_targets].name, "filename");
+            snprintf(targets[nr_targets++].desired, sizeof(targets[0].desired), "%s", params.filename);
+        }
+        if (params.period > 0) {
+            strcpy(targets[nr_targets].name, "timer_period");
+            snprintf(targets[nr_targets++].desired, sizeof(targets[0].desired), "%u", params.period);
+        }
+    }
+
     if (!params.filename && params.period == 0) {
         fprintf(stderr, "Error: At least one parameter (filename or period) must be specified\n");
         print_usage(argv[0]);
@@ -218,13 +1462,13 @@ int main(int argc, char *argv[])
         if (validate_filepath(params.filename) != 0) {
             return 1;
         }
-        printf("Setting filename parameter to: %s\n", params.filename);
+        fprintf(msg_out, "Setting filename parameter to: %s\n", params.filename);
         if (write_sysfs_param(PARAM_FILENAME, params.filename) != 0) {
             fprintf(stderr, "Failed to set filename parameter\n");
             ret = 1;
             goto cleanup;
         }
-        printf("Filename parameter set successfully\n");
+        fprintf(msg_out, "Filename parameter set successfully\n");
     }
 
     if (params.period > 0) {
@@ -236,15 +1480,19 @@ int main(int argc, char *argv[])
             goto cleanup;
         }
 
-        printf("Setting timer_period parameter to: %u seconds\n", params.period);
+        fprintf(msg_out, "Setting timer_period parameter to: %u seconds\n", params.period);
         if (write_sysfs_param(PARAM_TIMER_PERIOD, period_str) != 0) {
             fprintf(stderr, "Failed to set timer_period parameter\n");
             ret = 1;
             goto cleanup;
         }
-        printf("Timer period parameter set successfully\n");
+        fprintf(msg_out, "Timer period parameter set successfully\n");
     }
 
 cleanup:
+    /* Сверяем и после неудачной записи: отчет показывает, с чем модуль работает на самом деле */
+    if (params.verify && verify_params(targets, nr_targets, NULL) != 0) {
+        ret = 1;
+    }
     return ret;
 }
\ No newline at end of file
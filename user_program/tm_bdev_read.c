@@ -0,0 +1,383 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+#include "test_module_uapi.h"
+
+/*
+ * Читает кольцевой лог test_module с блочного устройства (параметр
+ * bdev_path): для каждой области выводит сегменты текущей разметки от
+ * самого старого к самому новому, с -f продолжает следить за областью.
+ * Модуль пишет bio в обход page cache, поэтому устройство читается с
+ * O_DIRECT.
+ */
+
+#define SYSFS_BDEV_PATH "/sys/module/test_module/parameters/bdev_path"
+#define DEFAULT_INTERVAL_MS 100
+
+typedef struct {
+    int fd;
+    struct tm_bdev_super super;
+    /* Буфер сегмента, выровненный для O_DIRECT */
+    char *segment;
+} bdev_log_t;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void print_usage(const char *prog_name)
+{
+    printf("Usage: %s [OPTIONS] [DEVICE]\n", prog_name);
+    printf("\nDEVICE defaults to the module's bdev_path parameter.\n");
+    printf("\nOptions:\n");
+    printf("  -r, --region N         Read only region N (writer N of the module)\n");
+    printf("  -f, --follow           Keep streaming new records of the region (needs -r)\n");
+    printf("  -i, --interval MS      Poll interval for --follow (default: %d)\n", DEFAULT_INTERVAL_MS);
+    printf("  -l, --list             Print the layout and segment ranges instead of data\n");
+}
+
+static int parse_uint(const char *str, unsigned int max, unsigned int *out)
+{
+    char *endptr;
+    unsigned long value;
+
+    errno = 0;
+    value = strtoul(str, &endptr, 10);
+    if (endptr == str || *endptr != '\0' || errno == ERANGE || value > max) {
+        fprintf(stderr, "Error: Invalid value %s\n", str);
+        return -1;
+    }
+
+    *out = (unsigned int)value;
+    return 0;
+}
+
+static int read_at(const bdev_log_t *log, void *buf, size_t len, uint64_t pos)
+{
+    ssize_t n;
+    size_t done = 0;
+
+    while (done < len) {
+        n = pread(log->fd, (char *)buf + done, len - done, (off_t)(pos + done));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        done += (size_t)n;
+    }
+
+    return 0;
+}
+
+static uint64_t segment_pos(const bdev_log_t *log, unsigned int region, uint64_t seq)
+{
+    return TM_BDEV_BLOCK +
+           ((uint64_t)region * log->super.segments_per_region +
+            (seq - 1) % log->super.segments_per_region) * log->super.segment_size;
+}
+
+/* Заголовок сегмента seq области; false, если там другой сегмент или чужая разметка */
+static bool read_header(const bdev_log_t *log, unsigned int region, uint64_t seq,
+                        struct tm_bdev_segment *header)
+{
+    if (read_at(log, log->segment, TM_BDEV_BLOCK, segment_pos(log, region, seq)) != 0)
+        return false;
+
+    memcpy(header, log->segment, sizeof(*header));
+    return header->magic == TM_BDEV_SEGMENT_MAGIC && header->region == region &&
+           header->seq == seq && header->format_ns == log->super.format_ns &&
+           header->used <= log->super.segment_size - TM_BDEV_BLOCK;
+}
+
+/* Самый новый сегмент области: заголовки всех позиций, максимальный seq */
+static uint64_t newest_seq(const bdev_log_t *log, unsigned int region)
+{
+    struct tm_bdev_segment header;
+    uint64_t newest = 0;
+    uint64_t index;
+    uint64_t pos;
+
+    for (index = 0; index < log->super.segments_per_region; index++) {
+        pos = segment_pos(log, region, index + 1);
+        if (read_at(log, log->segment, TM_BDEV_BLOCK, pos) != 0)
+            break;
+
+        memcpy(&header, log->segment, sizeof(header));
+        if (header.magic == TM_BDEV_SEGMENT_MAGIC && header.region == region &&
+            header.format_ns == log->super.format_ns && header.seq > newest &&
+            (header.seq - 1) % log->super.segments_per_region == index)
+            newest = header.seq;
+    }
+
+    return newest;
+}
+
+/*
+ * Выводит данные сегмента с from по used; возвращает новую позицию, from,
+ * если сегмент перезаписан во время чтения, или -1
+ */
+static int64_t emit_segment(const bdev_log_t *log, unsigned int region, uint64_t seq,
+                            const struct tm_bdev_segment *header, uint32_t from)
+{
+    uint32_t start = from & ~(uint32_t)(TM_BDEV_BLOCK - 1);
+    uint32_t end = (header->used + TM_BDEV_BLOCK - 1) & ~(uint32_t)(TM_BDEV_BLOCK - 1);
+    struct tm_bdev_segment check;
+
+    if (header->used <= from)
+        return from;
+
+    if (read_at(log, log->segment + TM_BDEV_BLOCK + start, end - start,
+                segment_pos(log, region, seq) + TM_BDEV_BLOCK + start) != 0) {
+        fprintf(stderr, "Failed to read segment %llu of region %u: %s\n",
+                (unsigned long long)seq, region, strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Writer заменяет заголовок сегмента раньше, чем пишет новые данные
+     * на его место: если заголовок после чтения другой, прочитанное могло
+     * уже принадлежать следующему кругу кольца
+     */
+    if (!read_header(log, region, seq, &check) || check.used < header->used) {
+        fprintf(stderr, "Segment %llu of region %u was overwritten while reading, skipped\n",
+                (unsigned long long)seq, region);
+        return from;
+    }
+
+    if (fwrite(log->segment + TM_BDEV_BLOCK + from, 1, header->used - from, stdout) !=
+        header->used - from)
+        return -1;
+
+    return header->used;
+}
+
+static int dump_region(const bdev_log_t *log, unsigned int region, bool list)
+{
+    struct tm_bdev_segment header;
+    uint64_t newest = newest_seq(log, region);
+    uint64_t oldest;
+    uint64_t seq;
+
+    if (newest == 0) {
+        if (list)
+            printf("region %u: empty\n", region);
+        return 0;
+    }
+
+    oldest = newest > log->super.segments_per_region ? newest - log->super.segments_per_region + 1 : 1;
+    if (list) {
+        printf("region %u: segments %llu-%llu\n", region,
+               (unsigned long long)oldest, (unsigned long long)newest);
+        return 0;
+    }
+
+    for (seq = oldest; seq <= newest && !stop; seq++) {
+        /* Самый старый сегмент мог быть перезаписан, пока мы читали */
+        if (!read_header(log, region, seq, &header))
+            continue;
+        if (emit_segment(log, region, seq, &header, 0) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Следит за текущим сегментом области: выводит дописанные байты, а
+ * когда появляется следующий сегмент - дочитывает текущий и переходит.
+ * Если writer обогнал читателя на все кольцо, читатель перескакивает к
+ * самому новому сегменту.
+ */
+static int follow_region(const bdev_log_t *log, unsigned int region, unsigned int interval_ms)
+{
+    struct timespec interval = { interval_ms / 1000, (long)(interval_ms % 1000) * 1000000L };
+    struct tm_bdev_segment header;
+    struct tm_bdev_segment next;
+    uint64_t seq = newest_seq(log, region);
+    int64_t pos = 0;
+
+    if (seq == 0)
+        seq = 1;
+
+    while (!stop) {
+        if (read_header(log, region, seq, &header)) {
+            pos = emit_segment(log, region, seq, &header, (uint32_t)pos);
+            if (pos < 0)
+                return -1;
+            fflush(stdout);
+        }
+
+        if (read_header(log, region, seq + 1, &next)) {
+            /* Последний сброс в текущий сегмент записан раньше заголовка следующего */
+            if (read_header(log, region, seq, &header) &&
+                emit_segment(log, region, seq, &header, (uint32_t)pos) < 0)
+                return -1;
+            seq++;
+            pos = 0;
+            continue;
+        }
+
+        if (!read_header(log, region, seq, &header) && newest_seq(log, region) > seq) {
+            fprintf(stderr, "Region %u: reader overrun at segment %llu, skipping ahead\n",
+                    region, (unsigned long long)seq);
+            seq = newest_seq(log, region);
+            pos = 0;
+            continue;
+        }
+
+        nanosleep(&interval, NULL);
+    }
+
+    return 0;
+}
+
+static int default_device(char *path, size_t size)
+{
+    FILE *file = fopen(SYSFS_BDEV_PATH, "r");
+
+    if (!file)
+        return -1;
+
+    if (!fgets(path, (int)size, file)) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    path[strcspn(path, "\n")] = '\0';
+    return strcmp(path, "(null)") == 0 || path[0] == '\0' ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bdev_log_t log = { .fd = -1 };
+    char device[PATH_MAX];
+    const char *path = NULL;
+    unsigned int region = 0;
+    unsigned int interval_ms = DEFAULT_INTERVAL_MS;
+    bool one_region = false;
+    bool follow = false;
+    bool list = false;
+    struct sigaction sa;
+    unsigned int i;
+    int ret = 0;
+
+    for (int a = 1; a < argc; a++) {
+        if ((strcmp(argv[a], "-r") == 0 || strcmp(argv[a], "--region") == 0) && a + 1 < argc) {
+            if (parse_uint(argv[++a], UINT32_MAX, &region) != 0)
+                return 1;
+            one_region = true;
+        } else if (strcmp(argv[a], "-f") == 0 || strcmp(argv[a], "--follow") == 0) {
+            follow = true;
+        } else if ((strcmp(argv[a], "-i") == 0 || strcmp(argv[a], "--interval") == 0) && a + 1 < argc) {
+            if (parse_uint(argv[++a], 60000, &interval_ms) != 0 || interval_ms == 0)
+                return 1;
+        } else if (strcmp(argv[a], "-l") == 0 || strcmp(argv[a], "--list") == 0) {
+            list = true;
+        } else if (argv[a][0] != '-' && !path) {
+            path = argv[a];
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[a]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (follow && (!one_region || list)) {
+        fprintf(stderr, "Error: --follow needs a single region (-r N) and no --list\n");
+        return 1;
+    }
+
+    if (!path) {
+        if (default_device(device, sizeof(device)) != 0) {
+            fprintf(stderr, "Error: No DEVICE given and test_module has no bdev_path\n");
+            return 1;
+        }
+        path = device;
+    }
+
+    log.fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (log.fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if (posix_memalign((void **)&log.segment, TM_BDEV_BLOCK, TM_BDEV_BLOCK) != 0 ||
+        read_at(&log, log.segment, TM_BDEV_BLOCK, 0) != 0) {
+        fprintf(stderr, "Failed to read the superblock of %s: %s\n", path, strerror(errno));
+        ret = 1;
+        goto out;
+    }
+
+    memcpy(&log.super, log.segment, sizeof(log.super));
+    if (log.super.magic != TM_BDEV_MAGIC || log.super.version != TM_BDEV_VERSION ||
+        log.super.block_size != TM_BDEV_BLOCK || log.super.segments_per_region == 0 ||
+        log.super.segment_size <= TM_BDEV_BLOCK || log.super.segment_size % TM_BDEV_BLOCK) {
+        fprintf(stderr, "Error: %s is not a test_module log\n", path);
+        ret = 1;
+        goto out;
+    }
+
+    if (one_region && region >= log.super.nr_regions) {
+        fprintf(stderr, "Error: %s has %u regions\n", path, log.super.nr_regions);
+        ret = 1;
+        goto out;
+    }
+
+    free(log.segment);
+    if (posix_memalign((void **)&log.segment, TM_BDEV_BLOCK, (size_t)log.super.segment_size) != 0) {
+        log.segment = NULL;
+        fprintf(stderr, "Failed to allocate a segment buffer\n");
+        ret = 1;
+        goto out;
+    }
+
+    if (list) {
+        printf("%s: %u regions, %llu segments of %llu KiB each\n", path, log.super.nr_regions,
+               (unsigned long long)log.super.segments_per_region,
+               (unsigned long long)log.super.segment_size / 1024);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (follow) {
+        ret = follow_region(&log, region, interval_ms) == 0 ? 0 : 1;
+        goto out;
+    }
+
+    for (i = one_region ? region : 0; i < (one_region ? region + 1 : log.super.nr_regions); i++) {
+        if (dump_region(&log, i, list) != 0) {
+            ret = 1;
+            break;
+        }
+    }
+
+out:
+    free(log.segment);
+    close(log.fd);
+    return ret;
+}
@@ -0,0 +1,397 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "tm_stats.h"
+
+/*
+ * Экспорт статистики test_module в формате Prometheus. Метрики читаются
+ * из отображенных страниц /dev/test_module - без системных вызовов на
+ * поле - и либо атомарно (rename) записываются в файл textfile
+ * collector'а node_exporter, либо отдаются по HTTP через UNIX-сокет.
+ */
+
+#define DEFAULT_INTERVAL 15
+/* Клиент, который не шлет запрос или не читает ответ, не блокирует сервер дольше */
+#define CLIENT_TIMEOUT_SEC 5
+
+static volatile sig_atomic_t stop_requested;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void print_usage(const char *prog_name)
+{
+    printf("Usage: %s (-t FILE | -u SOCKET) [-i SECONDS]\n", prog_name);
+    printf("\nOptions:\n");
+    printf("  -t, --textfile FILE    Write metrics to FILE for node_exporter textfile collector\n");
+    printf("  -u, --socket PATH      Serve metrics over HTTP on a UNIX socket\n");
+    printf("  -i, --interval SECONDS Textfile update interval (default: %d)\n", DEFAULT_INTERVAL);
+    printf("\nExamples:\n");
+    printf("  %s -t /var/lib/node_exporter/textfile/test_module.prom\n", prog_name);
+    printf("  %s -u /run/test_module.sock\n", prog_name);
+    printf("  curl --unix-socket /run/test_module.sock http://localhost/metrics\n");
+}
+
+static void metric_header(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP test_module_%s %s\n# TYPE test_module_%s %s\n", name, help, name, type);
+}
+
+/* Снимок всех потоков, из которого формируется один ответ */
+typedef struct {
+    unsigned int nr_streams;
+    int valid[TM_STATS_MAX_STREAMS];
+    struct tm_stats_stream streams[TM_STATS_MAX_STREAMS];
+    int hb_valid[TM_STATS_MAX_STREAMS];
+    struct tm_heartbeat_stream heartbeat[TM_STATS_MAX_STREAMS];
+    unsigned long long now_ns;
+} snapshot_t;
+
+static void take_snapshot(const tm_stats_t *stats, snapshot_t *snap)
+{
+    struct timespec now;
+    unsigned int i;
+
+    snap->nr_streams = tm_stats_nr_streams(stats);
+    for (i = 0; i < snap->nr_streams; i++) {
+        snap->valid[i] = tm_stats_read_stream(stats, i, &snap->streams[i]) == 0;
+        snap->hb_valid[i] = tm_heartbeat_read(stats, i, &snap->heartbeat[i]) == 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    snap->now_ns = (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+static void counter(FILE *out, const char *name, const char *help, const snapshot_t *snap,
+                    size_t offset)
+{
+    unsigned int i;
+
+    metric_header(out, name, "counter", help);
+    for (i = 0; i < snap->nr_streams; i++) {
+        if (!snap->valid[i])
+            continue;
+        fprintf(out, "test_module_%s{stream=\"%u\"} %llu\n", name, i,
+                (unsigned long long)*(const __u64 *)((const char *)&snap->streams[i] + offset));
+    }
+}
+
+static void format_metrics(FILE *out, const snapshot_t *snap)
+{
+    const struct tm_stats_stream *s;
+    unsigned long long cumulative;
+    unsigned int i;
+    int b;
+
+    counter(out, "heartbeat_ticks_total", "Heartbeat records produced.", snap,
+            offsetof(struct tm_stats_stream, write_counter));
+    counter(out, "records_accepted_total", "Records accepted by the rate limiter.", snap,
+            offsetof(struct tm_stats_stream, accepted));
+    counter(out, "records_dropped_total", "Records dropped by the rate limiter.", snap,
+            offsetof(struct tm_stats_stream, dropped));
+    counter(out, "records_overflow_total", "Records dropped because buffers or memory budget were full.",
+            snap, offsetof(struct tm_stats_stream, overflow));
+    counter(out, "records_written_total", "Records handed to the log file.", snap,
+            offsetof(struct tm_stats_stream, last_seq));
+    counter(out, "bytes_written_total", "Bytes written to the log file.", snap,
+            offsetof(struct tm_stats_stream, bytes_written));
+    counter(out, "write_errors_total", "Failed or partial writes.", snap,
+            offsetof(struct tm_stats_stream, write_errors));
+    counter(out, "flushes_total", "Batches written to the log file.", snap,
+            offsetof(struct tm_stats_stream, flushes));
+
+    metric_header(out, "backlog_bytes", "gauge", "Data waiting for the writer.");
+    for (i = 0; i < snap->nr_streams; i++) {
+        if (snap->valid[i])
+            fprintf(out, "test_module_backlog_bytes{stream=\"%u\"} %llu\n", i,
+                    (unsigned long long)snap->streams[i].backlog_bytes);
+    }
+
+    metric_header(out, "last_write_timestamp_seconds", "gauge", "Time of the last write to the log file.");
+    for (i = 0; i < snap->nr_streams; i++) {
+        if (snap->valid[i])
+            fprintf(out, "test_module_last_write_timestamp_seconds{stream=\"%u\"} %.3f\n", i,
+                    snap->streams[i].last_write_ns / 1e9);
+    }
+
+    metric_header(out, "write_latency_seconds", "histogram", "Latency of writes to the log file.");
+    for (i = 0; i < snap->nr_streams; i++) {
+        if (!snap->valid[i])
+            continue;
+
+        s = &snap->streams[i];
+        cumulative = 0;
+        for (b = 0; b < TM_LAT_BUCKETS - 1; b++) {
+            cumulative += s->lat_hist[b];
+            fprintf(out, "test_module_write_latency_seconds_bucket{stream=\"%u\",le=\"%g\"} %llu\n",
+                    i, (double)(1ULL << b) / 1e6, cumulative);
+        }
+        cumulative += s->lat_hist[TM_LAT_BUCKETS - 1];
+        fprintf(out, "test_module_write_latency_seconds_bucket{stream=\"%u\",le=\"+Inf\"} %llu\n",
+                i, cumulative);
+        fprintf(out, "test_module_write_latency_seconds_sum{stream=\"%u\"} %.9f\n",
+                i, s->lat_sum_ns / 1e9);
+        fprintf(out, "test_module_write_latency_seconds_count{stream=\"%u\"} %llu\n", i, cumulative);
+    }
+
+    metric_header(out, "heartbeat_age_seconds", "gauge", "Time since the last heartbeat tick.");
+    for (i = 0; i < snap->nr_streams; i++) {
+        if (snap->hb_valid[i] && snap->heartbeat[i].mono_ns)
+            fprintf(out, "test_module_heartbeat_age_seconds{stream=\"%u\"} %.3f\n", i,
+                    (snap->now_ns - snap->heartbeat[i].mono_ns) / 1e9);
+    }
+}
+
+/* Формирует метрики в памяти, чтобы запись в файл/сокет была одним вызовом */
+static char *render_metrics(const tm_stats_t *stats, size_t *len)
+{
+    snapshot_t snap;
+    char *buf = NULL;
+    FILE *out;
+
+    take_snapshot(stats, &snap);
+
+    out = open_memstream(&buf, len);
+    if (!out) {
+        return NULL;
+    }
+
+    format_metrics(out, &snap);
+
+    if (fclose(out) != 0) {
+        free(buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+
+    return 0;
+}
+
+/* Пишет во временный файл рядом и переименовывает: collector не видит частичных данных */
+static int write_textfile(const char *path, const tm_stats_t *stats)
+{
+    char tmp[PATH_MAX];
+    char *buf;
+    size_t len;
+    int fd;
+    int ret = -1;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "Error: Path too long: %s\n", path);
+        return -1;
+    }
+
+    buf = render_metrics(stats, &len);
+    if (!buf) {
+        fprintf(stderr, "Failed to format metrics: %s\n", strerror(errno));
+        return -1;
+    }
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", tmp, strerror(errno));
+        free(buf);
+        return -1;
+    }
+
+    if (write_all(fd, buf, len) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        goto out;
+    }
+
+    if (close(fd) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "Failed to publish %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        goto out;
+    }
+
+    ret = 0;
+out:
+    free(buf);
+    return ret;
+}
+
+static int run_textfile(const char *path, unsigned int interval, const tm_stats_t *stats)
+{
+    struct timespec ts = { .tv_sec = interval, .tv_nsec = 0 };
+
+    while (!stop_requested) {
+        write_textfile(path, stats);
+        nanosleep(&ts, NULL);
+    }
+
+    return 0;
+}
+
+static void serve_client(int client, const tm_stats_t *stats)
+{
+    static const char header[] =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Connection: close\r\n\r\n";
+    struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT_SEC };
+    char request[1024];
+    char *buf;
+    size_t len;
+
+    /* Клиенты обслуживаются по одному: зависший не должен остановить экспорт */
+    if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
+        fprintf(stderr, "Failed to set client timeout: %s\n", strerror(errno));
+        return;
+    }
+
+    /* Запрос не разбираем: любой GET получает метрики */
+    if (read(client, request, sizeof(request)) < 0) {
+        return;
+    }
+
+    buf = render_metrics(stats, &len);
+    if (!buf) {
+        return;
+    }
+
+    if (write_all(client, header, sizeof(header) - 1) == 0) {
+        write_all(client, buf, len);
+    }
+    free(buf);
+}
+
+static int run_socket(const char *path, const tm_stats_t *stats)
+{
+    struct sockaddr_un addr;
+    int server;
+    int client;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server, 8) != 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        close(server);
+        return -1;
+    }
+
+    while (!stop_requested) {
+        client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to accept connection: %s\n", strerror(errno));
+            break;
+        }
+
+        serve_client(client, stats);
+        close(client);
+    }
+
+    close(server);
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    tm_stats_t stats = { .fd = -1 };
+    const char *textfile = NULL;
+    const char *socket_path = NULL;
+    unsigned int interval = DEFAULT_INTERVAL;
+    struct sigaction sa;
+    char *endptr;
+    int ret;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--textfile") == 0) && i + 1 < argc) {
+            textfile = argv[++i];
+        } else if ((strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--socket") == 0) && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if ((strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--interval") == 0) && i + 1 < argc) {
+            unsigned long value = strtoul(argv[++i], &endptr, 10);
+
+            if (*endptr != '\0' || value < 1 || value > 3600) {
+                fprintf(stderr, "Error: Interval must be between 1 and 3600 seconds\n");
+                return 1;
+            }
+            interval = (unsigned int)value;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!textfile == !socket_path) {
+        fprintf(stderr, "Error: Exactly one of --textfile or --socket must be specified\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (tm_stats_open(&stats) != 0) {
+        fprintf(stderr, "Failed to map %s: %s\n", TM_DEVICE_PATH, strerror(errno));
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (textfile)
+        ret = run_textfile(textfile, interval, &stats);
+    else
+        ret = run_socket(socket_path, &stats);
+
+    tm_stats_close(&stats);
+    return ret == 0 ? 0 : 1;
+}
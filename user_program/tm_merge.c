@@ -0,0 +1,314 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+/*
+ * Сливает шарды потока test_module (nr_shards > 1) в один поток в
+ * глобальном порядке. Каждая запись шарда начинается с заголовка
+ * "<seq> <realtime ns> " (hex, 16 цифр), seq общий для всех шардов потока.
+ * Модуль берет seq и место в буфере шарда двумя отдельными атомарными
+ * операциями, поэтому внутри шарда seq возрастает лишь почти: запись из
+ * прерывания или с другого CPU может лечь раньше записи с меньшим seq.
+ * Поэтому каждый шард читается через окно из window записей,
+ * упорядоченное по seq, и на каждом шаге выводится запись с наименьшим
+ * seq среди окон. Записи, опоздавшие больше чем на окно, выводятся как
+ * есть и подсчитываются.
+ */
+
+#define SYSFS_BASE "/sys/module/test_module/parameters"
+#define MAX_SHARDS 8
+#define SHARD_HDR_LEN 34
+#define DEFAULT_WINDOW 256
+#define MAX_WINDOW 65536
+
+/* Запись: строка с заголовком и строки продолжения без него */
+typedef struct {
+    unsigned long long seq;
+    char *text;
+    size_t len;
+} record_t;
+
+typedef struct {
+    const char *path;
+    FILE *file;
+    /* Следующая прочитанная строка, еще не попавшая в запись */
+    char *line;
+    size_t cap;
+    ssize_t len;
+    /* seq последнего заголовка; строки без заголовка наследуют его */
+    unsigned long long seq;
+    /* Окно, отсортированное по seq */
+    record_t *window;
+    unsigned int nr;
+} shard_t;
+
+static void print_usage(const char *prog_name)
+{
+    printf("Usage: %s [OPTIONS] [FILE...]\n", prog_name);
+    printf("\nMerges shard files by record sequence number and writes the result to stdout.\n");
+    printf("Without FILE arguments the shards of the module's stream are used.\n");
+    printf("\nOptions:\n");
+    printf("  -s, --stream N         Stream whose shards to merge (default: 0)\n");
+    printf("  -H, --strip-header     Drop the \"<seq> <timestamp> \" header from each record\n");
+    printf("  -w, --window N         Records per shard reordered by seq (default: %d)\n", DEFAULT_WINDOW);
+}
+
+static int read_param(const char *name, char *value, size_t size)
+{
+    char path[PATH_MAX];
+    FILE *file;
+
+    snprintf(path, sizeof(path), SYSFS_BASE "/%s", name);
+    file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (!fgets(value, (int)size, file)) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    value[strcspn(value, "\n")] = '\0';
+    return 0;
+}
+
+/* Пути шардов так же, как их строит модуль */
+static int module_shards(unsigned int stream, char paths[][PATH_MAX], unsigned int *count)
+{
+    char filename[PATH_MAX];
+    char value[32];
+    char base[PATH_MAX];
+    unsigned long shards;
+    unsigned int i;
+
+    if (read_param("filename", filename, sizeof(filename)) != 0 ||
+        read_param("nr_shards", value, sizeof(value)) != 0) {
+        return -1;
+    }
+
+    shards = strtoul(value, NULL, 10);
+    if (shards < 1 || shards > MAX_SHARDS) {
+        fprintf(stderr, "Error: Unexpected nr_shards %s\n", value);
+        return -1;
+    }
+
+    if (stream == 0)
+        snprintf(base, sizeof(base), "%s", filename);
+    else if (snprintf(base, sizeof(base), "%s.%u", filename, stream) >= (int)sizeof(base))
+        return -1;
+
+    snprintf(paths[0], PATH_MAX, "%s", base);
+    for (i = 1; i < shards; i++) {
+        if (snprintf(paths[i], PATH_MAX, "%s.shard%u", base, i) >= PATH_MAX)
+            return -1;
+    }
+
+    *count = (unsigned int)shards;
+    return 0;
+}
+
+static bool parse_header(const char *line, ssize_t len, unsigned long long *seq)
+{
+    int i;
+
+    if (len < SHARD_HDR_LEN || line[16] != ' ' || line[33] != ' ')
+        return false;
+
+    for (i = 0; i < 33; i++) {
+        if (i != 16 && !isxdigit((unsigned char)line[i]))
+            return false;
+    }
+
+    *seq = strtoull(line, NULL, 16);
+    return true;
+}
+
+static void shard_next(shard_t *shard)
+{
+    shard->len = getline(&shard->line, &shard->cap, shard->file);
+}
+
+/* Читает следующую запись шарда целиком; false - конец файла */
+static bool shard_read_record(shard_t *shard, record_t *record)
+{
+    unsigned long long seq;
+    char *text;
+
+    if (shard->len <= 0)
+        return false;
+
+    parse_header(shard->line, shard->len, &shard->seq);
+    record->seq = shard->seq;
+    record->len = 0;
+    record->text = NULL;
+
+    do {
+        text = realloc(record->text, record->len + (size_t)shard->len);
+        if (!text) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+        record->text = text;
+        memcpy(record->text + record->len, shard->line, (size_t)shard->len);
+        record->len += (size_t)shard->len;
+        shard_next(shard);
+    } while (shard->len > 0 && !parse_header(shard->line, shard->len, &seq));
+
+    return true;
+}
+
+/* Дополняет окно шарда до window записей */
+static void shard_fill(shard_t *shard, unsigned int window)
+{
+    record_t record;
+    unsigned int pos;
+
+    while (shard->nr < window && shard_read_record(shard, &record)) {
+        /* Записи почти упорядочены, место обычно в самом конце */
+        pos = shard->nr;
+        while (pos > 0 && shard->window[pos - 1].seq > record.seq)
+            pos--;
+        memmove(&shard->window[pos + 1], &shard->window[pos],
+                (shard->nr - pos) * sizeof(record));
+        shard->window[pos] = record;
+        shard->nr++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static char module_paths[MAX_SHARDS][PATH_MAX];
+    shard_t shards[MAX_SHARDS];
+    unsigned int nr_shards = 0;
+    unsigned long stream = 0;
+    unsigned long window = DEFAULT_WINDOW;
+    bool strip = false;
+    shard_t *min;
+    record_t record;
+    unsigned int i;
+    unsigned long long seq;
+    unsigned long long last_seq = 0;
+    unsigned long long late = 0;
+    bool emitted = false;
+    int ret = 0;
+
+    memset(shards, 0, sizeof(shards));
+
+    for (int a = 1; a < argc; a++) {
+        if ((strcmp(argv[a], "-s") == 0 || strcmp(argv[a], "--stream") == 0) && a + 1 < argc) {
+            char *endptr;
+
+            stream = strtoul(argv[++a], &endptr, 10);
+            if (*endptr != '\0' || stream >= MAX_SHARDS) {
+                fprintf(stderr, "Error: Invalid stream %s\n", argv[a]);
+                return 1;
+            }
+        } else if ((strcmp(argv[a], "-w") == 0 || strcmp(argv[a], "--window") == 0) && a + 1 < argc) {
+            char *endptr;
+
+            window = strtoul(argv[++a], &endptr, 10);
+            if (*endptr != '\0' || window < 1 || window > MAX_WINDOW) {
+                fprintf(stderr, "Error: Invalid window %s (1-%d)\n", argv[a], MAX_WINDOW);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "-H") == 0 || strcmp(argv[a], "--strip-header") == 0) {
+            strip = true;
+        } else if (strcmp(argv[a], "-h") == 0 || strcmp(argv[a], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (argv[a][0] == '-' && argv[a][1] != '\0') {
+            fprintf(stderr, "Unknown option: %s\n", argv[a]);
+            print_usage(argv[0]);
+            return 1;
+        } else if (nr_shards >= MAX_SHARDS) {
+            fprintf(stderr, "Error: At most %d files can be merged\n", MAX_SHARDS);
+            return 1;
+        } else {
+            shards[nr_shards++].path = argv[a];
+        }
+    }
+
+    if (nr_shards == 0) {
+        if (module_shards((unsigned int)stream, module_paths, &nr_shards) != 0)
+            return 1;
+        for (i = 0; i < nr_shards; i++)
+            shards[i].path = module_paths[i];
+    }
+
+    for (i = 0; i < nr_shards; i++) {
+        shards[i].window = calloc(window, sizeof(record_t));
+        if (!shards[i].window) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return 1;
+        }
+
+        shards[i].file = fopen(shards[i].path, "r");
+        if (!shards[i].file) {
+            /* Шард, в который еще ничего не писали, может отсутствовать */
+            if (errno != ENOENT) {
+                fprintf(stderr, "Failed to open %s: %s\n", shards[i].path, strerror(errno));
+                ret = 1;
+            }
+            shards[i].len = -1;
+            continue;
+        }
+        shard_next(&shards[i]);
+        shard_fill(&shards[i], (unsigned int)window);
+    }
+
+    for (;;) {
+        min = NULL;
+        for (i = 0; i < nr_shards; i++) {
+            if (shards[i].nr && (!min || shards[i].window[0].seq < min->window[0].seq))
+                min = &shards[i];
+        }
+        if (!min)
+            break;
+
+        record = min->window[0];
+        memmove(&min->window[0], &min->window[1], (min->nr - 1) * sizeof(record));
+        min->nr--;
+
+        if (emitted && record.seq < last_seq)
+            late++;
+        else
+            last_seq = record.seq;
+        emitted = true;
+
+        if (strip && parse_header(record.text, (ssize_t)record.len, &seq))
+            fwrite(record.text + SHARD_HDR_LEN, 1, record.len - SHARD_HDR_LEN, stdout);
+        else
+            fwrite(record.text, 1, record.len, stdout);
+        free(record.text);
+
+        shard_fill(min, (unsigned int)window);
+    }
+
+    if (late) {
+        fprintf(stderr, "Warning: %llu record(s) were out of order by more than %lu records, "
+                "try a larger --window\n", late, window);
+    }
+
+    for (i = 0; i < nr_shards; i++) {
+        if (shards[i].file)
+            fclose(shards[i].file);
+        free(shards[i].line);
+        free(shards[i].window);
+    }
+
+    if (fflush(stdout) != 0) {
+        fprintf(stderr, "Failed to write output: %s\n", strerror(errno));
+        ret = 1;
+    }
+    return ret;
+}
@@ -0,0 +1,153 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+
+#include "test_module_uapi.h"
+
+/*
+ * Читатель кольца записей test_module (параметр reader_ring_kb): выводит
+ * новые записи в stdout и подтверждает их модулю только после того, как
+ * они записаны, поэтому медленный потребитель stdout задерживает
+ * освобождение кольца. Если модуль отключил читателя за отставание,
+ * программа сообщает, на сколько байт он отстал, и завершается с кодом 2.
+ * Открытый TM_LOG_DEVICE_PATH не дает выгрузить модуль (rmmod - EBUSY).
+ */
+
+#define READ_BYTES (64 * 1024)
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void print_usage(const char *prog_name)
+{
+    printf("Usage: %s [OPTIONS]\n", prog_name);
+    printf("\nOptions:\n");
+    printf("  -n, --no-ack           Let the module acknowledge records as soon as they are read\n");
+    printf("  -s, --status           Print this reader's position and lag to stderr after each read\n");
+}
+
+static int reader_status(int fd, struct tm_reader_status *status)
+{
+    if (ioctl(fd, TM_IOC_READER_STATUS, status) != 0) {
+        fprintf(stderr, "TM_IOC_READER_STATUS failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void report_detached(int fd)
+{
+    struct tm_reader_status status;
+
+    if (reader_status(fd, &status) == 0) {
+        fprintf(stderr, "Reader %u was detached by the module: it lagged by %llu bytes\n",
+                status.id, (unsigned long long)status.lag);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static char buf[READ_BYTES];
+    struct tm_reader_status status;
+    struct sigaction sa;
+    bool manual_ack = true;
+    bool show_status = false;
+    uint64_t pos;
+    ssize_t n;
+    int ret = 0;
+    int fd;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--no-ack") == 0) {
+            manual_ack = false;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--status") == 0) {
+            show_status = true;
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    fd = open(TM_LOG_DEVICE_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", TM_LOG_DEVICE_PATH, strerror(errno));
+        if (errno == ENOENT || errno == ENODEV) {
+            fprintf(stderr, "Is test_module loaded with reader_ring_kb=N?\n");
+        }
+        return 1;
+    }
+
+    if (reader_status(fd, &status) != 0) {
+        close(fd);
+        return 1;
+    }
+    pos = status.pos;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stop) {
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EPIPE) {
+                report_detached(fd);
+                ret = 2;
+            } else {
+                fprintf(stderr, "Failed to read %s: %s\n", TM_LOG_DEVICE_PATH, strerror(errno));
+                ret = 1;
+            }
+            break;
+        }
+
+        if (fwrite(buf, 1, (size_t)n, stdout) != (size_t)n || fflush(stdout) != 0) {
+            ret = errno == EPIPE ? 0 : 1;
+            break;
+        }
+        pos += (uint64_t)n;
+
+        /* Записанное в stdout можно перезаписывать в кольце */
+        if (manual_ack && ioctl(fd, TM_IOC_READER_ACK, &pos) != 0) {
+            if (errno == EPIPE) {
+                report_detached(fd);
+                ret = 2;
+            } else {
+                fprintf(stderr, "TM_IOC_READER_ACK failed: %s\n", strerror(errno));
+                ret = 1;
+            }
+            break;
+        }
+
+        if (show_status && reader_status(fd, &status) == 0) {
+            fprintf(stderr, "reader %u: pos=%llu acked=%llu lag=%llu\n", status.id,
+                    (unsigned long long)status.pos, (unsigned long long)status.acked,
+                    (unsigned long long)status.lag);
+        }
+    }
+
+    close(fd);
+    return ret;
+}
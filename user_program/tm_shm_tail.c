@@ -0,0 +1,318 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "test_module_uapi.h"
+
+/*
+ * Читает лог test_module из разделяемой памяти (параметр shm_kb): fd
+ * shmem-файла выдает ioctl TM_IOC_SHM_FD, файл отображается только для
+ * чтения, и данные копируются прямо из колец областей по протоколу из
+ * test_module_uapi.h. Между сбросами программа спит в poll() на
+ * /dev/test_module. Если читатель отстал больше чем на размер кольца,
+ * потерянные байты сообщаются в stderr, а вывод продолжается со
+ * следующей целой строки. Пока программа работает, она держит
+ * /dev/test_module открытым, и rmmod test_module завершается с EBUSY.
+ */
+
+#define WAKEUP_MS 1000
+
+typedef struct {
+    uint64_t cursor;
+    /* После потери данных пропускаем остаток оборванной записи */
+    bool resync;
+    uint64_t lost;
+} reader_t;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void print_usage(const char *prog_name)
+{
+    printf("Usage: %s [OPTIONS]\n", prog_name);
+    printf("\nOptions:\n");
+    printf("  -r, --region N         Read only region N (writer N of the module)\n");
+    printf("  -a, --all              Start from the oldest data still in the ring\n");
+    printf("  -1, --once             Print what is in the ring now and exit\n");
+}
+
+static int parse_uint(const char *str, unsigned int max, unsigned int *out)
+{
+    char *endptr;
+    unsigned long value;
+
+    errno = 0;
+    value = strtoul(str, &endptr, 10);
+    if (endptr == str || *endptr != '\0' || errno == ERANGE || value > max) {
+        fprintf(stderr, "Error: Invalid value %s\n", str);
+        return -1;
+    }
+
+    *out = (unsigned int)value;
+    return 0;
+}
+
+static bool check_header(const struct tm_shm_header *hdr, off_t file_size)
+{
+    unsigned int i;
+
+    if (hdr->magic != TM_SHM_MAGIC || hdr->version != TM_SHM_VERSION ||
+        hdr->nr_regions == 0 || hdr->nr_regions > TM_STATS_MAX_STREAMS) {
+        return false;
+    }
+
+    for (i = 0; i < hdr->nr_regions; i++) {
+        const struct tm_shm_region *region = &hdr->regions[i];
+
+        if (region->size == 0 || region->data_offset > (uint64_t)file_size ||
+            region->size > (uint64_t)file_size - region->data_offset) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Копирует [from, to) из кольца области, to - from <= size */
+static void ring_copy(const char *base, const struct tm_shm_region *region,
+                      uint64_t from, uint64_t to, char *out)
+{
+    const char *data = base + region->data_offset;
+    uint64_t off = from % region->size;
+    size_t len = (size_t)(to - from);
+    size_t n = len < region->size - off ? len : (size_t)(region->size - off);
+
+    memcpy(out, data + off, n);
+    memcpy(out + n, data, len - n);
+}
+
+/* Выводит все, что появилось в области после курсора */
+static int drain(const char *base, unsigned int idx, reader_t *reader, char *copy)
+{
+    const struct tm_shm_region *region = &((const struct tm_shm_header *)base)->regions[idx];
+    uint64_t size = region->size;
+    uint64_t head;
+    uint64_t reserved;
+    uint64_t from = reader->cursor;
+    size_t skip = 0;
+    size_t len;
+
+    head = __atomic_load_n(&region->head, __ATOMIC_ACQUIRE);
+    if (head == from)
+        return 0;
+
+    if (head - from > size) {
+        reader->lost += head - size - from;
+        reader->resync = true;
+        from = head - size;
+    }
+
+    ring_copy(base, region, from, head, copy);
+
+    /* Все, что writer зарезервировал после начала копии, могло ее испортить */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    reserved = __atomic_load_n(&region->reserved, __ATOMIC_RELAXED);
+    len = (size_t)(head - from);
+    if (reserved - from > size) {
+        uint64_t overwritten = reserved - size - from;
+
+        skip = overwritten < len ? (size_t)overwritten : len;
+        reader->lost += overwritten;
+        reader->resync = true;
+    }
+    reader->cursor = head;
+
+    if (reader->lost) {
+        fprintf(stderr, "region %u: %llu bytes overwritten before they were read\n",
+                idx, (unsigned long long)reader->lost);
+        reader->lost = 0;
+    }
+
+    if (reader->resync) {
+        char *nl = memchr(copy + skip, '\n', len - skip);
+
+        if (!nl)
+            return 0;
+        skip = (size_t)(nl - copy) + 1;
+        reader->resync = false;
+    }
+
+    if (skip < len && fwrite(copy + skip, 1, len - skip, stdout) != len - skip)
+        return -1;
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    reader_t readers[TM_STATS_MAX_STREAMS];
+    const struct tm_shm_header *hdr;
+    unsigned int region = UINT32_MAX;
+    unsigned int first;
+    unsigned int last;
+    bool from_start = false;
+    bool once = false;
+    struct sigaction sa;
+    struct pollfd pfd;
+    struct stat st;
+    uint64_t max_size = 0;
+    uint64_t gen;
+    char *base;
+    char *copy;
+    unsigned int i;
+    int shm_fd;
+    int ret = 0;
+
+    for (int a = 1; a < argc; a++) {
+        if ((strcmp(argv[a], "-r") == 0 || strcmp(argv[a], "--region") == 0) && a + 1 < argc) {
+            if (parse_uint(argv[++a], TM_STATS_MAX_STREAMS - 1, &region) != 0)
+                return 1;
+        } else if (strcmp(argv[a], "-a") == 0 || strcmp(argv[a], "--all") == 0) {
+            from_start = true;
+        } else if (strcmp(argv[a], "-1") == 0 || strcmp(argv[a], "--once") == 0) {
+            once = true;
+            from_start = true;
+        } else if (strcmp(argv[a], "-h") == 0 || strcmp(argv[a], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[a]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    pfd.fd = open(TM_DEVICE_PATH, O_RDONLY | O_CLOEXEC);
+    if (pfd.fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", TM_DEVICE_PATH, strerror(errno));
+        return 1;
+    }
+    pfd.events = POLLIN;
+
+    shm_fd = ioctl(pfd.fd, TM_IOC_SHM_FD);
+    if (shm_fd < 0) {
+        if (errno == ENODEV)
+            fprintf(stderr, "Shared-memory log is disabled: load the module with shm_kb=N\n");
+        else
+            fprintf(stderr, "TM_IOC_SHM_FD failed: %s\n", strerror(errno));
+        close(pfd.fd);
+        return 1;
+    }
+
+    if (fstat(shm_fd, &st) != 0 || st.st_size < (off_t)sizeof(*hdr)) {
+        fprintf(stderr, "Unexpected shared-memory log size\n");
+        close(shm_fd);
+        close(pfd.fd);
+        return 1;
+    }
+
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Failed to map shared-memory log: %s\n", strerror(errno));
+        close(pfd.fd);
+        return 1;
+    }
+
+    hdr = (const struct tm_shm_header *)base;
+    if (!check_header(hdr, st.st_size)) {
+        fprintf(stderr, "Unsupported shared-memory log format\n");
+        ret = 1;
+        goto out_unmap;
+    }
+
+    if (region != UINT32_MAX && region >= hdr->nr_regions) {
+        fprintf(stderr, "Error: The log has %u regions\n", hdr->nr_regions);
+        ret = 1;
+        goto out_unmap;
+    }
+    first = region == UINT32_MAX ? 0 : region;
+    last = region == UINT32_MAX ? hdr->nr_regions - 1 : region;
+
+    memset(readers, 0, sizeof(readers));
+    for (i = first; i <= last; i++) {
+        uint64_t head = __atomic_load_n(&hdr->regions[i].head, __ATOMIC_ACQUIRE);
+        uint64_t size = hdr->regions[i].size;
+
+        if (!from_start)
+            readers[i].cursor = head;
+        else if (head > size)
+            readers[i].cursor = head - size;
+        /* Кольцо уже переполнялось: первая запись может быть оборвана */
+        readers[i].resync = from_start && head > size;
+        if (size > max_size)
+            max_size = size;
+    }
+
+    copy = malloc((size_t)max_size);
+    if (!copy) {
+        fprintf(stderr, "Failed to allocate %llu bytes\n", (unsigned long long)max_size);
+        ret = 1;
+        goto out_unmap;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stop) {
+        for (i = first; i <= last; i++) {
+            if (drain(base, i, &readers[i], copy) != 0) {
+                ret = errno == EPIPE ? 0 : 1;
+                goto out_free;
+            }
+        }
+        if (fflush(stdout) != 0) {
+            ret = errno == EPIPE ? 0 : 1;
+            break;
+        }
+
+        if (once)
+            break;
+
+        /* Каждый сброс writer'а меняет поколение статистики и будит poll() */
+        if (poll(&pfd, 1, WAKEUP_MS) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            ret = 1;
+            break;
+        }
+        if ((pfd.revents & POLLIN) && read(pfd.fd, &gen, sizeof(gen)) < 0 && errno != EINTR) {
+            fprintf(stderr, "Failed to read %s: %s\n", TM_DEVICE_PATH, strerror(errno));
+            ret = 1;
+            break;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            fprintf(stderr, "%s: device reported an error\n", TM_DEVICE_PATH);
+            break;
+        }
+    }
+
+out_free:
+    free(copy);
+out_unmap:
+    munmap(base, (size_t)st.st_size);
+    close(pfd.fd);
+    return ret;
+}
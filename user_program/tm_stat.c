@@ -0,0 +1,48 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tm_stats.h"
+
+/* Печатает снимок страницы статистики test_module */
+int main(void)
+{
+    tm_stats_t stats = { .fd = -1, .page = NULL };
+    struct tm_stats_stream s;
+    unsigned int i;
+    int b;
+
+    if (tm_stats_open(&stats) != 0) {
+        fprintf(stderr, "Failed to map %s: %s\n", TM_DEVICE_PATH, strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < tm_stats_nr_streams(&stats); i++) {
+        if (tm_stats_read_stream(&stats, i, &s) != 0) {
+            fprintf(stderr, "Failed to read stream %u: %s\n", i, strerror(errno));
+            continue;
+        }
+
+        printf("stream %u: writes=%llu accepted=%llu dropped=%llu overflow=%llu "
+               "bytes=%llu write_errors=%llu flushes=%llu last_seq=%llu "
+               "last_write_ns=%llu write_lat_us=%u\n",
+               i, (unsigned long long)s.write_counter, (unsigned long long)s.accepted,
+               (unsigned long long)s.dropped, (unsigned long long)s.overflow,
+               (unsigned long long)s.bytes_written, (unsigned long long)s.write_errors,
+               (unsigned long long)s.flushes, (unsigned long long)s.last_seq,
+               (unsigned long long)s.last_write_ns, s.write_lat_us);
+
+        printf("  latency:");
+        for (b = 0; b < TM_LAT_BUCKETS; b++) {
+            if (s.lat_hist[b])
+                printf(" <%lluus=%llu", 1ULL << b, (unsigned long long)s.lat_hist[b]);
+        }
+        printf("\n");
+    }
+
+    tm_stats_close(&stats);
+    return 0;
+}
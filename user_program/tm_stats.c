@@ -0,0 +1,135 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "tm_stats.h"
+
+#define TM_STATS_MAX_RETRIES 1000
+
+static const void *tm_map_page(int fd, unsigned long pgoff)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    void *addr;
+
+    addr = mmap(NULL, (size_t)page_size, PROT_READ, MAP_SHARED, fd, (off_t)(pgoff * page_size));
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+int tm_stats_open(tm_stats_t *stats)
+{
+    if (!stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    stats->page = NULL;
+    stats->heartbeat = NULL;
+
+    stats->fd = open(TM_DEVICE_PATH, O_RDONLY | O_CLOEXEC);
+    if (stats->fd < 0) {
+        return -1;
+    }
+
+    stats->page = tm_map_page(stats->fd, TM_STATS_PGOFF);
+    stats->heartbeat = tm_map_page(stats->fd, TM_HEARTBEAT_PGOFF);
+    if (!stats->page || !stats->heartbeat) {
+        int err = errno;
+
+        tm_stats_close(stats);
+        errno = err;
+        return -1;
+    }
+
+    if (stats->page->magic != TM_STATS_MAGIC || stats->page->version != TM_STATS_VERSION ||
+        stats->heartbeat->magic != TM_HEARTBEAT_MAGIC ||
+        stats->heartbeat->version != TM_HEARTBEAT_VERSION) {
+        tm_stats_close(stats);
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+void tm_stats_close(tm_stats_t *stats)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (!stats) {
+        return;
+    }
+
+    if (stats->page) {
+        munmap((void *)stats->page, page_size);
+        stats->page = NULL;
+    }
+
+    if (stats->heartbeat) {
+        munmap((void *)stats->heartbeat, page_size);
+        stats->heartbeat = NULL;
+    }
+
+    if (stats->fd >= 0) {
+        close(stats->fd);
+        stats->fd = -1;
+    }
+}
+
+unsigned int tm_stats_nr_streams(const tm_stats_t *stats)
+{
+    return stats && stats->page ? stats->page->nr_streams : 0;
+}
+
+/* Копирует запись потока, повторяя чтение, пока ядро обновляет ее (seq нечетный или изменился) */
+static int tm_read_seq(const __u32 *seq, void *out, size_t size)
+{
+    __u32 begin;
+    __u32 end;
+    int retries;
+
+    for (retries = 0; retries < TM_STATS_MAX_RETRIES; retries++) {
+        begin = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (begin & 1) {
+            continue;
+        }
+
+        memcpy(out, (const void *)seq, size);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        end = __atomic_load_n(seq, __ATOMIC_RELAXED);
+        if (begin == end) {
+            return 0;
+        }
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+int tm_stats_read_stream(const tm_stats_t *stats, unsigned int stream,
+                         struct tm_stats_stream *out)
+{
+    if (!stats || !stats->page || !out || stream >= tm_stats_nr_streams(stats)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return tm_read_seq(&stats->page->streams[stream].seq, out, sizeof(*out));
+}
+
+int tm_heartbeat_read(const tm_stats_t *stats, unsigned int stream,
+                      struct tm_heartbeat_stream *out)
+{
+    if (!stats || !stats->heartbeat || !out || stream >= stats->heartbeat->nr_streams) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return tm_read_seq(&stats->heartbeat->streams[stream].seq, out, sizeof(*out));
+}
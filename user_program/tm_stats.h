@@ -0,0 +1,28 @@
+#ifndef TM_STATS_H
+#define TM_STATS_H
+
+#include "test_module_uapi.h"
+
+/*
+ * Чтение страниц статистики и heartbeat test_module без системных
+ * вызовов: tm_stats_open() один раз отображает страницы, дальше
+ * tm_stats_read_stream()/tm_heartbeat_read() копируют согласованный
+ * снимок потока. Пока страницы отображены (до tm_stats_close()),
+ * модуль нельзя выгрузить: rmmod завершится с EBUSY.
+ */
+
+typedef struct {
+    int fd;
+    const struct tm_stats_page *page;
+    const struct tm_heartbeat_page *heartbeat;
+} tm_stats_t;
+
+int tm_stats_open(tm_stats_t *stats);
+void tm_stats_close(tm_stats_t *stats);
+unsigned int tm_stats_nr_streams(const tm_stats_t *stats);
+int tm_stats_read_stream(const tm_stats_t *stats, unsigned int stream,
+                         struct tm_stats_stream *out);
+int tm_heartbeat_read(const tm_stats_t *stats, unsigned int stream,
+                      struct tm_heartbeat_stream *out);
+
+#endif /* TM_STATS_H */
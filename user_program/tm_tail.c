@@ -0,0 +1,359 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <signal.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+
+/*
+ * tail -f для лога test_module без копирования через пространство
+ * пользователя: новые байты передаются splice() в stdout-канал или
+ * sendfile() в файл/сокет, пробуждения - по inotify. Следует за ротацией
+ * (файл переименован/удален и создан заново) и, если путь не задан -f,
+ * за сменой параметра filename.
+ */
+
+#define SYSFS_FILENAME "/sys/module/test_module/parameters/filename"
+#define CHUNK_BYTES (1024 * 1024)
+#define FILENAME_CHECK_MS 1000
+
+typedef enum {
+    COPY_SPLICE,
+    COPY_SENDFILE,
+    COPY_READ,
+} copy_mode_t;
+
+typedef struct {
+    char path[PATH_MAX];
+    int fd;
+    ino_t ino;
+    off_t offset;
+    int dir_wd;
+    int file_wd;
+} tail_file_t;
+
+static volatile sig_atomic_t stop;
+
+static void print_usage(const char *prog_name)
+{
+    printf("Usage: %s [OPTIONS]\n", prog_name);
+    printf("\nOptions:\n");
+    printf("  -f, --file PATH        File to follow (default: the module's filename parameter)\n");
+    printf("  -s, --stream N         Follow stream N (<filename>.N for N > 0)\n");
+    printf("  -c, --bytes N          Start N bytes before the end (default: 0)\n");
+    printf("  -a, --all              Start from the beginning of the file\n");
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static int parse_ulong(const char *str, unsigned long max, unsigned long *out)
+{
+    char *endptr;
+    unsigned long value;
+
+    errno = 0;
+    value = strtoul(str, &endptr, 10);
+    if (endptr == str || *endptr != '\0' || errno == ERANGE || value > max) {
+        fprintf(stderr, "Error: Invalid value %s\n", str);
+        return -1;
+    }
+
+    *out = value;
+    return 0;
+}
+
+/* Путь потока так же, как его строит модуль: поток 0 - filename, N - filename.N */
+static int module_path(unsigned int stream, char *path, size_t size)
+{
+    char value[PATH_MAX];
+    ssize_t n;
+    int fd;
+
+    fd = open(SYSFS_FILENAME, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    n = read(fd, value, sizeof(value) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+
+    while (n > 0 && value[n - 1] == '\n')
+        n--;
+    value[n] = '\0';
+
+    if (stream == 0)
+        snprintf(path, size, "%s", value);
+    else
+        snprintf(path, size, "%s.%u", value, stream);
+    return 0;
+}
+
+static void tail_close(tail_file_t *tf, int in_fd)
+{
+    if (tf->file_wd >= 0) {
+        inotify_rm_watch(in_fd, tf->file_wd);
+        tf->file_wd = -1;
+    }
+    if (tf->dir_wd >= 0) {
+        inotify_rm_watch(in_fd, tf->dir_wd);
+        tf->dir_wd = -1;
+    }
+    if (tf->fd >= 0) {
+        close(tf->fd);
+        tf->fd = -1;
+    }
+}
+
+/*
+ * Каталог наблюдается всегда: так видно создание файла после ротации,
+ * даже если файла еще нет. Сам файл - пока он открыт.
+ */
+static int tail_open(tail_file_t *tf, int in_fd, off_t start_back, bool from_start)
+{
+    char dir[PATH_MAX];
+    struct stat st;
+
+    snprintf(dir, sizeof(dir), "%s", tf->path);
+    tf->dir_wd = inotify_add_watch(in_fd, dirname(dir), IN_CREATE | IN_MOVED_TO);
+    if (tf->dir_wd < 0) {
+        fprintf(stderr, "Failed to watch directory of %s: %s\n", tf->path, strerror(errno));
+        return -1;
+    }
+
+    tf->fd = open(tf->path, O_RDONLY | O_CLOEXEC);
+    if (tf->fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "Failed to open %s: %s\n", tf->path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(tf->fd, &st) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", tf->path, strerror(errno));
+        return -1;
+    }
+
+    tf->ino = st.st_ino;
+    if (from_start)
+        tf->offset = 0;
+    else
+        tf->offset = st.st_size > start_back ? st.st_size - start_back : 0;
+
+    tf->file_wd = inotify_add_watch(in_fd, tf->path,
+                                    IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+    if (tf->file_wd < 0) {
+        fprintf(stderr, "Failed to watch %s: %s\n", tf->path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Путь указывает на другой inode (ротация) или файл появился */
+static bool tail_rotated(const tail_file_t *tf)
+{
+    struct stat st;
+
+    if (stat(tf->path, &st) != 0)
+        return false;
+
+    return tf->fd < 0 || st.st_ino != tf->ino;
+}
+
+static ssize_t copy_chunk(copy_mode_t *mode, int fd, off_t *offset, size_t len)
+{
+    static char buf[64 * 1024];
+    ssize_t n;
+
+    switch (*mode) {
+    case COPY_SPLICE:
+        n = splice(fd, offset, STDOUT_FILENO, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        break;
+    case COPY_SENDFILE:
+        n = sendfile(STDOUT_FILENO, fd, offset, len);
+        break;
+    default:
+        n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), *offset);
+        if (n > 0) {
+            n = write(STDOUT_FILENO, buf, (size_t)n);
+            if (n > 0)
+                *offset += n;
+        }
+        return n;
+    }
+
+    /* Например, sendfile() в терминал: переходим на обычное копирование */
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        *mode = COPY_READ;
+        return copy_chunk(mode, fd, offset, len);
+    }
+
+    return n;
+}
+
+/* Передает все, что появилось после offset; файл мог быть усечен */
+static int tail_drain(tail_file_t *tf, copy_mode_t *mode)
+{
+    struct stat st;
+    ssize_t n;
+
+    if (tf->fd < 0)
+        return 0;
+
+    if (fstat(tf->fd, &st) != 0)
+        return -1;
+
+    if (st.st_size < tf->offset) {
+        fprintf(stderr, "%s: file truncated\n", tf->path);
+        tf->offset = 0;
+    }
+
+    while (tf->offset < st.st_size) {
+        size_t len = (size_t)(st.st_size - tf->offset);
+
+        n = copy_chunk(mode, tf->fd, &tf->offset, len < CHUNK_BYTES ? len : CHUNK_BYTES);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EPIPE)
+                fprintf(stderr, "Failed to copy from %s: %s\n", tf->path, strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+            break;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    tail_file_t tf = { .fd = -1, .dir_wd = -1, .file_wd = -1 };
+    const char *fixed_path = NULL;
+    unsigned long stream = 0;
+    unsigned long start_back = 0;
+    bool from_start = false;
+    char path[PATH_MAX];
+    copy_mode_t mode;
+    struct sigaction sa;
+    struct pollfd pfd;
+    struct stat st;
+    ssize_t n;
+    int ret = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--file") == 0) && i + 1 < argc) {
+            fixed_path = argv[++i];
+        } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--stream") == 0) && i + 1 < argc) {
+            if (parse_ulong(argv[++i], 7, &stream) != 0)
+                return 1;
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--bytes") == 0) && i + 1 < argc) {
+            if (parse_ulong(argv[++i], LONG_MAX, &start_back) != 0)
+                return 1;
+        } else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--all") == 0) {
+            from_start = true;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (fixed_path) {
+        snprintf(tf.path, sizeof(tf.path), "%s", fixed_path);
+    } else if (module_path((unsigned int)stream, tf.path, sizeof(tf.path)) != 0) {
+        fprintf(stderr, "Failed to read %s: is test_module loaded?\n", SYSFS_FILENAME);
+        return 1;
+    }
+
+    /* Канал - splice(), остальное - sendfile() с откатом на read()/write() */
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode))
+        mode = COPY_SPLICE;
+    else
+        mode = COPY_SENDFILE;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pfd.fd = inotify_init1(IN_CLOEXEC);
+    if (pfd.fd < 0) {
+        fprintf(stderr, "inotify_init1 failed: %s\n", strerror(errno));
+        return 1;
+    }
+    pfd.events = POLLIN;
+
+    if (tail_open(&tf, pfd.fd, (off_t)start_back, from_start) != 0) {
+        ret = 1;
+        goto out;
+    }
+
+    while (!stop) {
+        if (tail_drain(&tf, &mode) != 0) {
+            ret = errno == EPIPE ? 0 : 1;
+            break;
+        }
+
+        /* Таймаут нужен только для проверки параметра filename: sysfs не поддерживает inotify */
+        n = poll(&pfd, 1, fixed_path ? -1 : FILENAME_CHECK_MS);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            ret = 1;
+            break;
+        }
+
+        if (n > 0 && read(pfd.fd, events, sizeof(events)) < 0 && errno != EINTR) {
+            fprintf(stderr, "Failed to read inotify events: %s\n", strerror(errno));
+            ret = 1;
+            break;
+        }
+
+        if (!fixed_path && module_path((unsigned int)stream, path, sizeof(path)) == 0 &&
+            strcmp(path, tf.path) != 0) {
+            /* Модуль пишет в новый файл: дочитываем старый и переключаемся на начало нового */
+            tail_drain(&tf, &mode);
+            tail_close(&tf, pfd.fd);
+            snprintf(tf.path, sizeof(tf.path), "%s", path);
+            fprintf(stderr, "==> following %s <==\n", tf.path);
+            if (tail_open(&tf, pfd.fd, 0, true) != 0) {
+                ret = 1;
+                break;
+            }
+        } else if (tail_rotated(&tf)) {
+            tail_drain(&tf, &mode);
+            tail_close(&tf, pfd.fd);
+            if (tail_open(&tf, pfd.fd, 0, true) != 0) {
+                ret = 1;
+                break;
+            }
+        }
+    }
+
+out:
+    tail_close(&tf, pfd.fd);
+    close(pfd.fd);
+    return ret;
+}